@@ -75,11 +75,17 @@ typedef unsigned long  ulong;
 #define NDATA          90              // Number of data bytes in a block
 #define MAXSIZE        0x0FFFFF80      // Maximal (theoretical) length of file
 #define SUPERBLOCK     0xFFFFFFFF      // Address of superblock
+#define EXTBLOCK       0xFFFFFFFE      // Address of superblock extension
+#define EXTVERSION     1               // Version of superblock extension
+#define MAXEXTSIZE     0x2000000000ULL // Maximal length with extended address
 
 #define NGROUP         5               // For NGROUP blocks (1..15), 1 recovery
 #define NGROUPMIN      2
 #define NGROUPMAX      10
 
+#define NPARMAX        15              // Max parity pages per stripe
+#define NSTRIPEPAGE    240             // Max data pages per stripe
+
 typedef struct __attribute__ ((packed)) t_data { // Block on paper
   uint32_t          addr;                 // Offset of the block or special code
   uchar          data[NDATA];          // Useful data
@@ -92,6 +98,11 @@ _Static_assert(sizeof(t_data)==128, "t_data not 128 bytes long");
 
 #define PBM_COMPRESSED 0x01            // Paper backup is compressed
 #define PBM_ENCRYPTED  0x02            // Paper backup is encrypted
+#define PBM_MULTISTREAM 0x04           // Compressed as independent streams
+#define PBM_PAGEPARITY 0x08            // Parity pages follow data pages
+#define PBM_COLUMNGROUPS 0x10          // Blocks are grouped also along strings
+#define PBM_EXTADDR    0x20            // Addresses are relative to the page
+#define PBM_ARCHIVE    0x40            // Data is archive of several files
 
 // FILETIME is 64-bit data type, time_t typically 64-bit, but was 32-bit in
 // older *NIX versions.  Assertion failure is likely due to this.  128 bytes
@@ -115,19 +126,39 @@ _Static_assert(sizeof(t_superdata)==sizeof(t_data),
                       "t_superdata is not the same size as t_data");
 #endif
 
+// Files longer than MAXSIZE don't fit into 28-bit block address. They are
+// printed in PBM_EXTADDR mode: addresses on paper are relative to the page,
+// and every page, besides superblocks, contains extensions with full sizes,
+// page number and offset of the page. Superblock keeps low bits only.
+typedef struct __attribute__ ((packed)) t_extdata { // Superblock extension
+  uint32_t       addr;                 // Expecting EXTBLOCK
+  uint32_t       version;              // Expecting EXTVERSION
+  uint64_t       datasize;             // Size of (compressed) data
+  uint64_t       origsize;             // Size of original (uncompressed) data
+  uint64_t       base;                 // Offset of the page in data
+  uint32_t       page;                 // Actual page (1-based)
+  uchar          reserved[58];         // Reserved, set to 0
+  ushort         crc;                  // Cyclic redundancy of previous fields
+  uchar          ecc[ECC_SIZE];        // Reed-Solomon's error correction code
+} t_extdata;
+#ifdef __linux__
+_Static_assert(sizeof(t_extdata)==sizeof(t_data),
+                      "t_extdata is not the same size as t_data");
+#endif
+
 typedef struct t_block {               // Block in memory
-  uint32_t       addr;                 // Offset of the block
+  uint64_t       addr;                 // Offset of the block
   uint32_t       recsize;              // 0 for data, or length of covered data
   uchar          data[NDATA];          // Useful data
 } t_block;
 
 typedef struct t_superblock {          // Identification block in memory
   uint32_t       addr;                 // Expecting SUPERBLOCK
-  uint32_t       datasize;             // Size of (compressed) data
+  uint64_t       datasize;             // Size of (compressed) data
   uint32_t       pagesize;             // Size of (compressed) data on page
-  uint32_t       origsize;             // Size of original (uncompressed) data
+  uint64_t       origsize;             // Size of original (uncompressed) data
   uint32_t       mode;                 // Special mode bits, set of PBM_xxx
-  ushort         page;                 // Actual page (1-based)
+  uint32_t       page;                 // Actual page (1-based)
   FileTimePortable modified;           // last modify time
   uint32_t       attributes;           // Basic file attributes
   uint32_t       filecrc;              // 16-bit CRC of decrypted packed file
@@ -140,6 +171,8 @@ typedef struct t_superblock {          // Identification block in memory
 ///////////////////////////////////// CRC //////////////////////////////////////
 
 ushort Crc16(uchar *data,int length);
+ushort Updatecrc16(ushort crc,uchar *data,int length);
+uint32_t Crc32(uchar *data,uint32_t length);
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -148,11 +181,56 @@ ushort Crc16(uchar *data,int length);
 void   Encode8(uchar *data,uchar *parity,int pad);
 int    Decode8(uchar *data, int *eras_pos, int no_eras,int pad);
 
+extern uchar rs_alpha[];               // Powers of primitive element, GF(256)
+extern uchar rs_index[];               // Logarithms, rs_index[0] is 255
+
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////// PAGE PARITY //////////////////////////////////
+
+int    Paritystripes(int npages);
+uchar  Paritycoef(int row,int index);
+void   Gfmuladd(uchar *dst,uchar *src,uchar c,uint32_t n);
+int    Gfinvertmatrix(uchar *a,int n);
+void   Encodeparitypage(uchar *parity,uchar *data,uint64_t datasize,
+         uint32_t pagesize,int npages,int q);
+
+
+////////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////// PDF //////////////////////////////////////
+
+typedef struct t_pdf {                 // PDF file being written
+  FILE           *f;                   // Output file
+  long           *offset;              // File offsets of objects
+  int            nobj;                 // Number of objects, including 0
+  int            maxobj;               // Size of offset, entries
+  int            npage;                // Number of pages written so far
+} t_pdf;
+
+uint32_t Encodeg4(uchar *bits,int width,int height,uchar **out);
+uint32_t Encoderaw(uchar *bits,int width,int height,uchar **out);
+int    Pdfopen(t_pdf *pdf,char *path);
+int    Pdfaddpage(t_pdf *pdf,uchar *image,uint32_t length,int g4,
+         int width,int height,int ppix,int ppiy,int pagex,int pagey,
+         int left,int top);
+int    Pdfclose(t_pdf *pdf);
+void   Pdfabort(t_pdf *pdf);
+
 
 ////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////// PRINTER ////////////////////////////////////
 
 #define PACKLEN        65536           // Length of data read buffer 64 K
+#define SEGLEN         0x100000        // Uncompressed size of bzip2 stream
+#define NPROBE         8               // Number of compressibility samples
+#define PROBELEN       16384           // Length of compressibility sample
+#define BMPCHUNK       0x400000        // Approximate size of bitmap read chunk
+
+#define FMT_BMP        0               // 8-bit grayscale bitmap
+#define FMT_BMP1       1               // 1-bit black and white bitmap
+#define FMT_PDF        2               // Multipage PDF with G4 images
+#define FMT_PGM        3               // 8-bit PGM (binary PNM)
+#define FMT_PBM        4               // 1-bit PBM (binary PNM)
 
 typedef struct t_printdata {           // Print control structure
   int            step;                 // Next data printing step (0 - idle)
@@ -161,18 +239,28 @@ typedef struct t_printdata {           // Print control structure
   FILE           *hfile;               // (Formerly HANDLE) file pointer
   FileTimePortable modified;           // last modify time
   uint32_t       attributes;           // File attributes
-  uint32_t       origsize;             // Original file size, bytes
-  uint32_t       readsize;             // Amount of data read from file so far
-  uint32_t       datasize;             // Size of (compressed) data
-  uint32_t       alignedsize;          // Data size aligned to next 16 bytes
+  uint64_t       origsize;             // Original file size, bytes
+  uint64_t       readsize;             // Amount of data read from file so far
+  uint64_t       datasize;             // Size of (compressed) data
+  uint64_t       alignedsize;          // Data size aligned to next 16 bytes
   uint32_t       pagesize;             // Size of (compressed) data on page
-  int            compression;          // 0: none, 1: fast, 2: maximal
+  int            ndatapages;           // Number of pages with data
+  int            npages;               // Total number of pages, with parity
+  int            compression;          // 0: none, 1: fast, 2: maximal, 3: auto
+  int            multistream;          // Compressed as independent streams
+  int            threads;              // Number of worker threads
+  int            format;               // Output format, one of FMT_xxx
   int            encryption;           // 0: none, 1: encrypt
   int            printheader;          // Print header and footer
   int            printborder;          // Print border around bitmap
   int            redundancy;           // Redundancy
+  int            pageparity;           // Parity pages per stripe, 0: none
+  int            columngroups;         // Add recovery blocks along strings
+  int            archive;              // Input is archive of several files
   uchar          *buf;                 // Buffer for compressed file
-  uint32_t       bufsize;              // Size of buf, bytes
+  uchar          *parity;              // Parity pages or NULL
+  uchar          *map;                 // Input file mapped into memory
+  uint64_t       bufsize;              // Size of buf, bytes
   uchar          *readbuf;             // Read buffer, PACKLEN bytes long
   bz_stream      bzstream;             // Compression control structure
   int            bufcrc;               // 16-bit CRC of (packed) data in buf
@@ -184,6 +272,8 @@ typedef struct t_printdata {           // Print control structure
   int            ppiy;                 // Printer Y resolution, pixels per inch
   int            width;                // Page width, pixels
   int            height;               // Page height, pixels
+  int            paperwidth;           // Paper width, pixels
+  int            paperheight;          // Paper height, pixels
   //HFONT          hfont6;               // Font 1/6 inch high
   //HFONT          hfont10;              // Font 1/10 inch high
   int            extratop;             // Height of title line, pixels
@@ -201,6 +291,13 @@ typedef struct t_printdata {           // Print control structure
   //HBITMAP        hbmp;                 // Handle of memory bitmap
   uchar          *dibbits;             // Pointer to DIB bits
   uchar          *drawbits;            // Pointer to file bitmap bits
+  int            npagebuf;             // Number of page bitmaps in drawbits
+  uchar          *dotspan;             // 256 pre-rasterised spans of 8 dots
+  uchar          *templbits;           // Static part of the full page
+  uchar          *shortbits;           // Static part of the shorter last page
+  int            fullny;               // Number of rows on the full page
+  int            shortny;              // Number of rows on the last page
+  t_pdf          pdf;                  // PDF output, if format is FMT_PDF
   uchar          bmi[sizeof(BITMAPINFO)+256*sizeof(RGBQUAD)]; // Bitmap info
   int            startdoc;             // Print job started
 } t_printdata;
@@ -228,6 +325,7 @@ typedef struct t_procdata {            // Descriptor of processed data
   uchar          *data;                // Pointer to bitmap
   int            sizex;                // X bitmap size, pixels
   int            sizey;                // Y bitmap size, pixels
+  int            reduction;            // Bitmap reduction factor (0: unknown)
   int            gridxmin,gridxmax;    // Rought X grid limits, pixels
   int            gridymin,gridymax;    // Rought Y grid limits, pixels
   int            searchx0,searchx1;    // X grid search limits, pixels
@@ -235,6 +333,7 @@ typedef struct t_procdata {            // Descriptor of processed data
   int            cmean;                // Mean grid intensity (0..255)
   int            cmin,cmax;            // Minimal and maximal grid intensity
   float          sharpfactor;          // Estimated sharpness correction factor
+  int            lastgood;             // Last good recognition combination
   float          xpeak;                // Base X grid line, pixels
   float          xstep;                // X grid step, pixels
   float          xangle;               // X tilt, radians
@@ -253,7 +352,12 @@ typedef struct t_procdata {            // Descriptor of processed data
   int            nposy;                // Number of blocks to scan in X
   int            posx,posy;            // Next block to scan
   t_data         uncorrected;          // Data before ECC for block display
-  t_block        *blocklist;           // List of blocks recognized on page
+  t_block        *blocklist;           // Blocks preceding superblock on page
+  int            labelled;             // Page label is complete
+  t_extdata      extdata;              // Superblock extension, if any
+  uint64_t       pagebase;             // Offset of the page in extended mode
+  int            fileindex;            // Index of processed file or -1
+  uint32_t       fileserial;           // Serial number of processed file
   t_superblock   superblock;           // Page header
   int            maxdotsize;           // Maximal size of the data dot, pixels
   int            orientation;          // Data orientation (-1: unknown)
@@ -264,6 +368,7 @@ typedef struct t_procdata {            // Descriptor of processed data
 } t_procdata;
 
 int       pb_orientation;          // Orientation of bitmap (-1: unknown)
+int       pb_decodescale;          // Bitmap reduction (0: auto, 1: never)
 t_procdata pb_procdata;            // Descriptor of processed data
 
 void   Nextdataprocessingstep(t_procdata *pdata);
@@ -271,75 +376,184 @@ void   Freeprocdata(t_procdata *pdata);
 void   Startbitmapdecoding(t_procdata *pdata,uchar *data,int sizex,int sizey);
 void   Stopbitmapdecoding(t_procdata *pdata);
 int    Decodeblock(t_procdata *pdata,int posx,int posy,t_data *result);
+void   Decodegrids(uchar *data,int sizex,int sizey);
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////// FILE PROCESSOR ////////////////////////////////
 
-#define NFILE          5               // Max number of simultaneous files
+#define NFILE          16              // Initial size of file table
+#define FPROCMEM       0x1000000       // Max data kept in memory per file
+
+typedef struct t_recblock {            // Recovery block of unfinished page
+  int            group;                // Index of the first block in group
+  int            ngroup;               // Number of blocks in group
+  int            stride;               // Distance between blocks in group
+  int            page;                 // Page that owns the block, 0: none
+  uchar          data[NDATA];          // Recovery data
+} t_recblock;
 
 typedef struct t_fproc {               // Descriptor of processed file
   int            busy;                 // In work
+  uint32_t       hash;                 // Hash of file identity
+  uint32_t       serial;               // Unique number of the descriptor
+  int            next;                 // Next slot in hash chain or free list
+  FILE           *spill;               // Temporary file with data or NULL
   // General file data.
   char           name[64];             // File name - may have all 64 chars
   FileTimePortable modified;           // last modify time
   uint32_t       attributes;           // Basic file attrributes
-  uint32_t       datasize;             // Size of (compressed) data
+  uint64_t       datasize;             // Size of (compressed) data
   uint32_t       pagesize;             // Size of (compressed) data on page
-  uint32_t       origsize;             // Size of original (uncompressed) data
+  uint64_t       origsize;             // Size of original (uncompressed) data
   uint32_t       mode;                 // Special mode bits, set of PBM_xxx
   int            npages;               // Total number of pages
   uint32_t       filecrc;              // 16-bit CRC of decrypted packed file
   // Properties of currently processed page.
   int            page;                 // Currently processed page
   int            ngroup;               // Actual NGROUP on the page
-  uint32_t       minpageaddr;          // Minimal address of block on page
-  uint32_t       maxpageaddr;          // Maximal address of block on page
   // Gathered data.
   int            nblock;               // Total number of data blocks
   int            ndata;                // Number of decoded blocks so far
-  uchar          *datavalid;           // 0:data invalid, 1:valid, 2:recovery
-  uchar          *data;                // Gathered data
+  uchar          *valid;               // Valid data blocks, bit per block
+  uchar          *data;                // Gathered data, NULL if spilled
+  t_recblock     *rec;                 // Recovery blocks of unfinished pages
+  int            nrec;                 // Number of recovery blocks in rec
+  int            maxrec;               // Size of rec, blocks
+  uchar          *saved;               // Blocks in checkpoint, bit per block
+  int            nalloc;               // Blocks in storage, data and parity
+  int            nparity;              // Parity pages with allocated storage
   // Statistics.
   int            goodblocks;           // Total number of good blocks read
   int            badblocks;            // Total number of unreadable blocks
   uint32_t       restoredbytes;        // Total number of bytes restored by ECC
   int            recoveredblocks;      // Total number of recovered blocks
-  int            rempages[8];          // 1-based list of remaining pages
+  uchar          *pagedone;            // Complete pages, bit per page
+  int            ncolumn;              // Columns in printed grid, 0: unknown
+  int            member;               // TOC index of --extract file+1 or 0
 } t_fproc;
 
-t_fproc   pb_fproc[NFILE];             // Processed file
+t_fproc   *pb_fproc;                   // Processed files, grows as necessary
+int       pb_nfproc;                   // Number of entries in pb_fproc
 
 void   Closefproc(int slot);
 int    Startnextpage(t_superblock *superblock);
-int    Addblock(t_block *block,int slot);
-int    Finishpage(int slot,int ngood,int nbad,uint32_t nrestored);
+int    Addblock(t_block *block,int slot,int page);
+int    Finishpage(int slot,int page,int ngood,int nbad,uint32_t nrestored);
 int    Saverestoredfile(int slot,int force);
+int    Pagecomplete(t_superblock *superblock);
+int    Readfprocdata(t_fproc *pf,uint64_t offset,uint32_t length,uchar *buf);
+int    Writefprocdata(t_fproc *pf,uint64_t offset,uchar *data,uint32_t length);
+void   Prefetchkey(uchar *salt);
+int    Getkey(uchar *salt,uchar *key);
+void   Forgetkey(uchar *salt);
+void   Clearkeycache(void);
+
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////////// CHECKPOINT AND SHARDS /////////////////////////////
+
+int    Isfiledone(t_superblock *sb);
+void   Checkpointpage(int slot);
+void   Checkpointdone(int slot);
+int    Newcheckpoint(void);
+int    Resumecheckpoint(void);
+void   Closecheckpoint(void);
+void   Emitshard(t_superblock *superblock,t_block *block,int nblock);
+int    Mergeshards(int nshard,char **shard);
+
+
+////////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////// REPORT ////////////////////////////////////
+
+void   Writereport(int final);
+void   Listincomplete(void);
+
+
+////////////////////////////////////////////////////////////////////////////////
+/////////////////////////////////// ARCHIVE ////////////////////////////////////
+
+#define ARCHMAGIC      0x52414250      // 'PBAR', start of archive
+#define ARCHVERSION    1               // Version of archive format
+#define ARCHNAME       228             // Max length of name in archive, with 0
+#define MAXARCHFILE    65536           // Max number of files in archive
+
+typedef struct __attribute__ ((packed)) t_archhead { // Start of archive
+  uint32_t       magic;                // Expecting ARCHMAGIC
+  uint32_t       version;              // Expecting ARCHVERSION
+  uint32_t       nfile;                // Number of files in TOC
+  uint32_t       tocsize;              // Header and TOC, multiple of NDATA
+} t_archhead;
+
+typedef struct __attribute__ ((packed)) t_archentry { // Entry of TOC
+  uint64_t       offset;               // Offset of file data in archive
+  uint64_t       size;                 // Size of file, bytes
+  FileTimePortable modified;           // last modify time
+  uint32_t       mode;                 // Access rights, POSIX bits
+  char           name[ARCHNAME];       // Relative path, '/' as separator
+} t_archentry;
+#ifdef __linux__
+_Static_assert(sizeof(t_archentry)==256, "t_archentry not 256 bytes long");
+#endif
+
+int    Isdirectory(const char *path);
+int    Buildarchive(t_printdata *print);
+int    Extractarchive(t_fproc *pf,FILE *f);
+int    Extractselected(int slot);
+int    Pageneeded(t_fproc *pf,int page);
 
 
 ////////////////////////////////////////////////////////////////////////////////
 /////////////////////////////////// SCANNER ////////////////////////////////////
 
+#define CH_AVG         0               // Average of red, green and blue
+#define CH_LUMA        1               // Luma (ITU-R BT.601 weights)
+#define CH_GREEN       2               // Green channel only
+#define CH_RED         3               // Red channel only
+#define CH_BLUE        4               // Blue channel only
+
 int    Decodebitmap(char *path);
 
 
 ////////////////////////////////////////////////////////////////////////////////
 //////////////////////////////// USER INTERFACE ////////////////////////////////
 
+#define PWD_PROMPT     0               // Ask for password on terminal
+#define PWD_FD         1               // Read password from file descriptor
+#define PWD_FILE       2               // Read password from file
+#define PWD_ENV        3               // Get password from environment
+
 char      pb_infile[MAXPATH];      // Last selected file to read
 char      pb_outbmp[MAXPATH];      // Last selected bitmap to save
 char      pb_inbmp[MAXPATH];       // Last selected bitmap to read
 char      pb_outfile[MAXPATH];     // Last selected data file to save
  
 char      pb_password[PASSLEN];    // Encryption password
+int       pb_pwdsource;            // Source of password, one of PWD_xxx
+char      pb_pwdarg[MAXPATH];      // Descriptor, file or variable name
+int       pb_pwdvalid;             // Batch password is in pb_password
  
 int       pb_dpi;                  // Dot raster, dots per inch
 int       pb_dotpercent;           // Dot size, percent of dpi
-int       pb_compression;          // 0: none, 1: fast, 2: maximal
+int       pb_compression;          // 0: none, 1: fast, 2: maximal, 3: auto
+int       pb_threads;              // Number of worker threads
+int       pb_multistream;          // Compress as independent streams
+int       pb_format;               // Output format, one of FMT_xxx
+int       pb_channel;              // Colour to gray conversion, one of CH_xxx
+int       pb_stdin;                // Bitmaps are read from standard input
+int       pb_stdout;               // Data goes to stdout, messages to stderr
 int       pb_redundancy;           // Redundancy (NGROUPMIN..NGROUPMAX)
+int       pb_pageparity;           // Parity pages per stripe (0..NPARMAX)
+int       pb_columngroups;         // Group blocks also along strings
 int       pb_printheader;          // Print header and footer
 int       pb_printborder;          // Border around bitmap
 int       pb_autosave;             // Autosave completed files
+int       pb_resume;               // Resume from checkpoint
+int       pb_emitshard;            // Write recognized blocks to shard
+char      pb_report[MAXPATH];      // JSON report of missing data or empty
+char      pb_extract[MAXPATH];     // File to extract from archive or empty
+int       pb_narchive;             // Number of inputs packed into archive
+char      **pb_archive;            // Files and directories to pack
 int       pb_bestquality;          // Determine best quality
 int       pb_encryption;           // Encrypt data before printing
 int       pb_opentext;             // Enter passwords in open text
@@ -365,6 +579,12 @@ int strnicmp (const char *str1, const char *str2, size_t len);
 // returns 0 on success, -1 on failure
 int Getpassword();
 
+// Wipes password, unless it is the batch password that must be reused
+void Clearpassword(void);
+
+// Calls fn(arg,i) for i=0..n-1, distributing calls among nthread threads
+void Parallelfor(int n,int nthread,void (*fn)(void *,int),void *arg);
+
 int max (int a, int b);
 
 int min (int a, int b);
@@ -0,0 +1,633 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// PaperBack -- high density backups on the plain paper                       //
+//                                                                            //
+// Copyright (c) 2007 Oleh Yuschuk                                            //
+// ollydbg at t-online de (set Subject to 'paperback' or be filtered out!)    //
+//                                                                            //
+//                                                                            //
+// This file is part of PaperBack.                                            //
+//                                                                            //
+// Paperback is free software; you can redistribute it and/or modify it under //
+// the terms of the GNU General Public License as published by the Free       //
+// Software Foundation; either version 3 of the License, or (at your option)  //
+// any later version.                                                         //
+//                                                                            //
+// PaperBack is distributed in the hope that it will be useful, but WITHOUT   //
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or      //
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for   //
+// more details.                                                              //
+//                                                                            //
+// You should have received a copy of the GNU General Public License along    //
+// with this program. If not, see <http://www.gnu.org/licenses/>.             //
+//                                                                            //
+//                                                                            //
+// Note that bzip2 compression/decompression library, which is the part of    //
+// this project, is covered by different license, which, in my opinion, is    //
+// compatible with GPL.                                                       //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#endif
+#include <sys/stat.h>
+#include <dirent.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <utime.h>
+#include "FileAttributes.h"
+
+#include "paperbak.h"
+#include "Resource.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Archive of several files. When several files or a directory are encoded,  //
+// they are packed into a single stream that is printed as one file with      //
+// PBM_ARCHIVE mode bit. Stream starts with the table of contents: header and //
+// fixed-size entries with names, sizes, offsets, times and access rights of  //
+// all files. TOC is padded to the whole number of blocks, so that it never   //
+// shares block with the file data. Data of the files follows without gaps.  //
+//                                                                            //
+// If archive is neither compressed nor encrypted, data of each file lies on  //
+// paper at its offset in the archive, and single file requested by --extract //
+// needs only pages that hold TOC and this file.                              //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+typedef struct t_archfile {            // File to pack into archive
+  char           path[MAXPATH];        // Path to the file
+  t_archentry    entry;                // Entry of TOC
+} t_archfile;
+
+typedef struct t_archsrc {             // Source of archive data
+  FILE           *f;                   // Unpacked archive or NULL
+  t_fproc        *pf;                  // Gathered data, if f is NULL
+  uint64_t       size;                 // Size of archive, bytes
+} t_archsrc;
+
+static t_archfile *archfile;           // Files to pack
+static int       narchfile;            // Number of items in archfile
+static int       maxarchfile;          // Allocated size of archfile
+
+// Checks whether path is an existing directory.
+int Isdirectory(const char *path) {
+  struct stat st;
+  if (path==NULL || path[0]=='\0' || stat(path,&st)!=0)
+    return 0;
+  return S_ISDIR(st.st_mode)?1:0;
+};
+
+// Gets last component of the path, trailing separators are ignored. Returns
+// empty string for the root, "." and "..".
+static void Basename(const char *path,char *name) {
+  int i,n;
+  n=strlen(path);
+  while (n>0 && (path[n-1]=='/' || path[n-1]=='\\')) n--;
+  for (i=n; i>0 && path[i-1]!='/' && path[i-1]!='\\' && path[i-1]!=':'; i--);
+  if (n-i>=ARCHNAME)
+    i=n-ARCHNAME+1;
+  memcpy(name,path+i,n-i);
+  name[n-i]='\0';
+  if (strcmp(name,".")==0 || strcmp(name,"..")==0)
+    name[0]='\0';
+  ;
+};
+
+// Adds file to the list of files to pack. Returns 0 on success and -1 on
+// error.
+static int Addarchfile(const char *path,const char *name,struct stat *st) {
+  t_archfile *pa;
+  if (strlen(path)>=MAXPATH || strlen(name)>=ARCHNAME) {
+    Reporterror("File name is too long for archive");
+    return -1; };
+  if (narchfile>=MAXARCHFILE) {
+    Reporterror("Too many files for archive");
+    return -1; };
+  if (narchfile>=maxarchfile) {
+    pa=(t_archfile *)realloc(archfile,
+      (maxarchfile+NFILE)*sizeof(t_archfile));
+    if (pa==NULL) {
+      Reporterror("Low memory");
+      return -1; };
+    archfile=pa;
+    maxarchfile+=NFILE; };
+  pa=archfile+narchfile;
+  memset(pa,0,sizeof(t_archfile));
+  strcpy(pa->path,path);
+  strcpy(pa->entry.name,name);
+  pa->entry.size=st->st_size;
+  pa->entry.modified=convertToFileTime(st->st_mtime);
+  pa->entry.mode=st->st_mode & 0777;
+  narchfile++;
+  return 0;
+};
+
+// Adds all regular files in the directory and its subdirectories. Names are
+// prefixed with name, which may be empty. Returns 0 on success and -1 on
+// error.
+static int Scandirectory(const char *path,const char *name) {
+  int result;
+  char subpath[MAXPATH],subname[ARCHNAME];
+  DIR *dir;
+  struct dirent *de;
+  struct stat st;
+  dir=opendir(path);
+  if (dir==NULL) {
+    Reporterror("Unable to read directory");
+    return -1; };
+  result=0;
+  while (result==0 && (de=readdir(dir))!=NULL) {
+    if (strcmp(de->d_name,".")==0 || strcmp(de->d_name,"..")==0)
+      continue;
+    if (strlen(path)+strlen(de->d_name)+2>MAXPATH ||
+      strlen(name)+strlen(de->d_name)+2>ARCHNAME) {
+      Reporterror("File name is too long for archive");
+      result=-1; break; };
+    sprintf(subpath,"%s/%s",path,de->d_name);
+    if (name[0]=='\0')
+      strcpy(subname,de->d_name);
+    else
+      sprintf(subname,"%s/%s",name,de->d_name);
+    if (stat(subpath,&st)!=0) {
+      Reporterror("Unable to get input file attributes");
+      result=-1; }
+    else if (S_ISDIR(st.st_mode))
+      result=Scandirectory(subpath,subname);
+    else if (S_ISREG(st.st_mode))
+      result=Addarchfile(subpath,subname,&st);
+    ;                                  // Devices, sockets etc. are ignored
+  };
+  closedir(dir);
+  return result;
+};
+
+// Compares names of two files to pack, for qsort().
+static int Comparearchfile(const void *a,const void *b) {
+  return strcmp(((t_archfile *)a)->entry.name,((t_archfile *)b)->entry.name);
+};
+
+// Packs files and directories listed in pb_archive into the temporary file
+// and opens it as input file of the print descriptor. Files from directories
+// keep their paths relative to the parent of the directory. Files are sorted
+// by name, so that the same set of files always gives the same archive.
+// Returns 0 on success and -1 on error.
+int Buildarchive(t_printdata *print) {
+  int i,result;
+  uint32_t n;
+  uint64_t offset,done;
+  char name[ARCHNAME];
+  uchar *buf;
+  FILE *f,*fin;
+  struct stat st;
+  t_archhead head;
+  narchfile=0;
+  result=0;
+  for (i=0; i<pb_narchive && result==0; i++) {
+    Basename(pb_archive[i],name);
+    if (stat(pb_archive[i],&st)!=0) {
+      Reporterror("Unable to get input file attributes");
+      result=-1; }
+    else if (S_ISDIR(st.st_mode))
+      result=Scandirectory(pb_archive[i],name);
+    else if (name[0]=='\0') {
+      Reporterror("Invalid file name");
+      result=-1; }
+    else
+      result=Addarchfile(pb_archive[i],name,&st);
+    ;
+  };
+  if (result==0 && narchfile==0) {
+    Reporterror("No files to pack");
+    result=-1; };
+  if (result==0) {
+    qsort(archfile,narchfile,sizeof(t_archfile),Comparearchfile);
+    for (i=1; i<narchfile; i++) {
+      if (strcmp(archfile[i-1].entry.name,archfile[i].entry.name)==0) break; };
+    if (i<narchfile) {
+      Reporterror("Duplicate file name in archive");
+      result=-1;
+    };
+  };
+  // Calculate layout. TOC occupies whole blocks.
+  memset(&head,0,sizeof(head));
+  head.magic=ARCHMAGIC;
+  head.version=ARCHVERSION;
+  head.nfile=narchfile;
+  head.tocsize=(sizeof(t_archhead)+narchfile*sizeof(t_archentry)+NDATA-1)/
+    NDATA*NDATA;
+  offset=head.tocsize;
+  for (i=0; i<narchfile && result==0; i++) {
+    archfile[i].entry.offset=offset;
+    offset+=archfile[i].entry.size;
+    if (offset>MAXEXTSIZE) {
+      Reporterror("Invalid file size");
+      result=-1;
+    };
+  };
+  f=NULL;
+  buf=NULL;
+  if (result==0) {
+    f=tmpfile();
+    buf=(uchar *)malloc(PACKLEN);
+    if (f==NULL || buf==NULL) {
+      Reporterror("Unable to create temporary file");
+      result=-1;
+    };
+  };
+  // Write TOC, padding and data.
+  if (result==0) {
+    Message("Packing files",0);
+    memset(buf,0,NDATA);
+    if (fwrite(&head,sizeof(head),1,f)!=1)
+      result=-1;
+    for (i=0; i<narchfile && result==0; i++) {
+      if (fwrite(&archfile[i].entry,sizeof(t_archentry),1,f)!=1)
+        result=-1;
+      ;
+    };
+    n=head.tocsize-sizeof(head)-narchfile*sizeof(t_archentry);
+    if (result==0 && n>0 && fwrite(buf,1,n,f)!=n)
+      result=-1;
+    if (result!=0)
+      Reporterror("Unable to write temporary file");
+    ;
+  };
+  for (i=0; i<narchfile && result==0; i++) {
+    fin=fopen(archfile[i].path,"rb");
+    if (fin==NULL) {
+      Reporterror("Unable to open file");
+      result=-1; break; };
+    for (done=0; done<archfile[i].entry.size; done+=n) {
+      n=(archfile[i].entry.size-done<PACKLEN?
+        archfile[i].entry.size-done:PACKLEN);
+      if (fread(buf,1,n,fin)!=n) {
+        Reporterror("Unable to read file");
+        result=-1; break; };
+      if (fwrite(buf,1,n,f)!=n) {
+        Reporterror("Unable to write temporary file");
+        result=-1; break;
+      };
+    };
+    // File that grows while packed would corrupt the archive.
+    if (result==0 && fgetc(fin)!=EOF) {
+      Reporterror("File changed while packing");
+      result=-1; };
+    fclose(fin);
+  };
+  if (result==0 && fflush(f)!=0) {
+    Reporterror("Unable to write temporary file");
+    result=-1; };
+  if (buf!=NULL)
+    free(buf);
+  if (result!=0) {
+    if (f!=NULL) fclose(f);
+    free(archfile); archfile=NULL;
+    narchfile=maxarchfile=0;
+    return -1; };
+  // Archive is the input file now. It gets the time of the newest file.
+  rewind(f);
+  print->hfile=f;
+  print->origsize=offset;
+  print->attributes=FILE_ATTRIBUTE_NORMAL;
+  print->modified=archfile[0].entry.modified;
+  for (i=1; i<narchfile; i++) {
+    if (archfile[i].entry.modified.dwHighDateTime>
+      print->modified.dwHighDateTime ||
+      (archfile[i].entry.modified.dwHighDateTime==
+      print->modified.dwHighDateTime &&
+      archfile[i].entry.modified.dwLowDateTime>
+      print->modified.dwLowDateTime))
+      print->modified=archfile[i].entry.modified;
+    ;
+  };
+  // Name of the archive is the name of the only directory, or "archive".
+  Basename(pb_archive[0],name);
+  if (pb_narchive>1 || name[0]=='\0')
+    strcpy(name,"archive");
+  strcpy(print->infile,name);
+  print->archive=1;
+  fprintf(pb_stdout?stderr:stdout,"Packed %i file(s), TOC %u bytes\n",
+    narchfile,head.tocsize);
+  free(archfile); archfile=NULL;
+  narchfile=maxarchfile=0;
+  return 0;
+};
+
+// Checks whether single file requested by --extract can be taken directly
+// from the gathered data, without decompression and decryption.
+static int Isselective(t_fproc *pf) {
+  return pb_extract[0]!='\0' && (pf->mode & PBM_ARCHIVE)!=0 &&
+    (pf->mode & (PBM_COMPRESSED|PBM_ENCRYPTED))==0;
+};
+
+// Checks whether piece of the archive is available. Gathered data may be
+// incomplete, all blocks of the piece must be valid. Returns 1 if piece is
+// available and 0 otherwise.
+static int Isavailable(t_archsrc *src,uint64_t offset,uint64_t length) {
+  uint64_t i;
+  if (offset>src->size || length>src->size-offset)
+    return 0;                          // Outside the archive
+  if (src->f!=NULL)
+    return 1;
+  for (i=offset/NDATA; i*NDATA<offset+length; i++) {
+    if ((src->pf->valid[i>>3] & (1<<(i & 7)))==0) return 0; };
+  return 1;
+};
+
+// Reads piece of the archive. Returns 0 on success and -1 on error.
+static int Readarchive(t_archsrc *src,uint64_t offset,uint32_t length,
+  uchar *buf) {
+  if (Isavailable(src,offset,length)==0)
+    return -1;
+  if (src->f!=NULL) {
+    if (fseeko(src->f,offset,SEEK_SET)!=0 ||
+      fread(buf,1,length,src->f)!=length)
+      return -1;
+    return 0; };
+  return Readfprocdata(src->pf,offset,length,buf);
+};
+
+// Reads and verifies header of the archive. Returns 0 on success and -1 if
+// header is unreadable or invalid.
+static int Readarchhead(t_archsrc *src,t_archhead *head) {
+  if (Readarchive(src,0,sizeof(t_archhead),(uchar *)head)!=0)
+    return -1;
+  if (head->magic!=ARCHMAGIC || head->version!=ARCHVERSION ||
+    head->nfile>MAXARCHFILE ||
+    head->tocsize<sizeof(t_archhead)+head->nfile*sizeof(t_archentry) ||
+    head->tocsize>src->size)
+    return -1;
+  return 0;
+};
+
+// Reads entry of the TOC with given index and verifies it. Returns 0 on
+// success and -1 on error.
+static int Readarchentry(t_archsrc *src,t_archhead *head,int index,
+  t_archentry *entry) {
+  if (Readarchive(src,sizeof(t_archhead)+(uint64_t)index*sizeof(t_archentry),
+    sizeof(t_archentry),(uchar *)entry)!=0)
+    return -1;
+  if (entry->offset<head->tocsize || entry->offset>src->size ||
+    entry->size>src->size-entry->offset ||
+    entry->name[ARCHNAME-1]!='\0')
+    return -1;
+  return 0;
+};
+
+// Looks for the file requested by --extract. Returns index of its entry in
+// TOC plus 1 if file is found, 0 if it's not in the archive and -1 if TOC is
+// not yet complete or invalid.
+static int Findmember(t_archsrc *src,t_archhead *head,t_archentry *entry) {
+  int i;
+  if (Readarchhead(src,head)!=0)
+    return -1;
+  for (i=0; i<(int)head->nfile; i++) {
+    if (Readarchentry(src,head,i,entry)!=0)
+      return -1;
+    if (strcmp(entry->name,pb_extract)==0)
+      return i+1;
+    ;
+  };
+  return 0;
+};
+
+// Same as Findmember(), but for the gathered data of the file descriptor.
+// Found entry is remembered in the descriptor, so that TOC is scanned only
+// once and not on every page.
+static int Findgathered(t_fproc *pf,t_archsrc *src,t_archhead *head,
+  t_archentry *entry) {
+  int n;
+  src->f=NULL;
+  src->pf=pf;
+  src->size=pf->origsize;
+  if (pf->member>0) {
+    if (Readarchhead(src,head)!=0 ||
+      Readarchentry(src,head,pf->member-1,entry)!=0)
+      return -1;
+    return pf->member; };
+  n=Findmember(src,head,entry);
+  if (n>0)
+    pf->member=n;
+  return n;
+};
+
+// Creates directory, if it doesn't exist yet. Returns 0 on success and -1 on
+// error.
+static int Makedirectory(const char *path) {
+  if (Isdirectory(path))
+    return 0;
+#ifdef _WIN32
+  return (mkdir(path)==0?0:-1);
+#else
+  return (mkdir(path,0777)==0?0:-1);
+#endif
+};
+
+// Selects name of the extracted file. Files are saved to the directory
+// pb_outfile under their names in archive, missing directories are created.
+// Names are relative and use '/' as separator; names that could escape the
+// output directory are rejected. Single file requested by --extract may be
+// also saved as pb_outfile. Returns 0 on success and -1 on error.
+static int Memberpath(const char *name,char *path) {
+  int i,n,start,result;
+  n=strlen(pb_outfile);
+  if (pb_extract[0]!='\0' && n>0 && pb_outfile[n-1]!='/' &&
+    pb_outfile[n-1]!='\\' && Isdirectory(pb_outfile)==0) {
+    strcpy(path,pb_outfile);
+    return 0; };
+  if (name[0]=='/' || strpbrk(name,"\\:")!=NULL)
+    start=-1;
+  else {
+    for (start=0,i=0; ; i++) {
+      if (name[i]!='/' && name[i]!='\0')
+        continue;
+      if (i==start || (i-start==1 && name[start]=='.') ||
+        (i-start==2 && name[start]=='.' && name[start+1]=='.')) {
+        start=-1; break; };
+      if (name[i]=='\0')
+        break;
+      start=i+1;
+    };
+  };
+  while (n>1 && (pb_outfile[n-1]=='/' || pb_outfile[n-1]=='\\')) n--;
+  if (start<0 || n+1+strlen(name)>=MAXPATH) {
+    Reporterror("Invalid file name in archive");
+    return -1; };
+  sprintf(path,"%.*s/%s",n,pb_outfile,name);
+  // Create output directory and subdirectories.
+  for (i=n; path[i]!='\0'; i++) {
+    if (path[i]!='/') continue;
+    path[i]='\0';
+    result=Makedirectory(path);
+    path[i]='/';
+    if (result!=0) {
+      Reporterror("Unable to create directory");
+      return -1;
+    };
+  };
+  return 0;
+};
+
+// Saves file from the archive and restores its time and access rights.
+// Returns 0 on success and -1 on error.
+static int Savemember(t_archsrc *src,t_archentry *entry) {
+  int success;
+  uint32_t n;
+  uint64_t done;
+  uchar *buf;
+  char path[MAXPATH];
+  FILE *f;
+  struct stat st;
+  struct utimbuf newtime;
+  if (pb_stdout && pb_extract[0]!='\0')
+    f=stdout;
+  else {
+    if (Memberpath(entry->name,path)!=0)
+      return -1;
+    f=fopen(path,"wb");
+    if (f==NULL) {
+      Reporterror("Unable to create file");
+      return -1;
+    };
+  };
+  buf=(uchar *)malloc(PACKLEN);
+  success=(buf!=NULL);
+  for (done=0; done<entry->size && success; done+=n) {
+    n=(entry->size-done<PACKLEN?entry->size-done:PACKLEN);
+    if (Readarchive(src,entry->offset+done,n,buf)!=0 ||
+      fwrite(buf,1,n,f)!=n)
+      success=0;
+    ;
+  };
+  if (buf!=NULL)
+    free(buf);
+  if (f==stdout) {
+    if (fflush(f)!=0)
+      success=0;
+    if (success==0)
+      Reporterror("Unable to write data");
+    return (success?0:-1); };
+  if (fclose(f)!=0)
+    success=0;
+  if (success==0) {
+    remove(path);
+    Reporterror("Unable to extract file");
+    return -1; };
+  newtime.actime=(stat(path,&st)==0?st.st_atime:time(NULL));
+  newtime.modtime=convertToPosixTime(entry->modified);
+  utime(path,&newtime);
+  chmod(path,entry->mode & 0777);
+  return 0;
+};
+
+// Splits unpacked archive into files or, if --extract is given, saves only
+// the requested file. Returns 0 on success and -1 on error.
+int Extractarchive(t_fproc *pf,FILE *f) {
+  int i,n;
+  char s[TEXTLEN];
+  t_archsrc src;
+  t_archhead head;
+  t_archentry entry;
+  src.f=f;
+  src.pf=NULL;
+  src.size=pf->origsize;
+  if (pb_extract[0]!='\0') {
+    n=Findmember(&src,&head,&entry);
+    if (n<0) {
+      Reporterror("Invalid archive");
+      return -1; };
+    if (n==0) {
+      Reporterror("File is not in the archive");
+      return -1; };
+    return Savemember(&src,&entry); };
+  if (pb_stdout) {
+    Reporterror("Archive can't be written to stdout, use --extract");
+    return -1; };
+  if (Readarchhead(&src,&head)!=0) {
+    Reporterror("Invalid archive");
+    return -1; };
+  for (i=0; i<(int)head.nfile; i++) {
+    if (Readarchentry(&src,&head,i,&entry)!=0) {
+      Reporterror("Invalid archive");
+      return -1; };
+    if (Savemember(&src,&entry)!=0)
+      return -1;
+    ;
+  };
+  sprintf(s,"%i file(s) extracted",head.nfile);
+  Message(s,0);
+  return 0;
+};
+
+// Saves file requested by --extract as soon as the TOC and all blocks of the
+// file are restored, without waiting for the rest of the archive. Returns 0
+// if file is saved and descriptor closed, -1 on error and 1 if data is still
+// incomplete or file must be taken from the whole archive.
+int Extractselected(int slot) {
+  int n;
+  t_fproc *pf;
+  t_archsrc src;
+  t_archhead head;
+  t_archentry entry;
+  pf=pb_fproc+slot;
+  if (Isselective(pf)==0)
+    return 1;
+  n=Findgathered(pf,&src,&head,&entry);
+  if (n<0)
+    return 1;                          // TOC is not yet complete
+  if (n==0) {
+    // There is no need to read remaining pages.
+    Reporterror("File is not in the archive");
+    Checkpointdone(slot);
+    Closefproc(slot);
+    return -1; };
+  if (Isavailable(&src,entry.offset,entry.size)==0)
+    return 1;                          // File is still incomplete
+  if (Savemember(&src,&entry)!=0)
+    return -1;
+  Checkpointdone(slot);
+  Closefproc(slot);
+  Message("File extracted",0);
+  return 0;
+};
+
+// Checks whether page with given index (0-based) holds TOC or data of the
+// file.
+static int Pageinrange(t_fproc *pf,t_archhead *head,t_archentry *entry,
+  int index) {
+  uint64_t first;
+  first=(uint64_t)index*pf->pagesize;
+  if (first<head->tocsize)
+    return 1;
+  return (first<entry->offset+entry->size &&
+    first+pf->pagesize>entry->offset);
+};
+
+// Checks whether page (1-based) must be decoded when file is extracted with
+// --extract. Until TOC is read, all pages are necessary; then only pages
+// that hold TOC or data of the file. Lost page can be rebuilt from parity
+// pages only if all other pages of its stripe are known, so with parity
+// pages, whole stripes are necessary. Parity pages are always necessary.
+// Returns 1 if page must be decoded and 0 if it may be skipped.
+int Pageneeded(t_fproc *pf,int page) {
+  int i,nstripe;
+  t_archsrc src;
+  t_archhead head;
+  t_archentry entry;
+  if (Isselective(pf)==0 || pf->pagesize<NDATA ||
+    page<1 || page>pf->npages)
+    return 1;
+  if (Findgathered(pf,&src,&head,&entry)<=0)
+    return 1;
+  if ((pf->mode & PBM_PAGEPARITY)==0)
+    return Pageinrange(pf,&head,&entry,page-1);
+  nstripe=Paritystripes(pf->npages);
+  for (i=(page-1)%nstripe; i<pf->npages; i+=nstripe) {
+    if (Pageinrange(pf,&head,&entry,i)) return 1; };
+  return 0;
+};
@@ -0,0 +1,520 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// PaperBack -- high density backups on the plain paper                       //
+//                                                                            //
+// Copyright (c) 2007 Oleh Yuschuk                                            //
+// ollydbg at t-online de (set Subject to 'paperback' or be filtered out!)    //
+//                                                                            //
+//                                                                            //
+// This file is part of PaperBack.                                            //
+//                                                                            //
+// Paperback is free software; you can redistribute it and/or modify it under //
+// the terms of the GNU General Public License as published by the Free       //
+// Software Foundation; either version 3 of the License, or (at your option)  //
+// any later version.                                                         //
+//                                                                            //
+// PaperBack is distributed in the hope that it will be useful, but WITHOUT   //
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or      //
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for   //
+// more details.                                                              //
+//                                                                            //
+// You should have received a copy of the GNU General Public License along    //
+// with this program. If not, see <http://www.gnu.org/licenses/>.             //
+//                                                                            //
+//                                                                            //
+// Note that bzip2 compression/decompression library, which is the part of    //
+// this project, is covered by different license, which, in my opinion, is    //
+// compatible with GPL.                                                       //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include "bzlib.h"
+#include "aes.h"
+
+#include "paperbak.h"
+#include "Resource.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Checkpoint of the partially restored files. Checkpoint is a log of records //
+// appended after each processed page. Each record contains identity of the   //
+// file (as in superblock) and either blocks that became valid since the      //
+// last record (as a bitmap over the range of blocks, followed by the data of //
+// the marked blocks), or the note that file was saved. Records are protected //
+// by 32-bit CRC, so the incomplete record left by a crash is discarded.      //
+//                                                                            //
+// Shards, written by --emit-shard, use the same format. Instead of the file  //
+// processor, decoder passes there all blocks recognized on the page, data    //
+// and recovery alike, with their addresses. Any number of shards decoded on  //
+// different computers can be merged into the complete file.                  //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+#define CKMAGIC        0x4B434250      // 'PBCK', start of checkpoint file
+#define CKRECORD       0x52434250      // 'PBCR', start of record
+#define CKVERSION      3               // Version of checkpoint format
+#define CKMAXBLOCK     0x100000        // Max range of blocks in one record
+
+#define CK_BLOCKS      1               // Newly restored blocks
+#define CK_DONE        2               // File is saved
+#define CK_SHARD       3               // Blocks recognized on the page
+
+typedef struct t_ckheader {            // Header of file or record
+  uint32_t       magic;                // CKMAGIC or CKRECORD
+  uint32_t       type;                 // Version or one of CK_xxx
+  uint32_t       length;               // Length of record data
+  uint32_t       crc;                  // 32-bit CRC of record data
+} t_ckheader;
+
+typedef struct t_ckblocks {            // Range of blocks in CK_BLOCKS record
+  uint32_t       first;                // First block in range
+  uint32_t       nblock;               // Number of blocks in range
+} t_ckblocks;
+
+static FILE      *ckfile;              // Open checkpoint or NULL
+static int       ckdisabled;           // Checkpoint is not written
+static char      ckpath[MAXPATH];      // Name of checkpoint file
+static t_superblock *donelist;         // Files saved in this or previous run
+static int       ndone;                // Number of items in donelist
+static int       maxdone;              // Allocated size of donelist
+
+// Selects name of the checkpoint: the name of the output file with extension
+// .pbck, or paperback.pbck if output is a directory. Returns 0 on success and
+// -1 if checkpoint is not possible.
+static int Checkpointpath(void) {
+  int n;
+  if (pb_stdout || pb_outfile[0]=='\0')
+    return -1;
+  if (pb_emitshard) {
+    strcpy(ckpath,pb_outfile);
+    return 0; };
+  n=strlen(pb_outfile);
+  if (pb_outfile[n-1]=='/' || pb_outfile[n-1]=='\\')
+    sprintf(ckpath,"%.*spaperback.pbck",MAXPATH-16,pb_outfile);
+  else
+    sprintf(ckpath,"%.*s.pbck",MAXPATH-6,pb_outfile);
+  return 0;
+};
+
+// Creates new checkpoint, if not yet open. Returns 0 on success and -1 on
+// error.
+static int Opencheckpoint(void) {
+  t_ckheader hdr;
+  if (ckfile!=NULL)
+    return 0;
+  if (ckdisabled || Checkpointpath()!=0)
+    return -1;
+  ckfile=fopen(ckpath,"wb");
+  if (ckfile==NULL)
+    return -1;
+  hdr.magic=CKMAGIC;
+  hdr.type=CKVERSION;
+  hdr.length=0;
+  hdr.crc=0;
+  if (fwrite(&hdr,sizeof(hdr),1,ckfile)!=1) {
+    fclose(ckfile); ckfile=NULL;
+    return -1; };
+  return 0;
+};
+
+// Appends record to the checkpoint and forces it to disk. Returns 0 on
+// success and -1 on error.
+static int Writerecord(int type,uchar *data,uint32_t length) {
+  t_ckheader hdr;
+  hdr.magic=CKRECORD;
+  hdr.type=type;
+  hdr.length=length;
+  hdr.crc=Crc32(data,length);
+  if (fwrite(&hdr,sizeof(hdr),1,ckfile)!=1 ||
+    fwrite(data,1,length,ckfile)!=length || fflush(ckfile)!=0)
+    return -1;
+#ifdef __linux__
+  fsync(fileno(ckfile));
+#endif
+  return 0;
+};
+
+// Reads next record from the checkpoint or shard. Returns allocated record
+// data, or NULL if there are no more valid records.
+static uchar *Readrecord(FILE *f,t_ckheader *hdr) {
+  uchar *data;
+  if (fread(hdr,sizeof(t_ckheader),1,f)!=1)
+    return NULL;
+  if (hdr->magic!=CKRECORD || hdr->length<sizeof(t_superblock) ||
+    hdr->length>0x7FFFFFFF)
+    return NULL;
+  data=(uchar *)malloc(hdr->length);
+  if (data==NULL)
+    return NULL;
+  if (fread(data,1,hdr->length,f)!=hdr->length ||
+    Crc32(data,hdr->length)!=hdr->crc) {
+    free(data);                        // Incomplete record, crash
+    return NULL; };
+  return data;
+};
+
+// Fills superblock with identity of the processed file.
+static void Getidentity(t_fproc *pf,t_superblock *sb) {
+  memset(sb,0,sizeof(t_superblock));
+  sb->addr=SUPERBLOCK;
+  sb->datasize=pf->datasize;
+  sb->pagesize=pf->pagesize;
+  sb->origsize=pf->origsize;
+  sb->mode=pf->mode;
+  sb->page=pf->page;
+  sb->modified=pf->modified;
+  sb->attributes=pf->attributes;
+  sb->filecrc=pf->filecrc;
+  memcpy(sb->name,pf->name,64);
+  sb->ngroup=pf->ngroup;
+};
+
+// Adds file to the list of saved files.
+static void Adddone(t_superblock *sb) {
+  t_superblock *pd;
+  if (ndone>=maxdone) {
+    pd=(t_superblock *)realloc(donelist,
+      (maxdone+NFILE)*sizeof(t_superblock));
+    if (pd==NULL) return;
+    donelist=pd;
+    maxdone+=NFILE; };
+  donelist[ndone++]=*sb;
+};
+
+// Checks whether file described by superblock was already saved.
+int Isfiledone(t_superblock *sb) {
+  int i;
+  t_superblock *pd;
+  for (i=0,pd=donelist; i<ndone; i++,pd++) {
+    if (pd->datasize==sb->datasize && pd->origsize==sb->origsize &&
+      pd->mode==sb->mode &&
+      pd->modified.dwLowDateTime==sb->modified.dwLowDateTime &&
+      pd->modified.dwHighDateTime==sb->modified.dwHighDateTime &&
+      strnicmp(pd->name,sb->name,64)==0)
+      return 1;
+    ;
+  };
+  return 0;
+};
+
+// Appends blocks of the file that became valid since the last checkpoint.
+// Called after each page. Blocks are written in records of at most CKMAXBLOCK
+// blocks, so that memory doesn't depend on the size of the file. Errors are
+// reported once, decoding continues without checkpoint.
+void Checkpointpage(int slot) {
+  int i,n,from,first,last,nvalid;
+  uint32_t length;
+  uchar *data,*bits,*pd;
+  t_fproc *pf;
+  t_ckblocks *range;
+  if (slot<0 || slot>=pb_nfproc || pb_fproc[slot].busy==0)
+    return;
+  pf=pb_fproc+slot;
+  if (Opencheckpoint()!=0)
+    return;
+  if (pf->saved==NULL) {
+    pf->saved=(uchar *)calloc((pf->nalloc+7)/8,1);
+    if (pf->saved==NULL) return; };
+  for (from=0; from<pf->nalloc; from=last+1) {
+    // Find range of new blocks, including blocks of parity pages.
+    first=-1; last=-1; nvalid=0;
+    for (i=from; i<pf->nalloc && (first<0 || i-first<CKMAXBLOCK); i++) {
+      if ((pf->valid[i>>3] & (1<<(i & 7)))==0 ||
+        (pf->saved[i>>3] & (1<<(i & 7)))!=0)
+        continue;
+      if (first<0) first=i;
+      last=i;
+      nvalid++; };
+    if (nvalid==0)
+      return;
+    n=last-first+1;
+    length=sizeof(t_superblock)+sizeof(t_ckblocks)+(n+7)/8+nvalid*NDATA;
+    data=(uchar *)calloc(length,1);
+    if (data==NULL)
+      return;
+    Getidentity(pf,(t_superblock *)data);
+    range=(t_ckblocks *)(data+sizeof(t_superblock));
+    range->first=first;
+    range->nblock=n;
+    bits=data+sizeof(t_superblock)+sizeof(t_ckblocks);
+    pd=bits+(n+7)/8;
+    for (i=first; i<=last; i++) {
+      if ((pf->valid[i>>3] & (1<<(i & 7)))==0 ||
+        (pf->saved[i>>3] & (1<<(i & 7)))!=0)
+        continue;
+      if (Readfprocdata(pf,(uint64_t)i*NDATA,NDATA,pd)!=0)
+        break;
+      bits[(i-first)>>3]|=(uchar)(1<<((i-first) & 7));
+      pd+=NDATA; };
+    if (i<=last) {
+      free(data);
+      return; };
+    if (Writerecord(CK_BLOCKS,data,length)!=0) {
+      Reporterror("Unable to write checkpoint");
+      free(data);
+      return; };
+    for (i=first; i<=last; i++) {
+      if (bits[(i-first)>>3] & (1<<((i-first) & 7)))
+        pf->saved[i>>3]|=(uchar)(1<<(i & 7));
+      ;
+    };
+    free(data);
+  };
+};
+
+// Notes in the checkpoint that file is saved. Its pages will be skipped.
+void Checkpointdone(int slot) {
+  t_superblock sb;
+  if (slot<0 || slot>=pb_nfproc || pb_fproc[slot].busy==0)
+    return;
+  Getidentity(pb_fproc+slot,&sb);
+  Adddone(&sb);
+  if (Opencheckpoint()!=0)
+    return;
+  if (Writerecord(CK_DONE,(uchar *)&sb,sizeof(sb))!=0)
+    Reporterror("Unable to write checkpoint");
+  ;
+};
+
+// Verifies that decoding from scratch doesn't overwrite the checkpoint left
+// by the interrupted run. Shards are ordinary output and are overwritten.
+// Returns 0 if checkpoint may be created and -1 otherwise.
+int Newcheckpoint(void) {
+  FILE *f;
+  char s[TEXTLEN];
+  if (pb_emitshard || Checkpointpath()!=0)
+    return 0;
+  f=fopen(ckpath,"rb");
+  if (f==NULL)
+    return 0;
+  fclose(f);
+  sprintf(s,"Checkpoint %.*s exists, continue decoding with --resume or "
+    "delete it",TEXTLEN-80,ckpath);
+  Reporterror(s);
+  return -1;
+};
+
+// Restores file processor from the checkpoint left by the interrupted run
+// and opens it for appending. Files that are complete are saved. Returns 0
+// on success and -1 on error.
+int Resumecheckpoint(void) {
+  int i,slot,nrecord;
+  long good;
+  t_block block;
+  uchar *data,*bits,*pd;
+  char s[TEXTLEN];
+  t_ckheader hdr;
+  t_ckblocks *range;
+  t_superblock *sb;
+  t_fproc *pf;
+  if (Checkpointpath()!=0) {
+    Reporterror("Checkpoint requires output file or directory");
+    return -1; };
+  ckfile=fopen(ckpath,"r+b");
+  if (ckfile==NULL) {
+    Message("No checkpoint found, starting from scratch",0);
+    return 0; };
+  if (fread(&hdr,sizeof(hdr),1,ckfile)!=1 ||
+    hdr.magic!=CKMAGIC || hdr.type!=CKVERSION) {
+    fclose(ckfile); ckfile=NULL;
+    Reporterror("Invalid checkpoint");
+    return -1; };
+  nrecord=0;
+  good=ftell(ckfile);
+  while ((data=Readrecord(ckfile,&hdr))!=NULL) {
+    sb=(t_superblock *)data;
+    if (hdr.type==CK_DONE)
+      Adddone(sb);
+    else if (hdr.type==CK_BLOCKS &&
+      hdr.length>=sizeof(t_superblock)+sizeof(t_ckblocks)) {
+      range=(t_ckblocks *)(data+sizeof(t_superblock));
+      bits=data+sizeof(t_superblock)+sizeof(t_ckblocks);
+      // Bitmap of the range must fit into the record.
+      if (range->nblock>CKMAXBLOCK || (range->nblock+7)/8>
+        hdr.length-sizeof(t_superblock)-sizeof(t_ckblocks))
+        slot=-1;
+      else
+        slot=Startnextpage(sb);
+      if (slot>=0) {
+        pd=bits+(range->nblock+7)/8;
+        pf=pb_fproc+slot;
+        if (pf->saved==NULL)
+          pf->saved=(uchar *)calloc((pf->nalloc+7)/8,1);
+        for (i=0; i<(int)range->nblock; i++) {
+          if ((bits[i>>3] & (1<<(i & 7)))==0)
+            continue;
+          if (pd+NDATA>data+hdr.length)
+            break;
+          // Addblock() extends storage if block belongs to parity page.
+          block.addr=(uint64_t)(range->first+i)*NDATA;
+          block.recsize=0;
+          memcpy(block.data,pd,NDATA);
+          if (Addblock(&block,slot,0)!=0)
+            break;
+          if (pf->saved!=NULL)
+            pf->saved[(range->first+i)>>3]|=
+            (uchar)(1<<((range->first+i) & 7));
+          pd+=NDATA;
+        };
+      };
+    };
+    free(data);
+    nrecord++;
+    good=ftell(ckfile); };
+  // Discard incomplete tail and continue the log.
+  fflush(ckfile);
+#ifdef _WIN32
+  if (_chsize_s(_fileno(ckfile),good)!=0)
+#else
+  if (ftruncate(fileno(ckfile),good)!=0)
+#endif
+    Reporterror("Unable to truncate checkpoint");
+  ;
+  fseek(ckfile,good,SEEK_SET);
+  sprintf(s,"Resumed %i checkpoint records, %i files already saved",
+    nrecord,ndone);
+  Message(s,0);
+  // Save files that were completed just before the interruption.
+  for (slot=0; slot<pb_nfproc; slot++) {
+    pf=pb_fproc+slot;
+    if (pf->busy && pf->ndata==pf->nblock && pb_autosave)
+      Saverestoredfile(slot,0);
+    ;
+  };
+  return 0;
+};
+
+// Appends blocks recognized on the page to the shard. Called by decoder
+// instead of passing blocks to the file processor.
+void Emitshard(t_superblock *superblock,t_block *block,int nblock) {
+  int i;
+  uint32_t length;
+  uchar *data,*pd;
+  t_block b;
+  if (Opencheckpoint()!=0) {
+    Reporterror("Unable to create shard");
+    return; };
+  length=sizeof(t_superblock)+sizeof(uint32_t)+nblock*sizeof(t_block);
+  data=(uchar *)malloc(length);
+  if (data==NULL) {
+    Reporterror("Low memory");
+    return; };
+  memcpy(data,superblock,sizeof(t_superblock));
+  *(uint32_t *)(data+sizeof(t_superblock))=nblock;
+  // Blocks are copied field by field, so that padding is always zero and
+  // shards don't depend on the contents of uninitialized memory.
+  pd=data+sizeof(t_superblock)+sizeof(uint32_t);
+  for (i=0; i<nblock; i++,pd+=sizeof(t_block)) {
+    memset(&b,0,sizeof(t_block));
+    b.addr=block[i].addr;
+    b.recsize=block[i].recsize;
+    memcpy(b.data,block[i].data,NDATA);
+    memcpy(pd,&b,sizeof(t_block)); };
+  if (Writerecord(CK_SHARD,data,length)!=0)
+    Reporterror("Unable to write shard");
+  free(data);
+};
+
+// Merges shards into the file processor, runs group recovery once over the
+// union of all blocks and saves completed files. Shards already hold all the
+// progress, so no checkpoint is written. Returns 0 if all files are restored
+// and -1 otherwise.
+int Mergeshards(int nshard,char **shard) {
+  int i,k,n,slot,incomplete;
+  uchar *data;
+  char s[TEXTLEN+MAXPATH];
+  FILE *f;
+  t_ckheader hdr;
+  t_superblock *sb;
+  t_block *block;
+  t_fproc *pf;
+  ckdisabled=1;
+  for (k=0; k<nshard; k++) {
+    f=fopen(shard[k],"rb");
+    if (f==NULL) {
+      sprintf(s,"Unable to open %.*s",MAXPATH,shard[k]);
+      Reporterror(s);
+      continue; };
+    if (fread(&hdr,sizeof(hdr),1,f)!=1 ||
+      hdr.magic!=CKMAGIC || hdr.type!=CKVERSION) {
+      fclose(f);
+      sprintf(s,"%.*s is not a shard",MAXPATH,shard[k]);
+      Reporterror(s);
+      continue; };
+    sprintf(s,"Merging %.*s",MAXPATH,shard[k]);
+    Message(s,0);
+    while ((data=Readrecord(f,&hdr))!=NULL) {
+      sb=(t_superblock *)data;
+      n=(hdr.length-sizeof(t_superblock)-sizeof(uint32_t))/sizeof(t_block);
+      if (hdr.type==CK_SHARD &&
+        hdr.length>=sizeof(t_superblock)+sizeof(uint32_t) &&
+        *(uint32_t *)(data+sizeof(t_superblock))<=(uint32_t)n) {
+        n=*(uint32_t *)(data+sizeof(t_superblock));
+        block=(t_block *)(data+sizeof(t_superblock)+sizeof(uint32_t));
+        slot=Startnextpage(sb);
+        for (i=0; slot>=0 && i<n; i++)
+          Addblock(block+i,slot,0);
+        ;
+      };
+      free(data); };
+    fclose(f);
+  };
+  // All blocks are known, restore what is possible and save.
+  for (slot=0; slot<pb_nfproc; slot++) {
+    pf=pb_fproc+slot;
+    if (pf->busy==0) continue;
+    Finishpage(slot,0,0,0,0); };
+  // Saved files are closed. Remaining files are either incomplete or complete
+  // but could not be saved.
+  incomplete=0;
+  for (slot=0; slot<pb_nfproc; slot++) {
+    pf=pb_fproc+slot;
+    if (pf->busy==0) continue;
+    if (pf->ndata==pf->nblock)
+      sprintf(s,"%.*s: file is complete but was not saved",
+      (pf->mode & PBM_ENCRYPTED?32:64),pf->name);
+    else
+      sprintf(s,"%.*s: %i of %i blocks are missing",
+      (pf->mode & PBM_ENCRYPTED?32:64),pf->name,
+      pf->nblock-pf->ndata,pf->nblock);
+    Reporterror(s);
+    incomplete++; };
+  return (incomplete==0?0:-1);
+};
+
+// Closes checkpoint. If all files are saved, checkpoint is no longer
+// necessary and is deleted.
+void Closecheckpoint(void) {
+  int slot,nbusy;
+  if (ckfile!=NULL && pb_emitshard) {
+    fclose(ckfile);
+    ckfile=NULL;
+    Message("Shard saved",0); }
+  else if (ckfile!=NULL) {
+    fclose(ckfile);
+    ckfile=NULL;
+    nbusy=0;
+    for (slot=0; slot<pb_nfproc; slot++) {
+      if (pb_fproc[slot].busy) nbusy++; };
+    if (nbusy==0)
+      remove(ckpath);
+    else
+      Message("Some files are incomplete, scan missing pages and decode "
+        "them with --resume",0);
+    ;
+  };
+  if (donelist!=NULL)
+    free(donelist);
+  donelist=NULL;
+  ndone=maxdone=0;
+};
@@ -33,6 +33,10 @@
 #endif
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "bzlib.h"
 #include "aes.h"
 
@@ -43,6 +47,19 @@
 #define NPEAK          32              // Maximal number of peaks
 #define SUBDX          8               // X size of subblock, pixels
 #define SUBDY          8               // Y size of subblock, pixels
+#define MINPITCH       2.5             // Minimal dot pitch after reduction
+#define MAXREDUCTION   8               // Maximal bitmap reduction factor
+#define NGRID          16              // Maximal number of grids on bitmap
+#define GRIDGAP        6               // Minimal gap between grids, samples
+#define GRIDMARGIN     2               // Margin around cropped grid, samples
+
+typedef struct t_grid {                // Location of grid on the bitmap
+  int            x0,y0;                // Top left corner, pixels
+  int            x1,y1;                // Bottom right corner, pixels
+} t_grid;
+
+// Serializes access to file processor when several grids are decoded at once.
+static pthread_mutex_t fprocmutex=PTHREAD_MUTEX_INITIALIZER;
 
 // Given hystogramm h of length n points, locates black peaks and determines
 // phase and step of the grid.
@@ -160,7 +177,6 @@ static int Recognizebits(t_data *result,uchar grid[NDOT][NDOT],
   t_procdata *pdata) {
   int i,j,k,q,r,factor,lcorr,c,cmin,cmax,limit;
   int grid1[NDOT][NDOT],answer,bestanswer;
-  static int lastgood;
   ushort crc;
   t_data uncorrected,bestresult;
   cmin=pdata->cmin;
@@ -171,9 +187,10 @@ static int Recognizebits(t_data *result,uchar grid[NDOT][NDOT],
     if (pdata->orientation>=0 && r!=pdata->orientation) continue;
     // Try 3 different point overlapping factors, combined with 3 different
     // thresholds. Usually all cells are alike, so I remember the last known
-    // good combination and start with it.
+    // good combination and start with it. Grids decoded in parallel keep it
+    // in their own descriptors.
     for (k=0; k<9; k++) {
-      q=(k+lastgood)%9;
+      q=(k+pdata->lastgood)%9;
       switch (q) {
         case 0: factor=1000; lcorr=0; break;
         case 1: factor=32; lcorr=0; break;
@@ -184,7 +201,7 @@ static int Recognizebits(t_data *result,uchar grid[NDOT][NDOT],
         case 6: factor=1000; lcorr=(cmax-cmin)/16; break;
         case 7: factor=32; lcorr=(cmax-cmin)/16; break;
         case 8: factor=16; lcorr=(cmax-cmin)/16; break;
-        default: factor=1000; lcorr=0; lastgood=0; break; };
+        default: factor=1000; lcorr=0; pdata->lastgood=0; break; };
       // Correct grid for overlapping dots and calculate limit between black
       // and white. I take into account only adjacent dots; the influence of
       // diagonals is significantly lower.
@@ -239,7 +256,7 @@ static int Recognizebits(t_data *result,uchar grid[NDOT][NDOT],
           pdata->orientation=r;
           // Report success.
           if ((pdata->mode & M_BEST)==0) {
-            lastgood=q;
+            pdata->lastgood=q;
             return answer; }
           else if (answer<bestanswer) {
             bestanswer=answer;
@@ -385,9 +402,65 @@ static void Getgridintensity(t_procdata *pdata) {
   pdata->step++;
 };
 
+// Reduces bitmap k times in each direction in place, averaging each k*k
+// square of pixels (box filter). Rows are summed into the 16-bit accumulator,
+// with SSE2 16 pixels at once, then k adjacent sums are scaled by 1/(k*k).
+// Returns 0 on success and -1 on error.
+static int Reducebitmap(t_procdata *pdata,int k) {
+  int i,j,m,nx,ny,sizex,s,recip;
+  ushort *acc;
+  uchar *data,*pd,*pr,*p;
+  sizex=pdata->sizex;
+  nx=sizex/k;
+  ny=pdata->sizey/k;
+  if (nx<=3*NDOT || ny<=3*NDOT)
+    return -1;
+  acc=(ushort *)malloc(nx*k*sizeof(ushort));
+  if (acc==NULL)
+    return -1;
+  data=pdata->data;
+  recip=(65536+k*k/2)/(k*k);
+  // Output row j is written over the already processed part of the bitmap.
+  for (j=0; j<ny; j++) {
+    pr=data+(size_t)j*k*sizex;
+    memset(acc,0,nx*k*sizeof(ushort));
+    for (m=0; m<k; m++,pr+=sizex) {
+      i=0;
+#ifdef __SSE2__
+      for ( ; i+16<=nx*k; i+=16) {
+        __m128i v,zero;
+        zero=_mm_setzero_si128();
+        v=_mm_loadu_si128((__m128i *)(pr+i));
+        _mm_storeu_si128((__m128i *)(acc+i),_mm_add_epi16(
+          _mm_loadu_si128((__m128i *)(acc+i)),_mm_unpacklo_epi8(v,zero)));
+        _mm_storeu_si128((__m128i *)(acc+i+8),_mm_add_epi16(
+          _mm_loadu_si128((__m128i *)(acc+i+8)),_mm_unpackhi_epi8(v,zero)));
+      };
+#endif
+      for ( ; i<nx*k; i++)
+        acc[i]+=pr[i];
+      ;
+    };
+    pd=data+(size_t)j*nx;
+    for (i=0; i<nx; i++) {
+      for (m=0,s=0; m<k; m++)
+        s+=acc[i*k+m];
+      pd[i]=(uchar)((s*recip+32768)>>16); };
+    ;
+  };
+  free(acc);
+  // Release unused memory. If this fails, old block remains valid.
+  p=(uchar *)realloc(data,(size_t)nx*ny);
+  if (p!=NULL) pdata->data=p;
+  pdata->sizex=nx;
+  pdata->sizey=ny;
+  pdata->reduction=k;
+  return 0;
+};
+
 // Find angle and step of vertical grid lines.
 static void Getxangle(t_procdata *pdata) {
-  int i,j,a,x,y,x0,y0,dx,dy,sizex;
+  int i,j,a,k,x,y,x0,y0,dx,dy,sizex;
   int h[NHYST],nh[NHYST],ystep;
   uchar *data,*pd;
   float weight,xpeak,xstep;
@@ -445,6 +518,22 @@ static void Getxangle(t_procdata *pdata) {
   pdata->xpeak=bestxpeak;
   pdata->xstep=bestxstep;
   pdata->xangle=bestxangle;
+  // If bitmap is strongly oversampled, all further steps waste time on the
+  // redundant pixels. Reduce bitmap so that dots stay at least MINPITCH
+  // pixels apart, and search for the grid once again on the reduced bitmap.
+  if (pdata->reduction==0) {
+    if (pb_decodescale>0)
+      k=pb_decodescale;
+    else if (bestxstep<4*(NDOT+3))
+      k=1;
+    else
+      k=min((int)(bestxstep/(NDOT+3)/MINPITCH),MAXREDUCTION);
+    pdata->reduction=1;
+    if (k>1 && Reducebitmap(pdata,k)==0) {
+      pdata->step=2;                   // Restart from Getgridposition()
+      return;
+    };
+  };
   // Step finished.
   pdata->step++;
 };
@@ -588,6 +677,9 @@ static void Preparefordecoding(t_procdata *pdata) {
     pdata->maxdotsize=4;
   // Prepare superblock.
   memset(&pdata->superblock,0,sizeof(t_superblock));
+  memset(&pdata->extdata,0,sizeof(t_extdata));
+  pdata->labelled=0;
+  pdata->pagebase=0;
   // Initialize remaining items.
   pdata->bufdx=dx;
   pdata->bufdy=dy;
@@ -596,6 +688,8 @@ static void Preparefordecoding(t_procdata *pdata) {
   pdata->nbad=0;
   pdata->nsuper=0;
   pdata->nrestored=0;
+  pdata->fileindex=-1;                 // File is not yet known
+  pdata->fileserial=0;
   pdata->posx=pdata->posy=0;           // First block to scan
   // Step finished.
   pdata->step++;
@@ -814,10 +908,65 @@ int Decodeblock(t_procdata *pdata,int posx,int posy,t_data *result) {
   return answer;
 };
 
+// Checks whether descriptor of the file, to which blocks of the page are
+// added, is still in use. It may be completed and closed by the thread that
+// decodes another grid. Call with fprocmutex locked.
+static int Fileisopen(t_procdata *pdata) {
+  return (pdata->fileindex>=0 && pdata->fileindex<pb_nfproc &&
+    pb_fproc[pdata->fileindex].busy!=0 &&
+    pb_fproc[pdata->fileindex].serial==pdata->fileserial);
+};
+
+// Checks whether label of the page is complete: superblock is read and, if
+// file uses extended addresses, also its extension. Extension that matches
+// the superblock replaces low bits of sizes and page number with full values
+// and sets offset of the page, which is added to all addresses on the page.
+// Returns 1 if label is complete and 0 otherwise.
+static int Labelcomplete(t_procdata *pdata) {
+  t_superblock *sb;
+  t_extdata *pe;
+  sb=&pdata->superblock;
+  pe=&pdata->extdata;
+  if (sb->addr!=SUPERBLOCK)
+    return 0;                          // No superblock yet
+  if ((sb->mode & PBM_EXTADDR)==0) {
+    pdata->pagebase=0;
+    return 1; };
+  if (pe->addr!=EXTBLOCK)
+    return 0;                          // No extension yet
+  if (pe->version!=EXTVERSION || pe->page==0 ||
+    (uint32_t)pe->datasize!=(uint32_t)sb->datasize ||
+    (uint32_t)pe->origsize!=(uint32_t)sb->origsize ||
+    (ushort)pe->page!=(ushort)sb->page ||
+    pe->base!=(uint64_t)(pe->page-1)*sb->pagesize) {
+    pe->addr=0;                        // Unknown version or alien extension
+    return 0; };
+  sb->datasize=pe->datasize;
+  sb->origsize=pe->origsize;
+  sb->page=pe->page;
+  pdata->pagebase=pe->base;
+  return 1;
+};
+
+// Opens descriptor of the file as soon as the label of the page is read and
+// adds blocks that were staged before. Call with fprocmutex locked.
+static void Openpagefile(t_procdata *pdata) {
+  int i;
+  pdata->fileindex=Startnextpage(&pdata->superblock);
+  if (pdata->fileindex<0)
+    return;
+  pdata->fileserial=pb_fproc[pdata->fileindex].serial;
+  for (i=0; i<pdata->ngood; i++) {
+    pdata->blocklist[i].addr+=pdata->pagebase;
+    Addblock(pdata->blocklist+i,pdata->fileindex,pdata->superblock.page); };
+  ;
+};
+
 static void Decodenextblock(t_procdata *pdata) {
-  int answer,ngroup,percent;
+  int answer,ngroup,percent,skip;
   char s[TEXTLEN];
   t_data result;
+  t_block *block,temp;
 
   // Display percent of executed data and, if known, data name in progress bar.
   //if (pdata->superblock.name[0]=='\0')
@@ -843,30 +992,73 @@ static void Decodenextblock(t_procdata *pdata) {
   if (answer>=17) {
     // Error, block is unreadable.
     pdata->nbad++; }
-  else if (result.addr==SUPERBLOCK) {
-    // Superblock.
-    pdata->superblock.addr=SUPERBLOCK;
-    pdata->superblock.datasize=((t_superdata *)&result)->datasize;
-    pdata->superblock.pagesize=((t_superdata *)&result)->pagesize;
-    pdata->superblock.origsize=((t_superdata *)&result)->origsize;
-    pdata->superblock.mode=((t_superdata *)&result)->mode;
-    pdata->superblock.page=((t_superdata *)&result)->page;
-    pdata->superblock.modified=((t_superdata *)&result)->modified;
-    pdata->superblock.attributes=((t_superdata *)&result)->attributes;
-    pdata->superblock.filecrc=((t_superdata *)&result)->filecrc;
-    memcpy(pdata->superblock.name,((t_superdata *)&result)->name,64);
+  else if (result.addr==SUPERBLOCK || result.addr==EXTBLOCK) {
+    // Superblock or its extension. All copies on the page are the same, so
+    // only the first is taken.
+    if (result.addr==EXTBLOCK) {
+      if (pdata->extdata.addr!=EXTBLOCK)
+        pdata->extdata=*(t_extdata *)&result;
+      ; }
+    else if (pdata->superblock.addr!=SUPERBLOCK) {
+      pdata->superblock.addr=SUPERBLOCK;
+      pdata->superblock.datasize=((t_superdata *)&result)->datasize;
+      pdata->superblock.pagesize=((t_superdata *)&result)->pagesize;
+      pdata->superblock.origsize=((t_superdata *)&result)->origsize;
+      pdata->superblock.mode=((t_superdata *)&result)->mode;
+      pdata->superblock.page=((t_superdata *)&result)->page;
+      pdata->superblock.modified=((t_superdata *)&result)->modified;
+      pdata->superblock.attributes=((t_superdata *)&result)->attributes;
+      pdata->superblock.filecrc=((t_superdata *)&result)->filecrc;
+      memcpy(pdata->superblock.name,((t_superdata *)&result)->name,64); };
     pdata->nsuper++;
-    pdata->nrestored+=answer; }
+    pdata->nrestored+=answer;
+    // If this page is already restored (for example, when decoding is resumed
+    // from checkpoint), there is no need to decode it once again.
+    // Otherwise, blocks go directly to the file processor from now on.
+    if (pdata->labelled==0 && Labelcomplete(pdata)) {
+      pdata->labelled=1;
+      pthread_mutex_lock(&fprocmutex);
+      skip=Pagecomplete(&pdata->superblock);
+      if (skip==0 && pb_emitshard==0) {
+        Openpagefile(pdata);
+        // Page may hold no data of the file requested by --extract.
+        if (Fileisopen(pdata) &&
+          Pageneeded(pb_fproc+pdata->fileindex,pdata->superblock.page)==0)
+          skip=2;
+        ;
+      };
+      pthread_mutex_unlock(&fprocmutex);
+      if (skip) {
+        Message(skip==1?"Page is already restored, skipping":
+          "Page holds no data of the extracted file, skipping",0);
+        pdata->step=0;
+        return;
+      };
+    }; }
   else if (pdata->ngood<pdata->nposx*pdata->nposy) {
-    // Success, place data block into the intermediate buffer.
-    pdata->blocklist[pdata->ngood].addr=result.addr & 0x0FFFFFFF;
+    // Success. If file is known, pass block to file processor, otherwise
+    // place it into the intermediate buffer.
+    if (pdata->fileindex>=0)
+      block=&temp;
+    else
+      block=pdata->blocklist+pdata->ngood;
+    block->addr=result.addr & 0x0FFFFFFF;
     ngroup=(result.addr>>28) & 0x0000000F;
     if (ngroup>0) {                    // Recovery block
-      pdata->blocklist[pdata->ngood].recsize=ngroup*NDATA;
-      pdata->superblock.ngroup=ngroup; }
+      block->recsize=ngroup*NDATA;
+      if (block->addr%NDATA==0)        // Not a column group
+        pdata->superblock.ngroup=ngroup;
+      ; }
     else                               // Data block
-      pdata->blocklist[pdata->ngood].recsize=0;
-    memcpy(pdata->blocklist[pdata->ngood].data,result.data,NDATA);
+      block->recsize=0;
+    memcpy(block->data,result.data,NDATA);
+    if (block==&temp) {
+      block->addr+=pdata->pagebase;
+      pthread_mutex_lock(&fprocmutex);
+      if (Fileisopen(pdata))
+        Addblock(block,pdata->fileindex,pdata->superblock.page);
+      pthread_mutex_unlock(&fprocmutex);
+    };
     pdata->ngood++;
     // Number of bytes corrected by ECC may be misleading (block is so good
     // it can be read with wrong settings), but I have no better indicator
@@ -886,23 +1078,73 @@ finish:
   };
 };
 
-// Passes gathered data to file processor and frees resources allocated by call
-// to Preparefordecoding().
+// Counts printed columns from the page geometry: grid lines are printed
+// along every column, even if the blocks there are damaged or empty, while
+// raster around the optional border has no line. A line is recognized if it's
+// dark in at least 3/4 of the samples taken along it. Orientations 0, 2, 5 and
+// 7 mean that bitmap is rotated by 90 degrees, so that lines are horizontal.
+static int Gridcolumns(t_procdata *pdata) {
+  int j,x,y,n,ndark,rotated,limit,sizex,sizey;
+  float pos,step,angle,t,tmin,tmax;
+  sizex=pdata->sizex;
+  sizey=pdata->sizey;
+  rotated=(pdata->orientation==0 || pdata->orientation==2 ||
+    pdata->orientation==5 || pdata->orientation==7);
+  if (rotated) {
+    pos=pdata->ypeak; step=pdata->ystep; angle=pdata->yangle;
+    tmin=pdata->gridxmin; tmax=pdata->gridxmax; }
+  else {
+    pos=pdata->xpeak; step=pdata->xstep; angle=pdata->xangle;
+    tmin=pdata->gridymin; tmax=pdata->gridymax; };
+  if (step<1.0 || tmax<=tmin)
+    return 0;
+  limit=(pdata->cmin+pdata->cmax)/2;
+  n=0;
+  for (; pos<(rotated?sizey:sizex); pos+=step) {
+    ndark=0;
+    for (j=0; j<32; j++) {
+      t=tmin+(tmax-tmin)*j/31.0;
+      if (rotated) {
+        x=t; y=pos+t*angle+0.5; }
+      else {
+        x=pos+t*angle+0.5; y=t; };
+      if (x<0 || x>=sizex || y<0 || y>=sizey)
+        continue;
+      if (pdata->data[y*sizex+x]<limit) ndark++; };
+    if (ndark>=24) n++; };
+  return (n>1?n-1:0);
+};
+
+// Finishes page in file processor and frees resources allocated by call to
+// Preparefordecoding().
 static void Finishdecoding(t_procdata *pdata) {
-  int i,fileindex;
+  int i,ncolumn;
+  t_fproc *pf;
   // Pass gathered data to file processor.
-  if (pdata->superblock.addr==0)
+  pthread_mutex_lock(&fprocmutex);
+  fprintf(pb_stdout?stderr:stdout, "ngood: %d\n", pdata->ngood);
+  fprintf(pb_stdout?stderr:stdout, "nbad: %d\n", pdata->nbad);
+  fprintf(pb_stdout?stderr:stdout, "nsuper: %d\n", pdata->nsuper);
+  fprintf(pb_stdout?stderr:stdout, "nrestored: %d\n", pdata->nrestored);
+  if (pdata->labelled==0)
     Reporterror("Page label is not readable");
-  else {
-    fileindex=Startnextpage(&pdata->superblock);
-    if (fileindex>=0) {
-      for (i=0; i<pdata->ngood; i++)
-        Addblock(pdata->blocklist+i,fileindex);
-      Finishpage(fileindex,
-        pdata->ngood+pdata->nsuper,pdata->nbad,pdata->nrestored);
-      ;
-    };
+  else if (pb_emitshard) {
+    // Shard keeps absolute addresses.
+    for (i=0; i<pdata->ngood; i++)
+      pdata->blocklist[i].addr+=pdata->pagebase;
+    Emitshard(&pdata->superblock,pdata->blocklist,pdata->ngood); }
+  else if (Fileisopen(pdata)) {
+    // Number of printed columns is necessary to locate missing blocks.
+    ncolumn=Gridcolumns(pdata);
+    pf=pb_fproc+pdata->fileindex;
+    pf->ncolumn=max(pf->ncolumn,ncolumn);
+    Finishpage(pdata->fileindex,pdata->superblock.page,
+      pdata->ngood+pdata->nsuper,pdata->nbad,pdata->nrestored);
+    ;
   };
+  if (pb_report[0]!='\0')
+    Writereport(0);
+  pthread_mutex_unlock(&fprocmutex);
   // Page processed.
   pdata->step=0;
 };
@@ -1001,3 +1243,133 @@ void Stopbitmapdecoding(t_procdata *pdata) {
   };
 };
 
+// Splits runs of n activity samples that exceed limit, separated by at least
+// GRIDGAP quiet samples, into at most maxrun ranges [run0,run1). Returns
+// number of runs.
+static int Findruns(int *distr,int n,int limit,int *run0,int *run1,
+  int maxrun) {
+  int i,nrun,gap;
+  nrun=0; gap=GRIDGAP;
+  for (i=0; i<n; i++) {
+    if (distr[i]<limit) {
+      gap++; continue; };
+    if (gap>=GRIDGAP || nrun==0) {
+      if (nrun>=maxrun) break;
+      run0[nrun]=i; nrun++; };
+    run1[nrun-1]=i+1;
+    gap=0; };
+  return nrun;
+};
+
+// Locates disjoint data grids on the bitmap, for example, two half-size
+// printouts scanned side by side. Uses the same fast intensity changes as
+// Getgridposition(), but instead of single limits finds runs of active
+// columns, and then runs of active rows within each column run. Returns
+// number of grids found.
+static int Findgrids(uchar *data,int sizex,int sizey,t_grid *grid) {
+  int i,j,k,m,nx,ny,stepx,stepy,c,cmin,cmax,limit,ngrid,nxrun,nyrun;
+  int distrx[256],distry[256],xrun0[NGRID],xrun1[NGRID];
+  int yrun0[NGRID],yrun1[NGRID];
+  uchar *act,*pd;
+  if (sizex<=3*NDOT || sizey<=3*NDOT)
+    return 0;
+  stepx=sizex/256+1; nx=(sizex-2)/stepx; if (nx>256) nx=256;
+  stepy=sizey/256+1; ny=(sizey-2)/stepy; if (ny>256) ny=256;
+  act=(uchar *)malloc(nx*ny);
+  if (act==NULL)
+    return 0;
+  memset(distrx,0,nx*sizeof(int));
+  for (j=0; j<ny; j++) {
+    pd=data+(size_t)j*stepy*sizex;
+    for (i=0; i<nx; i++,pd+=stepx) {
+      c=pd[0];         cmin=c;           cmax=c;
+      c=pd[2];         cmin=min(cmin,c); cmax=max(cmax,c);
+      c=pd[sizex+1];   cmin=min(cmin,c); cmax=max(cmax,c);
+      c=pd[2*sizex];   cmin=min(cmin,c); cmax=max(cmax,c);
+      c=pd[2*sizex+2]; cmin=min(cmin,c); cmax=max(cmax,c);
+      act[j*nx+i]=(uchar)(cmax-cmin);
+      distrx[i]+=cmax-cmin;
+    };
+  };
+  // Grids may have different heights, therefore limit is lower than in
+  // Getgridposition().
+  limit=0;
+  for (i=0; i<nx; i++) {
+    if (distrx[i]>limit) limit=distrx[i]; };
+  nxrun=Findruns(distrx,nx,limit/4,xrun0,xrun1,NGRID);
+  ngrid=0;
+  for (k=0; k<nxrun; k++) {
+    // Too narrow runs are text or noise.
+    if (xrun1[k]-xrun0[k]<nx/16) continue;
+    memset(distry,0,ny*sizeof(int));
+    for (j=0; j<ny; j++) {
+      for (i=xrun0[k]; i<xrun1[k]; i++)
+        distry[j]+=act[j*nx+i];
+      ;
+    };
+    limit=0;
+    for (j=0; j<ny; j++) {
+      if (distry[j]>limit) limit=distry[j]; };
+    nyrun=Findruns(distry,ny,limit/4,yrun0,yrun1,NGRID);
+    for (m=0; m<nyrun && ngrid<NGRID; m++) {
+      if (yrun1[m]-yrun0[m]<ny/16) continue;
+      grid[ngrid].x0=max(xrun0[k]-GRIDMARGIN,0)*stepx;
+      grid[ngrid].x1=min((xrun1[k]+GRIDMARGIN)*stepx,sizex);
+      grid[ngrid].y0=max(yrun0[m]-GRIDMARGIN,0)*stepy;
+      grid[ngrid].y1=min((yrun1[m]+GRIDMARGIN)*stepy,sizey);
+      ngrid++;
+    };
+  };
+  free(act);
+  return ngrid;
+};
+
+// Decodes single grid from the list to the end. Called by Parallelfor().
+static void Decodegrid(void *arg,int index) {
+  t_procdata *pdata;
+  pdata=(t_procdata *)arg+index;
+  while (pdata->step!=0)
+    Nextdataprocessingstep(pdata);
+  ;
+};
+
+// Starts decoding of the new bitmap, taking ownership of data. Bitmap with
+// single grid is decoded step by step in pb_procdata. If bitmap contains
+// several disjoint grids, each is cropped into its own descriptor and all
+// grids are decoded at once in pb_threads threads. In this case, decoding is
+// finished on return and pb_procdata remains idle.
+void Decodegrids(uchar *data,int sizex,int sizey) {
+  int i,j,ngrid,dx,dy;
+  char s[TEXTLEN];
+  t_grid grid[NGRID];
+  t_procdata *pgrid;
+  uchar *crop;
+  ngrid=Findgrids(data,sizex,sizey,grid);
+  pgrid=NULL;
+  if (ngrid>1)
+    pgrid=(t_procdata *)calloc(ngrid,sizeof(t_procdata));
+  if (pgrid==NULL) {
+    Startbitmapdecoding(&pb_procdata,data,sizex,sizey);
+    return; };
+  Freeprocdata(&pb_procdata);
+  memset(&pb_procdata,0,sizeof(t_procdata));
+  sprintf(s,"Found %i grids",ngrid);
+  Message(s,0);
+  for (i=0; i<ngrid; i++) {
+    dx=grid[i].x1-grid[i].x0;
+    dy=grid[i].y1-grid[i].y0;
+    crop=(uchar *)malloc((size_t)dx*dy);
+    if (crop==NULL) {
+      Reporterror("Low memory");
+      continue; };
+    for (j=0; j<dy; j++)
+      memcpy(crop+(size_t)j*dx,
+      data+(size_t)(grid[i].y0+j)*sizex+grid[i].x0,dx);
+    Startbitmapdecoding(pgrid+i,crop,dx,dy);
+  };
+  free(data);
+  Parallelfor(ngrid,pb_threads,Decodegrid,pgrid);
+  for (i=0; i<ngrid; i++)
+    Freeprocdata(pgrid+i);
+  free(pgrid);
+};
@@ -32,10 +32,15 @@
 #include <windows.h>
 #elif __linux__
 #include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
 #endif
 #include <stdlib.h>
 #include <stdint.h>
 #include <utime.h>
+#include <pthread.h>
 #include "bzlib.h"
 #include "aes.h"
 #include "pwd2key.h"
@@ -44,36 +49,418 @@
 #include "Resource.h"
 
 
+#define KEYITER        524288          // Number of PBKDF2 iterations
+#define NKEYTHREAD     8               // Max number of key derivation threads
+
+#define KEY_PENDING    0               // Key is not yet derived
+#define KEY_WORKING    1               // Key is being derived
+#define KEY_READY      2               // Key is available
+
+#define NREBUILD       64              // Blocks rebuilt from parity at once
+
+typedef struct t_keyentry {            // Cached AES key
+  uchar          salt[16];             // Salt, as stored in the file name
+  uchar          key[AESKEYLEN];       // Derived key
+  int            state;                // One of KEY_xxx
+  struct t_keyentry *next;             // Next entry in the cache
+} t_keyentry;
+
+static t_keyentry *keycache;           // List of known keys
+static int       nkeythread;           // Number of running derivation threads
+static pthread_mutex_t keymutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t keyready=PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t pwdmutex=PTHREAD_MUTEX_INITIALIZER;
+
+// Returns cached entry with given salt or NULL. Call with keymutex locked.
+static t_keyentry *Findkey(uchar *salt) {
+  t_keyentry *pk;
+  for (pk=keycache; pk!=NULL; pk=pk->next) {
+    if (memcmp(pk->salt,salt,16)==0) break; };
+  return pk;
+};
+
+// Copies password to pw, asking for it if necessary. Files are completed by
+// several decoding threads, so pb_password is accessed only under pwdmutex.
+// Password entered by user is wiped from pb_password at once. Returns 0 on
+// success and -1 on error.
+static int Copypassword(char *pw) {
+  int status;
+  pthread_mutex_lock(&pwdmutex);
+  status=Getpassword();
+  if (status==0)
+    memcpy(pw,pb_password,PASSLEN);
+  Clearpassword();
+  pthread_mutex_unlock(&pwdmutex);
+  return status;
+};
+
+// Derives key for the given entry. PBKDF2 with half a million iterations takes
+// seconds, so keymutex must be unlocked by the caller.
+static void Derivekey(t_keyentry *pk,char *pw) {
+  derive_key((const uchar *)pw,strlen(pw),
+    pk->salt,16,KEYITER,pk->key,AESKEYLEN);
+};
+
+// Key derivation thread. Takes pending keys from the cache one by one and
+// exits when there is nothing more to do.
+static void *Keythread(void *arg) {
+  int valid;
+  char pw[PASSLEN];
+  t_keyentry *pk;
+  (void)arg;
+  valid=(Copypassword(pw)==0);
+  pthread_mutex_lock(&keymutex);
+  while (valid) {
+    for (pk=keycache; pk!=NULL; pk=pk->next) {
+      if (pk->state==KEY_PENDING) break; };
+    if (pk==NULL) break;
+    pk->state=KEY_WORKING;
+    pthread_mutex_unlock(&keymutex);
+    Derivekey(pk,pw);
+    pthread_mutex_lock(&keymutex);
+    pk->state=KEY_READY;
+    pthread_cond_broadcast(&keyready); };
+  nkeythread--;
+  pthread_cond_broadcast(&keyready);
+  pthread_mutex_unlock(&keymutex);
+  memset(pw,0,sizeof(pw));
+  return NULL;
+};
+
+// Starts derivation of the key for the given salt in background. Works only
+// if password comes from batch source, because I don't want to ask user for
+// password before the data is complete. Keys for several files are derived
+// in parallel, at most one thread per key.
+void Prefetchkey(uchar *salt) {
+  t_keyentry *pk;
+  pthread_t thread;
+  char pw[PASSLEN];
+  if (pb_pwdsource==PWD_PROMPT || Copypassword(pw)!=0)
+    return;
+  memset(pw,0,sizeof(pw));
+  pthread_mutex_lock(&keymutex);
+  if (Findkey(salt)==NULL) {
+    pk=(t_keyentry *)calloc(1,sizeof(t_keyentry));
+    if (pk!=NULL) {
+      memcpy(pk->salt,salt,16);
+      pk->state=KEY_PENDING;
+      pk->next=keycache;
+      keycache=pk;
+      if (nkeythread<NKEYTHREAD &&
+        pthread_create(&thread,NULL,Keythread,NULL)==0) {
+        pthread_detach(thread);
+        nkeythread++;
+      };
+    };
+  };
+  pthread_mutex_unlock(&keymutex);
+};
+
+// Gets AES key for the given salt, either from the cache or by deriving it
+// from password. Returns 0 on success and -1 on error.
+int Getkey(uchar *salt,uchar *key) {
+  int asked;
+  char pw[PASSLEN];
+  t_keyentry *pk;
+  asked=0;
+  pthread_mutex_lock(&keymutex);
+  pk=Findkey(salt);
+  if (pk==NULL) {
+    // Password may be entered by user, so I ask for it with keymutex
+    // unlocked. Meanwhile, the same key may appear in the cache, therefore
+    // lookup and insertion are repeated under the single lock.
+    pthread_mutex_unlock(&keymutex);
+    if (Copypassword(pw)!=0)
+      return -1;                       // User cancelled decryption
+    asked=1;
+    pthread_mutex_lock(&keymutex);
+    pk=Findkey(salt);
+    if (pk==NULL) {
+      pk=(t_keyentry *)calloc(1,sizeof(t_keyentry));
+      if (pk==NULL) {
+        pthread_mutex_unlock(&keymutex);
+        memset(pw,0,sizeof(pw));
+        return -1; };
+      memcpy(pk->salt,salt,16);
+      pk->state=KEY_PENDING;
+      pk->next=keycache;
+      keycache=pk;
+    };
+  };
+  if (pk->state==KEY_PENDING) {
+    // No free thread has taken this key yet, derive it here. Key could be
+    // prefetched only from the batch password that is never asked.
+    pk->state=KEY_WORKING;
+    pthread_mutex_unlock(&keymutex);
+    if (asked==0 && Copypassword(pw)!=0) {
+      pthread_mutex_lock(&keymutex);
+      pk->state=KEY_PENDING;
+      pthread_mutex_unlock(&keymutex);
+      return -1; };
+    asked=1;
+    Derivekey(pk,pw);
+    pthread_mutex_lock(&keymutex);
+    pk->state=KEY_READY;
+    pthread_cond_broadcast(&keyready); }
+  else {
+    while (pk->state!=KEY_READY)
+      pthread_cond_wait(&keyready,&keymutex);
+    ;
+  };
+  memcpy(key,pk->key,AESKEYLEN);
+  pthread_mutex_unlock(&keymutex);
+  if (asked)
+    memset(pw,0,sizeof(pw));
+  return 0;
+};
+
+// Removes key from the cache, for example, if password was wrong.
+void Forgetkey(uchar *salt) {
+  t_keyentry *pk,**ppk;
+  pthread_mutex_lock(&keymutex);
+  for (ppk=&keycache; *ppk!=NULL; ppk=&(*ppk)->next) {
+    pk=*ppk;
+    if (pk->state!=KEY_READY || memcmp(pk->salt,salt,16)!=0)
+      continue;
+    *ppk=pk->next;
+    memset(pk,0,sizeof(t_keyentry));
+    free(pk);
+    break; };
+  pthread_mutex_unlock(&keymutex);
+};
+
+// Waits for running derivations and wipes all cached keys.
+void Clearkeycache(void) {
+  t_keyentry *pk;
+  pthread_mutex_lock(&keymutex);
+  while (nkeythread>0)
+    pthread_cond_wait(&keyready,&keymutex);
+  while (keycache!=NULL) {
+    pk=keycache;
+    keycache=pk->next;
+    memset(pk,0,sizeof(t_keyentry));
+    free(pk); };
+  pthread_mutex_unlock(&keymutex);
+  pthread_mutex_lock(&pwdmutex);
+  memset(pb_password,0,sizeof(pb_password));
+  pb_pwdvalid=0;
+  pthread_mutex_unlock(&pwdmutex);
+};
+
+static int       *fprochash;           // Heads of hash chains, -1 if empty
+static int       nfprochash;           // Number of hash chains, power of 2
+static int       freefproc=-1;         // First free descriptor, -1 if none
+static uint32_t  fprocserial;          // Serial number of the last descriptor
+
+// Calculates hash of the file identity: name (case-insensitive), mode, time
+// and sizes. Files that match in Startnextpage() always have the same hash.
+static uint32_t Hashfproc(char *name,uint32_t mode,FileTimePortable *modified,
+  uint64_t datasize,uint64_t origsize) {
+  int i;
+  uint32_t h;
+  h=2166136261u;                       // FNV-1a
+  for (i=0; i<64 && name[i]!='\0'; i++)
+    h=(h^(uchar)tolower((uchar)name[i]))*16777619u;
+  h=(h^mode)*16777619u;
+  h=(h^modified->dwLowDateTime)*16777619u;
+  h=(h^modified->dwHighDateTime)*16777619u;
+  h=(h^(uint32_t)(datasize^(datasize>>32)))*16777619u;
+  h=(h^(uint32_t)(origsize^(origsize>>32)))*16777619u;
+  return h;
+};
+
+// Doubles the table of processed files and rebuilds hash chains. Existing
+// descriptors keep their indices. Returns 0 on success and -1 on error.
+static int Growfproc(void) {
+  int i,n,*ph;
+  t_fproc *pf;
+  n=(pb_nfproc==0?NFILE:pb_nfproc*2);
+  pf=(t_fproc *)realloc(pb_fproc,n*sizeof(t_fproc));
+  if (pf==NULL)
+    return -1;
+  pb_fproc=pf;
+  ph=(int *)realloc(fprochash,2*n*sizeof(int));
+  if (ph==NULL)
+    return -1;
+  fprochash=ph;
+  nfprochash=2*n;
+  memset(pb_fproc+pb_nfproc,0,(n-pb_nfproc)*sizeof(t_fproc));
+  for (i=n-1; i>=pb_nfproc; i--) {
+    pb_fproc[i].next=freefproc;
+    freefproc=i; };
+  pb_nfproc=n;
+  for (i=0; i<nfprochash; i++)
+    fprochash[i]=-1;
+  for (i=0; i<pb_nfproc; i++) {
+    if (pb_fproc[i].busy==0) continue;
+    pb_fproc[i].next=fprochash[pb_fproc[i].hash & (nfprochash-1)];
+    fprochash[pb_fproc[i].hash & (nfprochash-1)]=i; };
+  return 0;
+};
+
+// Allocates zeroed storage for the gathered data. Data of large files is not
+// kept in memory: blocks are written directly to their place in the sparse
+// temporary file, so that memory occupied by the pending file is limited to
+// the bitmap of valid blocks and recovery blocks of the current page. Returns
+// 0 on success and -1 on error.
+static int Allocfprocdata(t_fproc *pf) {
+  size_t size;
+  size=(size_t)pf->nblock*NDATA;
+  pf->data=NULL;
+  pf->spill=NULL;
+#ifdef __linux__
+  if (size>FPROCMEM) {
+    pf->spill=tmpfile();
+    if (pf->spill!=NULL) {
+      if (ftruncate(fileno(pf->spill),size)==0)
+        return 0;                      // Holes read as zeros
+      fclose(pf->spill);
+      pf->spill=NULL;
+    };
+  };
+#endif
+  pf->data=(uchar *)calloc(size,sizeof(uchar));
+  return (pf->data==NULL?-1:0);
+};
+
+// Frees storage for the gathered data.
+static void Freefprocdata(t_fproc *pf) {
+  if (pf->spill!=NULL)
+    fclose(pf->spill);                 // Temporary file is deleted
+  if (pf->data!=NULL)
+    free(pf->data);
+  pf->data=NULL;
+  pf->spill=NULL;
+};
+
+// Reads piece of gathered data to buf. Returns 0 on success and -1 on error.
+int Readfprocdata(t_fproc *pf,uint64_t offset,uint32_t length,uchar *buf) {
+#ifdef __linux__
+  ssize_t n;
+#endif
+  if (pf->spill==NULL) {
+    memcpy(buf,pf->data+offset,length);
+    return 0; };
+#ifdef __linux__
+  while (length>0) {
+    n=pread(fileno(pf->spill),buf,length,offset);
+    if (n<=0)
+      return -1;
+    buf+=n; offset+=n; length-=n; };
+  return 0;
+#else
+  return -1;
+#endif
+};
+
+// Writes piece of gathered data. Returns 0 on success and -1 on error.
+int Writefprocdata(t_fproc *pf,uint64_t offset,uchar *data,uint32_t length) {
+#ifdef __linux__
+  ssize_t n;
+#endif
+  if (pf->spill==NULL) {
+    memcpy(pf->data+offset,data,length);
+    return 0; };
+#ifdef __linux__
+  while (length>0) {
+    n=pwrite(fileno(pf->spill),data,length,offset);
+    if (n<=0)
+      return -1;
+    data+=n; offset+=n; length-=n; };
+  return 0;
+#else
+  return -1;
+#endif
+};
 
+// Extends storage of the gathered data and bitmap of valid blocks so that
+// they include block with given index on the parity page. Parity pages are
+// placed after the last data page, storage grows as they arrive. Returns 0 on
+// success and -1 if index is outside the parity pages or on error.
+static int Growparity(t_fproc *pf,int index) {
+  int first,nparity;
+  uint32_t nold,nnew;
+  uchar *pv,*pd,*ps;
+  if ((pf->mode & PBM_PAGEPARITY)==0 || pf->pagesize<NDATA || pf->npages==0)
+    return -1;                         // No parity pages
+  first=pf->npages*(pf->pagesize/NDATA);
+  if (index<first)
+    return -1;                         // Padding of the last data page
+  nparity=(index-first)/(pf->pagesize/NDATA)+1;
+  if (nparity>NPARMAX*Paritystripes(pf->npages))
+    return -1;                         // Outside the parity pages
+  if (nparity<=pf->nparity)
+    return 0;                          // Storage is already available
+  nold=pf->nalloc;
+  nnew=first+nparity*(pf->pagesize/NDATA);
+  pv=(uchar *)realloc(pf->valid,(nnew+7)/8);
+  if (pv==NULL)
+    return -1;
+  memset(pv+(nold+7)/8,0,(nnew+7)/8-(nold+7)/8);
+  pf->valid=pv;
+  if (pf->saved!=NULL) {
+    ps=(uchar *)realloc(pf->saved,(nnew+7)/8);
+    if (ps==NULL)
+      return -1;
+    memset(ps+(nold+7)/8,0,(nnew+7)/8-(nold+7)/8);
+    pf->saved=ps; };
+  if (pf->spill!=NULL) {
+#ifdef __linux__
+    if (ftruncate(fileno(pf->spill),(off_t)nnew*NDATA)!=0)
+      return -1;
+#endif
+    ; }
+  else {
+    pd=(uchar *)realloc(pf->data,(size_t)nnew*NDATA);
+    if (pd==NULL)
+      return -1;
+    memset(pd+(size_t)nold*NDATA,0,(size_t)(nnew-nold)*NDATA);
+    pf->data=pd; };
+  pf->nparity=nparity;
+  pf->nalloc=nnew;
+  return 0;
+};
 
 // Clears descriptor of processed file
 void Closefproc(int slot) {
-  if (slot<0 || slot>=NFILE)
+  int *pi;
+  if (slot<0 || slot>=pb_nfproc)
     return;                            // Error in input data
-  if (pb_fproc[slot].datavalid!=NULL)
-    free(pb_fproc[slot].datavalid);
-  if (pb_fproc[slot].data!=NULL)
-    free(pb_fproc[slot].data);
+  if (pb_fproc[slot].busy==0)
+    return;                            // Descriptor is not in use
+  // Remove descriptor from the hash chain.
+  pi=fprochash+(pb_fproc[slot].hash & (nfprochash-1));
+  while (*pi>=0 && *pi!=slot)
+    pi=&pb_fproc[*pi].next;
+  if (*pi==slot)
+    *pi=pb_fproc[slot].next;
+  if (pb_fproc[slot].valid!=NULL)
+    free(pb_fproc[slot].valid);
+  if (pb_fproc[slot].rec!=NULL)
+    free(pb_fproc[slot].rec);
+  if (pb_fproc[slot].pagedone!=NULL)
+    free(pb_fproc[slot].pagedone);
+  if (pb_fproc[slot].saved!=NULL)
+    free(pb_fproc[slot].saved);
+  Freefprocdata(pb_fproc+slot);
   memset(pb_fproc+slot,0,sizeof(t_fproc));
+  pb_fproc[slot].next=freefproc;
+  freefproc=slot;
   //Updatefileinfo(slot,pb_fproc+slot); //GUI
 };
 
 
 
-// Starts new decoded page. Returns non-negative index to table of processed
-// files on success or -1 on error.
-int Startnextpage(t_superblock *superblock) {
-  int i,slot,freeslot;
+// Locates descriptor of the file described by superblock. Returns index of
+// descriptor or -1 if file is not yet processed.
+static int Findfproc(t_superblock *superblock,uint32_t hash) {
+  int slot;
   t_fproc *pf;
-  // Check whether file is already in the list of processed files. If not,
-  // initialize new descriptor.
-  freeslot=-1;
-  for (slot=0,pf=pb_fproc; slot<NFILE; slot++,pf++) {
-    if (pf->busy==0) {                 // Empty descriptor
-      if (freeslot<0) freeslot=slot;
-      continue; };
-
-    
+  slot=(nfprochash==0?-1:fprochash[hash & (nfprochash-1)]);
+  for ( ; slot>=0; slot=pf->next) {
+    pf=pb_fproc+slot;
+    if (pf->hash!=hash)
+      continue;                        // Different identity
     if (strnicmp(pf->name,superblock->name,64)!=0)
       continue;                        // Different file name
     if (pf->mode!=superblock->mode)
@@ -85,26 +472,51 @@ int Startnextpage(t_superblock *superblock) {
       continue;                        // Different compressed size
     if (pf->origsize!=superblock->origsize)
       continue;                        // Different original size
-    // File found. Check for the case of two backup copies printed with
-    // different settings.
-    if (pf->pagesize!=superblock->pagesize)
-      pf->pagesize=0;
     break; };
-  if (slot>=NFILE) {
+  return slot;
+};
+
+// Starts new decoded page. Returns non-negative index to table of processed
+// files on success or -1 on error. Files are located by the hash of their
+// identity, table grows as necessary, so number of simultaneously processed
+// files is limited only by memory.
+int Startnextpage(t_superblock *superblock) {
+  int slot;
+  uint32_t hash;
+  t_fproc *pf;
+  // Size that doesn't fit into the block address is an error in the data.
+  if (superblock->datasize>
+    ((superblock->mode & PBM_EXTADDR)?MAXEXTSIZE:MAXSIZE)) {
+    Reporterror("Invalid data size");
+    return -1; };
+  // Check whether file is already in the list of processed files. If not,
+  // initialize new descriptor.
+  hash=Hashfproc(superblock->name,superblock->mode,&superblock->modified,
+    superblock->datasize,superblock->origsize);
+  slot=Findfproc(superblock,hash);
+  // File found. Check for the case of two backup copies printed with
+  // different settings.
+  if (slot>=0 && pb_fproc[slot].pagesize!=superblock->pagesize)
+    pb_fproc[slot].pagesize=0;
+  if (slot<0) {
     // No matching descriptor, create new one.
-    if (freeslot<0) {
-      Reporterror("Maximal number of processed files exceeded");
+    if (freefproc<0 && Growfproc()!=0) {
+      Reporterror("Low memory");
       return -1; };
-    slot=freeslot;
+    slot=freefproc;
     pf=pb_fproc+slot;
+    freefproc=pf->next;
     memset(pf,0,sizeof(t_fproc));
     // Allocate block and recovery tables.
     pf->nblock=(superblock->datasize+NDATA-1)/NDATA;
-    pf->datavalid=(uchar *)calloc(pf->nblock, sizeof(uchar));
-    pf->data=(uchar *)calloc(pf->nblock*NDATA, sizeof(uchar));
-    if (pf->datavalid==NULL || pf->data==NULL) {
-      if (pf->datavalid!=NULL) free(pf->datavalid);
-      if (pf->data!=NULL) free(pf->data);
+    pf->nalloc=pf->nblock;
+    pf->valid=(uchar *)calloc((pf->nblock+7)/8,sizeof(uchar));
+    if (pf->valid==NULL || Allocfprocdata(pf)!=0) {
+      if (pf->valid!=NULL) free(pf->valid);
+      Freefprocdata(pf);
+      memset(pf,0,sizeof(t_fproc));
+      pf->next=freefproc;
+      freefproc=slot;
       Reporterror("Low memory");
       return -1; 
     };
@@ -122,77 +534,403 @@ int Startnextpage(t_superblock *superblock) {
     else
       pf->npages=0;
     pf->ndata=0;
-    for (i=0; i<pf->npages && i<8; i++)
-      pf->rempages[i]=i+1;
+    if (pf->npages>0) {
+      pf->pagedone=(uchar *)calloc((pf->npages+7)/8,sizeof(uchar));
+      if (pf->pagedone==NULL)
+        pf->npages=0;                  // Pages are not reported
+      ;
+    };
     // Initialize statistics and declare descriptor as busy.
     pf->goodblocks=0;
     pf->badblocks=0;
     pf->restoredbytes=0;
     pf->recoveredblocks=0;
-    pf->busy=1; };
-  // Invalidate page limits and report success.
+    pf->busy=1;
+    pf->serial=++fprocserial;
+    pf->hash=hash;
+    pf->next=fprochash[hash & (nfprochash-1)];
+    fprochash[hash & (nfprochash-1)]=slot;
+    // Start key derivation as soon as possible, it takes a lot of time.
+    if (pf->mode & PBM_ENCRYPTED)
+      Prefetchkey((uchar *)(pf->name)+32);
+    ;
+  };
+  // Report success.
   pf=pb_fproc+slot;
   pf->page=superblock->page;
-  pf->ngroup=superblock->ngroup;
-  pf->minpageaddr=0xFFFFFFFF;
-  pf->maxpageaddr=0;
+  // Page where no recovery block was read keeps redundancy of the file.
+  if (superblock->ngroup>0)
+    pf->ngroup=superblock->ngroup;
+  ;
   //Updatefileinfo(slot,pf);
   return slot;
 };
 
-// Adds block recognized by decoder to file described by file descriptor with
-// specified index. Returns 0 on success and -1 on any error.
-int Addblock(t_block *block,int slot) {
-  int i,j;
+// Checks whether page described by superblock needs no decoding, because the
+// whole file is already saved or all data blocks of the page are restored.
+// Returns 1 if page may be skipped and 0 otherwise.
+int Pagecomplete(t_superblock *superblock) {
+  int j,slot,firstblock;
+  t_fproc *pf;
+  if (Isfiledone(superblock))
+    return 1;
+  slot=Findfproc(superblock,Hashfproc(superblock->name,superblock->mode,
+    &superblock->modified,superblock->datasize,superblock->origsize));
+  if (slot<0)
+    return 0;
+  pf=pb_fproc+slot;
+  if (pf->pagesize==0 || pf->pagesize!=superblock->pagesize ||
+    superblock->page<1)
+    return 0;
+  firstblock=(superblock->page-1)*(pf->pagesize/NDATA);
+  if (firstblock>=pf->nblock)
+    return 0;
+  for (j=firstblock; j<firstblock+pf->pagesize/NDATA && j<pf->nblock; j++) {
+    if ((pf->valid[j>>3] & (1<<(j & 7)))==0) return 0; };
+  return 1;
+};
+
+// XORs NDATA bytes of src into dst.
+static void Xorblock(uchar *dst,uchar *src) {
+  int i;
+  i=0;
+#ifdef __SSE2__
+  for ( ; i+16<=NDATA; i+=16) {
+    _mm_storeu_si128((__m128i *)(dst+i),_mm_xor_si128(
+      _mm_loadu_si128((__m128i *)(dst+i)),_mm_loadu_si128((__m128i *)(src+i))));
+  };
+#endif
+  for ( ; i<NDATA; i++)
+    dst[i]^=src[i];
+  ;
+};
+
+// Checks whether block with given index is padding after the end of data on
+// the last data page. Padding is printed as zeros and never stored.
+static int Ispadding(t_fproc *pf,int i) {
+  if (i<pf->nblock)
+    return 0;
+  if (pf->nparity>0 && i>=pf->npages*(pf->pagesize/NDATA))
+    return 0;                          // Block of parity page
+  return 1;
+};
+
+// Counts missing data blocks in the group of ngroup blocks that starts with
+// block r, stride blocks apart. Returns number of missing blocks and index of
+// the last of them in imis.
+static int Countmissing(t_fproc *pf,int r,int ngroup,int stride,int *imis) {
+  int i,n,nmis;
+  nmis=0;
+  for (n=0,i=r; n<ngroup; n++,i+=stride) {
+    if (Ispadding(pf,i))
+      continue;
+    if ((pf->valid[i>>3] & (1<<(i & 7)))==0) {
+      nmis++; *imis=i; };
+  };
+  return nmis;
+};
+
+// Restores the only missing block irec in the group from the recovery data.
+// Recovery data is destroyed. Returns 0 on success and -1 on error.
+static int Recovergroup(t_fproc *pf,int r,int ngroup,int stride,int irec,
+  uchar *pr) {
+  int i,j,n;
+  uchar buf[NDATA];
+  // Invert recovery data.
+  for (j=0; j<NDATA; j++) pr[j]^=0xFF;
+  // XOR recovery data with good data blocks. Padding is zero.
+  for (n=0,i=r; n<ngroup; n++,i+=stride) {
+    if (i==irec || Ispadding(pf,i)) continue;
+    if (Readfprocdata(pf,(uint64_t)i*NDATA,NDATA,buf)!=0)
+      return -1;
+    Xorblock(pr,buf); };
+  if (Writefprocdata(pf,(uint64_t)irec*NDATA,pr,NDATA)!=0)
+    return -1;
+  pf->valid[irec>>3]|=(uchar)(1<<(irec & 7));
+  pf->recoveredblocks++;
+  if (irec<pf->nblock)                 // Parity blocks are not counted
+    pf->ndata++;
+  return 0;
+};
+
+// Restores missing blocks from the kept recovery blocks (max. 1 per group).
+// With column groups, every block belongs to two groups, and block restored
+// in one group may complete the other, so I repeat until there is no more
+// progress (peeling). Used and complete groups are removed from the list.
+static void Peelgroups(t_fproc *pf) {
+  int k,n,irec,progress;
+  t_recblock *prec;
+  do {
+    progress=0;
+    for (k=0; k<pf->nrec; k++) {
+      prec=pf->rec+k;
+      n=Countmissing(pf,prec->group,prec->ngroup,prec->stride,&irec);
+      if (n==1 && Recovergroup(pf,prec->group,prec->ngroup,prec->stride,
+        irec,prec->data)==0)
+        progress=1;
+      if (n<=1) {
+        *prec=pf->rec[--pf->nrec];
+        k--;
+      };
+    };
+  } while (progress);
+};
+
+// Checks whether block with given index belongs to the group of some kept
+// recovery block.
+static int Ingroupofkept(t_fproc *pf,int i) {
+  int k;
+  t_recblock *prec;
+  for (k=0,prec=pf->rec; k<pf->nrec; k++,prec++) {
+    if (i>=prec->group && (i-prec->group)%prec->stride==0 &&
+      (i-prec->group)/prec->stride<prec->ngroup)
+      return 1;
+    ;
+  };
+  return 0;
+};
+
+// Adds block recognized by decoder on the given page (0 if page is unknown)
+// to file described by file descriptor with specified index. Data blocks are
+// written directly to their place in file. Group is restored as soon as its
+// only missing block is known: either when recovery block arrives, or when
+// data block arrives that completes the group of kept recovery block.
+// Otherwise recovery block is kept until its page is finished. Several pages
+// of the same file may be decoded simultaneously, so each kept block notes
+// its page. Returns 0 on success and -1 on any error.
+int Addblock(t_block *block,int slot,int page) {
+  int i,j,n,ngroup,stride,last,bpp;
+  uchar buf[NDATA];
   t_fproc *pf;
-  if (slot<0 || slot>=NFILE)
+  t_recblock *prec;
+  if (slot<0 || slot>=pb_nfproc)
     return -1;                         // Invalid index of file descriptor
   pf=pb_fproc+slot;
   if (pf->busy==0)
     return -1;                         // Index points to unused descriptor
+  if (block->addr/NDATA>=0x7FFFFFFF)
+    return -1;                         // Address is out of range
   // Add block to descriptor.
   if (block->recsize==0) {
     // Ordinary data block.
     i=block->addr/NDATA;
-    if ((uint32_t)(i*NDATA)!=block->addr)
+    if ((uint64_t)i*NDATA!=block->addr)
       return -1;                       // Invalid data alignment
-    if (i>=pf->nblock)
+    if (i>=pf->nblock && Growparity(pf,i)!=0)
       return -1;                       // Data outside the data size
-    if (pf->datavalid[i]!=1) {
-      memcpy(pf->data+block->addr,block->data,NDATA);
-      pf->datavalid[i]=1;              // Valid data
-      pf->ndata++; };
-    pf->minpageaddr=min(pf->minpageaddr,block->addr);
-    pf->maxpageaddr=max(pf->maxpageaddr,block->addr+NDATA); }
+    if ((pf->valid[i>>3] & (1<<(i & 7)))==0) {
+      if (Writefprocdata(pf,block->addr,block->data,NDATA)!=0)
+        return -1;                     // I/O error
+      pf->valid[i>>3]|=(uchar)(1<<(i & 7));
+      if (i<pf->nblock)
+        pf->ndata++;
+      // Late block may leave single missing block in some group.
+      if (pf->nrec>0 && Ingroupofkept(pf,i))
+        Peelgroups(pf);
+      ;
+    }; }
   else {
-    // Data recovery block. I write it to all free locations within the group.
-    if (block->recsize!=(uint32_t)(pf->ngroup*NDATA))
+    // Data recovery block.
+    ngroup=block->recsize/NDATA;
+    if (ngroup<1 || ngroup>15 || (uint32_t)(ngroup*NDATA)!=block->recsize)
       return -1;                       // Invalid recovery scope
-    i=block->addr/block->recsize;
-    if (i*block->recsize!=block->addr)
-      return -1;                       // Invalid data alignment
+    stride=block->addr%NDATA;
+    if (stride==0) {
+      // Group of consecutive blocks. All such groups on the page have the
+      // same scope, so it defines redundancy of the page.
+      if (block->addr%block->recsize!=0)
+        return -1;                     // Invalid data alignment
+      pf->ngroup=ngroup;
+      stride=1; }
+    else {
+      // Column group. Address is not aligned, its remainder is the distance
+      // between the blocks of the group.
+      if ((pf->mode & PBM_COLUMNGROUPS)==0 ||
+        stride<NGROUPMIN || stride>NGROUPMAX)
+        return -1;                     // Invalid data alignment
+      ;
+    };
     i=block->addr/NDATA;
-    for (j=i; j<i+pf->ngroup; j++) {
-      if (j>=pf->nblock)
+    if (stride>1) {
+      // Column group always has redundancy blocks, so that older versions
+      // read the same scope from all recovery blocks. Blocks that would lie
+      // past the end of the page are zero and are not part of the group.
+      if (pf->pagesize<NDATA)
+        return -1;                     // Page size is unknown
+      bpp=pf->pagesize/NDATA;
+      ngroup=min(ngroup,(i/bpp*bpp+bpp-i+stride-1)/stride); };
+    last=i+(ngroup-1)*stride;
+    if (last>=pf->nblock) {
+      // Group may include padding of the last data page or belong to parity
+      // page.
+      if (i<pf->nblock && Ispadding(pf,last)==0)
         return -1;                     // Data outside the data size
-      if (pf->datavalid[j]!=0) continue;
-      memcpy(pf->data+j*NDATA,block->data,NDATA);
-      pf->datavalid[j]=2; };           // Valid recovery data
-    pf->minpageaddr=min(pf->minpageaddr,block->addr);
-    pf->maxpageaddr=max(pf->maxpageaddr,block->addr+block->recsize);
+      if (i>=pf->nblock && Growparity(pf,last)!=0)
+        return -1;
+      ;
+    };
+    n=Countmissing(pf,i,ngroup,stride,&j);
+    if (n==0)
+      return 0;                        // Group is complete
+    if (n>1) {
+      // Keep block, missing data may appear later on the page.
+      if (pf->nrec>=pf->maxrec) {
+        n=max(16,pf->maxrec*2);
+        prec=(t_recblock *)realloc(pf->rec,n*sizeof(t_recblock));
+        if (prec==NULL)
+          return -1;                   // Low memory
+        pf->rec=prec;
+        pf->maxrec=n; };
+      prec=pf->rec+pf->nrec;
+      prec->group=i;
+      prec->ngroup=ngroup;
+      prec->stride=stride;
+      prec->page=page;
+      memcpy(prec->data,block->data,NDATA);
+      pf->nrec++; }
+    else {
+      memcpy(buf,block->data,NDATA);
+      if (Recovergroup(pf,i,ngroup,stride,j,buf)!=0)
+        return -1;
+      ;
+    };
   };
   // Report success.
   return 0;
 };
 
-// Processes gathered data. Returns -1 on error, 0 if file is complete and
+// Checks whether all blocks of the page are valid. Page index is 0-based,
+// parity pages follow data pages. Returns 1 if page is complete and 0
+// otherwise.
+static int Pagevalid(t_fproc *pf,int page) {
+  int j,first,last;
+  first=page*(pf->pagesize/NDATA);
+  if (page<pf->npages)
+    last=min(first+pf->pagesize/NDATA,pf->nblock);
+  else if (page-pf->npages<pf->nparity)
+    last=first+pf->pagesize/NDATA;
+  else
+    return 0;                          // Parity page never arrived
+  for (j=first; j<last; j++) {
+    if ((pf->valid[j>>3] & (1<<(j & 7)))==0) return 0; };
+  return 1;
+};
+
+// Rebuilds lost data pages from the parity pages. Stripe can be rebuilt if
+// it has at least as many complete parity pages as incomplete data pages.
+// Parity minus contribution of the known pages (syndrome) equals the sum of
+// missing pages multiplied by the square Cauchy submatrix, so missing pages
+// are syndromes multiplied by the inverted submatrix. Pages are processed in
+// pieces of NREBUILD blocks.
+static void Rebuildpages(t_fproc *pf) {
+  int i,j,k,r,s,m,p,n,l,first,bpp,nstripe,nrebuilt;
+  int mis[NPARMAX],row[NPARMAX];
+  uint32_t length;
+  uchar a[NPARMAX*NPARMAX],*buf,*syn;
+  char msg[TEXTLEN];
+  if ((pf->mode & PBM_PAGEPARITY)==0 || pf->nparity==0 ||
+    pf->pagesize<NDATA)
+    return;
+  bpp=pf->pagesize/NDATA;
+  nstripe=Paritystripes(pf->npages);
+  buf=NULL;
+  nrebuilt=0;
+  for (s=0; s<nstripe; s++) {
+    // Find incomplete data pages of the stripe.
+    m=0;
+    for (i=0,p=s; p<pf->npages && m<=NPARMAX; i++,p+=nstripe) {
+      if (Pagevalid(pf,p)==0) {
+        if (m<NPARMAX) mis[m]=i;
+        m++;
+      };
+    };
+    if (m==0 || m>NPARMAX)
+      continue;                        // Nothing to do or too many losses
+    // Select the same number of complete parity pages.
+    n=0;
+    for (j=0; j<NPARMAX && n<m; j++) {
+      if (Pagevalid(pf,pf->npages+j*nstripe+s)) row[n++]=j; };
+    if (n<m)
+      continue;                        // Not enough parity yet
+    for (r=0; r<m; r++) {
+      for (k=0; k<m; k++)
+        a[r*m+k]=Paritycoef(row[r],mis[k]);
+      ;
+    };
+    if (Gfinvertmatrix(a,m)!=0)
+      continue;                        // Must not happen
+    if (buf==NULL) {
+      buf=(uchar *)malloc((NPARMAX+1)*NREBUILD*NDATA);
+      if (buf==NULL) {
+        Reporterror("Low memory, can't rebuild lost pages");
+        return;
+      };
+    };
+    syn=buf+NREBUILD*NDATA;
+    for (j=0; j<bpp; j+=n) {
+      n=min(bpp-j,NREBUILD);
+      length=n*NDATA;
+      // Start with parity.
+      for (r=0; r<m; r++) {
+        first=(pf->npages+row[r]*nstripe+s)*bpp+j;
+        if (Readfprocdata(pf,(uint64_t)first*NDATA,length,syn+r*length)!=0)
+          goto error;
+        ;
+      };
+      // Subtract known pages. Data beyond the end of file is zero.
+      for (i=0,p=s; p<pf->npages; i++,p+=nstripe) {
+        for (k=0; k<m && mis[k]!=i; k++);
+        first=p*bpp+j;
+        if (k<m || first>=pf->nblock)
+          continue;
+        l=min(n,pf->nblock-first)*NDATA;
+        if (Readfprocdata(pf,(uint64_t)first*NDATA,l,buf)!=0)
+          goto error;
+        for (r=0; r<m; r++)
+          Gfmuladd(syn+r*length,buf,Paritycoef(row[r],i),l);
+        ;
+      };
+      // Calculate missing pages.
+      for (k=0; k<m; k++) {
+        first=(s+mis[k]*nstripe)*bpp+j;
+        if (first>=pf->nblock)
+          continue;
+        l=min(n,pf->nblock-first);
+        memset(buf,0,l*NDATA);
+        for (r=0; r<m; r++)
+          Gfmuladd(buf,syn+r*length,a[k*m+r],l*NDATA);
+        if (Writefprocdata(pf,(uint64_t)first*NDATA,buf,l*NDATA)!=0)
+          goto error;
+        for (i=first; i<first+l; i++) {
+          if (pf->valid[i>>3] & (1<<(i & 7)))
+            continue;
+          pf->valid[i>>3]|=(uchar)(1<<(i & 7));
+          pf->recoveredblocks++;
+          pf->ndata++;
+        };
+      };
+    };
+    nrebuilt+=m;
+  };
+  free(buf);
+  if (nrebuilt>0) {
+    sprintf(msg,"%i lost page(s) rebuilt from parity pages",nrebuilt);
+    Message(msg,0); };
+  return;
+error:
+  free(buf);
+  Reporterror("Unable to rebuild lost pages");
+};
+
+// Processes gathered data of the page (0 if blocks came from no particular
+// page, as from shards). Returns -1 on error, 0 if file is complete and
 // number of pages to scan if there is still missing data. In the last case,
-// fills list of several first remaining pages in file descriptor.
-int Finishpage(int slot,int ngood,int nbad,uint32_t nrestored) {
-  int i,j,r,rmin,rmax,nrec,irec,firstblock,nrempages;
-  uchar *pr,*pd;
+// marks complete pages in file descriptor.
+int Finishpage(int slot,int page,int ngood,int nbad,uint32_t nrestored) {
+  int i,j,k,n,firstblock;
   t_fproc *pf;
-  if (slot<0 || slot>=NFILE)
+  t_recblock *prec;
+  if (slot<0 || slot>=pb_nfproc)
     return -1;                         // Invalid index of file descriptor
   pf=pb_fproc+slot;
   if (pf->busy==0)
@@ -203,75 +941,54 @@ int Finishpage(int slot,int ngood,int nbad,uint32_t nrestored) {
   pf->badblocks+=nbad;
   pf->restoredbytes+=nrestored;
 
-  printf("ngood: %d\n", pb_procdata.ngood);
-  printf("nbad: %d\n", pb_procdata.nbad);
-  printf("nsuper: %d\n", pb_procdata.nsuper);
-  printf("nrestored: %d\n", pb_procdata.nrestored);
-
-  // Restore bad blocks if corresponding recovery blocks are available (max. 1
-  // per group).
-  if (pf->ngroup>0) {
-    rmin=(pf->minpageaddr/(NDATA*pf->ngroup))*pf->ngroup;
-    rmax=(pf->maxpageaddr/(NDATA*pf->ngroup))*pf->ngroup;
-    // Walk groups of data on current page, one by one.
-    for (r=rmin; r<=rmax; r+=pf->ngroup) {
-      if (r+pf->ngroup>pf->nblock)
-        break;                         // Inconsistent data
-      // Count blocks with recovery data in the group.
-      nrec=0;
-      for (i=r; i<r+pf->ngroup; i++) {
-        if (pf->datavalid[i]==2) {
-          nrec++; irec=i;
-          pf->datavalid[i]=0;          // Prepare for next round
-        };
-      };
-      if (nrec==1) {
-        // Exactly one block in group is missing, recovery is possible.
-        pr=pf->data+irec*NDATA;
-        // Invert recovery data.
-        for (j=0; j<NDATA; j++) *pr++^=0xFF;
-        // XOR recovery data with good data blocks.
-        for (i=r; i<r+pf->ngroup; i++) {
-          if (i==irec) continue;
-          pr=pf->data+irec*NDATA;
-          pd=pf->data+i*NDATA;
-          for (j=0; j<NDATA; j++) {
-            *pr++^=*pd++;
-          };
-        };
-        pf->datavalid[irec]=1;
-        pf->recoveredblocks++;
-        pf->ndata++;
-      };
-    };
-  };
+  // Restore bad blocks if corresponding recovery blocks are available. Only
+  // groups that were incomplete when their recovery block arrived are
+  // checked. Then unused recovery blocks of this page are discarded; blocks
+  // of other pages that are decoded at the same time remain.
+  Peelgroups(pf);
+  for (k=0; k<pf->nrec; k++) {
+    prec=pf->rec+k;
+    if (page>0 && prec->page!=page)
+      continue;
+    *prec=pf->rec[--pf->nrec];
+    k--; };
+  // Rebuild lost pages if file has parity pages.
+  Rebuildpages(pf);
   // Check whether there are still bad blocks on the page.
-  firstblock=(pf->page-1)*(pf->pagesize/NDATA);
-  for (j=firstblock; j<firstblock+pf->pagesize/NDATA && j<pf->nblock; j++) {
-    if (pf->datavalid[j]!=1) break; };
-  if (j<firstblock+pf->pagesize/NDATA && j<pf->nblock)
+  firstblock=(page-1)*(pf->pagesize/NDATA);
+  for (j=firstblock; page>0 && j<firstblock+pf->pagesize/NDATA &&
+    j<pf->nblock; j++) {
+    if ((pf->valid[j>>3] & (1<<(j & 7)))==0) break; };
+  if (page>0 && j<firstblock+pf->pagesize/NDATA && j<pf->nblock)
     Message("Unrecoverable errors on page, please scan it again\n",0);
   else if (nbad>0)
     Message("Page processed\n, all bad blocks successfully restored",0);
   else
     Message("Page processed\n",0);
-  // Calculate list of (partially) incomplete pages.
-  nrempages=0;
-  if (pf->pagesize>0) {
-    for (i=0; i<pf->npages && nrempages<8; i++) {
+  // Update bitmap of complete pages. Once complete, page remains complete.
+  if (pf->pagesize>0 && pf->pagedone!=NULL) {
+    for (i=0; i<pf->npages; i++) {
+      if (pf->pagedone[i>>3] & (1<<(i & 7)))
+        continue;
       firstblock=i*(pf->pagesize/NDATA);
       for (j=firstblock; j<firstblock+pf->pagesize/NDATA && j<pf->nblock; j++) {
-        if (pf->datavalid[j]==1)
-          continue;
-        // Page incomplete.
-        pf->rempages[nrempages++]=i+1;
-        break;
+        if ((pf->valid[j>>3] & (1<<(j & 7)))==0)
+          break;
+        ;
       };
+      if (j>=firstblock+pf->pagesize/NDATA || j>=pf->nblock)
+        pf->pagedone[i>>3]|=(uchar)(1<<(i & 7));
+      ;
     };
   };
-  if (nrempages<8)
-    pf->rempages[nrempages]=0;
   //Updatefileinfo(slot,pf);
+  // Save progress, so that interrupted decoding can be resumed.
+  if (pb_stdout==0)
+    Checkpointpage(slot);
+  // File requested by --extract may be complete long before the archive.
+  n=Extractselected(slot);
+  if (n<=0)
+    return n;
   if (pf->ndata==pf->nblock) {
     if (pb_autosave==0) {
       Message("File restored.",0);
@@ -284,19 +1001,240 @@ int Finishpage(int slot,int ngood,int nbad,uint32_t nrestored) {
   return 0; ////////////////////////////////////////////////////////////////////
 };
 
+// Gets piece of data to save. If data is encrypted or kept in temporary file,
+// reads it to buf and returns buf, otherwise returns pointer to data itself.
+// Offset and length must be multiples of 16 bytes. In CBC mode, IV of any
+// 16-byte record is the previous encrypted record, so data can be decrypted
+// in any order. Decryption is done in place.
+static uchar *Getplaindata(t_fproc *pf,uint64_t offset,uint32_t length,
+  uchar *buf,uchar *salt,aes_decrypt_ctx *ctx) {
+  uchar iv[16];
+  if ((pf->mode & PBM_ENCRYPTED)==0 && pf->spill==NULL)
+    return pf->data+offset;
+  if (Readfprocdata(pf,offset,length,buf)!=0)
+    return NULL;
+  if ((pf->mode & PBM_ENCRYPTED)==0)
+    return buf;
+  if (offset==0)
+    memcpy(iv,salt+16,16);             // The second 16-byte block is the IV
+  else if (Readfprocdata(pf,offset-16,16,iv)!=0)
+    return NULL;
+  if (aes_cbc_decrypt(buf,buf,length,iv,ctx)==EXIT_FAILURE)
+    return NULL;
+  return buf;
+};
+
+// Copies arbitrary piece of (decrypted) data to buf. Returns 0 on success and
+// -1 on error.
+static int Readplaindata(t_fproc *pf,uint64_t offset,uint32_t length,
+  uchar *buf,uchar *salt,aes_decrypt_ctx *ctx) {
+  uint32_t n,skip;
+  uint64_t start;
+  uchar *data,temp[PACKLEN];
+  if (offset>pf->datasize || length>pf->datasize-offset)
+    return -1;                         // Outside the data
+  while (length>0) {
+    start=offset & ~(uint64_t)15;
+    skip=offset-start;
+    // Lengths may exceed 2 GB, so don't use signed min() here.
+    if (length<PACKLEN) n=(length+skip+15) & ~15u; else n=PACKLEN;
+    if (n>PACKLEN) n=PACKLEN;
+    data=Getplaindata(pf,start,n,temp,salt,ctx);
+    if (data==NULL)
+      return -1;
+    n-=skip;
+    if (n>length) n=length;
+    memcpy(buf,data+skip,n);
+    buf+=n; offset+=n; length-=n; };
+  return 0;
+};
+
+// Decrypts and unpacks single bzip2 stream (or simply decrypts uncompressed
+// data) and writes it to file piece by piece. Note that compressed data is
+// padded to 16 bytes; bzip2 stops at the end of the stream. Returns 1 on
+// success and 0 on error.
+static int Unpackstream(t_fproc *pf,FILE *hfile,uchar *bufin,uchar *bufout,
+  uchar *salt,aes_decrypt_ctx *ctx) {
+  int success,status;
+  uint32_t l,n;
+  uint64_t offset,length;
+  uchar *data;
+  bz_stream bzstream;
+  if (pf->mode & PBM_COMPRESSED) {
+    memset(&bzstream,0,sizeof(bzstream));
+    if (BZ2_bzDecompressInit(&bzstream,0,0)!=BZ_OK)
+      return 0;
+    ;
+  };
+  success=1;
+  status=BZ_OK;
+  length=0;
+  for (offset=0; offset<pf->datasize && success; offset+=n) {
+    n=(pf->datasize-offset<PACKLEN?pf->datasize-offset:PACKLEN);
+    data=Getplaindata(pf,offset,n,bufin,salt,ctx);
+    if (data==NULL) {
+      success=0; break; };
+    if ((pf->mode & PBM_COMPRESSED)==0) {
+      // Data is not compressed, skip alignment bytes at the end.
+      l=(pf->origsize-length<n?pf->origsize-length:n);
+      if (fwrite(data,sizeof(char),l,hfile)!=l)
+        success=0;
+      length+=l;
+      if (length>=pf->origsize) break;
+      continue; };
+    bzstream.next_in=(char *)data;
+    bzstream.avail_in=n;
+    do {
+      bzstream.next_out=(char *)bufout;
+      bzstream.avail_out=PACKLEN;
+      status=BZ2_bzDecompress(&bzstream);
+      if (status!=BZ_OK && status!=BZ_STREAM_END) {
+        success=0; break; };
+      l=PACKLEN-bzstream.avail_out;
+      if (fwrite(bufout,sizeof(char),l,hfile)!=l) {
+        success=0; break; };
+      length+=l;
+    } while (status==BZ_OK &&
+      (bzstream.avail_in>0 || bzstream.avail_out==0));
+    if (status==BZ_STREAM_END) break;
+  };
+  if ((pf->mode & PBM_COMPRESSED)!=0) {
+    if (status!=BZ_STREAM_END)
+      success=0;                       // Truncated or invalid stream
+    BZ2_bzDecompressEnd(&bzstream); };
+  return success;
+};
+
+typedef struct t_unpack {              // Independently compressed stream
+  uchar          *in;                  // Compressed data
+  uint32_t       insize;               // Size of compressed data
+  uchar          *out;                 // Unpacked data, SEGLEN bytes
+  uint32_t       outsize;              // Size of unpacked data
+  int            success;              // Unpacked successfully
+} t_unpack;
+
+// Unpacks one stream, called by Parallelfor().
+static void Unpacksegment(void *arg,int index) {
+  t_unpack *pu=((t_unpack *)arg)+index;
+  pu->success=(BZ2_bzBuffToBuffDecompress((char *)pu->out,&pu->outsize,
+    (char *)pu->in,pu->insize,0,0)==BZ_OK);
+  ;
+};
+
+// Unpacks data compressed by the encoder as a set of independent bzip2
+// streams (PBM_MULTISTREAM) and writes it to file. Data starts with 32-bit
+// uncompressed size of the segment, followed by streams, each preceded by its
+// 32-bit length. Streams are unpacked in parallel, pb_threads at a time, and
+// written in order. Returns 1 on success and 0 on error.
+static int Unpacksegments(t_fproc *pf,FILE *hfile,uchar *salt,
+  aes_decrypt_ctx *ctx) {
+  int i,n,nthread,success;
+  uint32_t seglen;
+  uint64_t offset,length;
+  t_unpack *pu;
+  if (Readplaindata(pf,0,sizeof(uint32_t),(uchar *)&seglen,salt,ctx)!=0)
+    return 0;
+  if (seglen==0 || seglen>64*SEGLEN)
+    return 0;                          // Invalid or damaged header
+  nthread=max(pb_threads,1);
+  pu=(t_unpack *)calloc(nthread,sizeof(t_unpack));
+  if (pu==NULL)
+    return 0;
+  for (i=0; i<nthread; i++) {
+    pu[i].out=(uchar *)malloc(seglen);
+    if (pu[i].out==NULL) break; };
+  success=(i==nthread);
+  offset=sizeof(uint32_t);
+  length=0;
+  while (success && length<pf->origsize) {
+    // Get next batch of compressed streams.
+    for (n=0; n<nthread && success; n++) {
+      if (Readplaindata(pf,offset,sizeof(uint32_t),
+        (uchar *)&pu[n].insize,salt,ctx)!=0 || pu[n].insize==0)
+        break;                         // Last stream or padding
+      // Packed segment can't be much longer than unpacked (see bzip2 docs).
+      if (pu[n].insize>seglen+seglen/100+600) {
+        success=0; break; };
+      offset+=sizeof(uint32_t);
+      if (pu[n].in!=NULL) free(pu[n].in);
+      pu[n].in=(uchar *)malloc(pu[n].insize);
+      if (pu[n].in==NULL ||
+        Readplaindata(pf,offset,pu[n].insize,pu[n].in,salt,ctx)!=0)
+        success=0;
+      offset+=pu[n].insize;
+      pu[n].outsize=seglen; };
+    if (n==0 || success==0) break;
+    Parallelfor(n,nthread,Unpacksegment,pu);
+    for (i=0; i<n && success; i++) {
+      if (pu[i].success==0 ||
+        fwrite(pu[i].out,sizeof(char),pu[i].outsize,hfile)!=pu[i].outsize)
+        success=0;
+      length+=pu[i].outsize;
+    };
+  };
+  if (length!=pf->origsize)
+    success=0;
+  for (i=0; i<nthread; i++) {
+    if (pu[i].in!=NULL) free(pu[i].in);
+    if (pu[i].out!=NULL) free(pu[i].out); };
+  free(pu);
+  return success;
+};
+
+// Selects name of the restored file. If pb_outfile is a directory, files are
+// saved there under their original names, so that many different files can
+// be restored in one run. Otherwise, pb_outfile is used as is.
+static void Selectoutfile(t_fproc *pf,char *path) {
+  int i,n,isdir;
+  char name[65];
+#ifdef __linux__
+  struct stat st;
+#endif
+  n=strlen(pb_outfile);
+  isdir=(n>0 && (pb_outfile[n-1]=='/' || pb_outfile[n-1]=='\\'));
+#ifdef __linux__
+  if (stat(pb_outfile,&st)==0 && S_ISDIR(st.st_mode))
+    isdir=1;
+#endif
+  if (isdir==0) {
+    strcpy(path,pb_outfile);
+    return; };
+  // If data is encrypted, second half of the name holds salt and IV.
+  n=(pf->mode & PBM_ENCRYPTED?32:64);
+  for (i=0; i<n && pf->name[i]!='\0'; i++) {
+    if (pf->name[i]=='/' || pf->name[i]=='\\' || pf->name[i]==':')
+      name[i]='_';
+    else
+      name[i]=pf->name[i];
+    ;
+  };
+  name[i]='\0';
+  if (name[0]=='\0' || strcmp(name,".")==0 || strcmp(name,"..")==0)
+    strcpy(name,"restored");
+  n=strlen(pb_outfile);
+  if (pb_outfile[n-1]=='/' || pb_outfile[n-1]=='\\')
+    sprintf(path,"%.*s%s",MAXPATH-66,pb_outfile,name);
+  else
+    sprintf(path,"%.*s/%s",MAXPATH-66,pb_outfile,name);
+  ;
+};
+
 // Saves file with specified index and closes file descriptor (if force is 1,
 // attempts to save data even if file is not yet complete). Returns 0 on
-// success and -1 on error.
+// success and -1 on error. Data is decrypted, unpacked and written in pieces
+// of PACKLEN bytes, so memory doesn't depend on the size of the file.
 int Saverestoredfile(int slot,int force) {
-  int n,success;
+  int success;
   ushort filecrc;
-  uint32_t l,length;
-  uchar *bufout,*data,*tempdata,*salt,key[AESKEYLEN],iv[16];
+  uint32_t n;
+  uint64_t offset;
+  uchar *bufin,*bufout,*data,*salt,key[AESKEYLEN];
   t_fproc *pf;
   aes_decrypt_ctx ctx[1];
   //HANDLE hfile;
   FILE *hfile;
-  if (slot<0 || slot>=NFILE)
+  char path[MAXPATH];
+  if (slot<0 || slot>=pb_nfproc)
     return -1;                         // Invalid index of file descriptor
   pf=pb_fproc+slot;
   if (pf->busy==0 || pf->nblock==0)
@@ -304,79 +1242,58 @@ int Saverestoredfile(int slot,int force) {
   if (pf->ndata!=pf->nblock && force==0)
     return -1;                         // Still incomplete data
   Message("",0);
-  // If data is encrypted, decrypt it to temporary buffer. Decryption in place
-  // is possible, but the whole data would be lost if password is incorrect.
+  bufin=(uchar *)malloc(PACKLEN);
+  bufout=(uchar *)malloc(PACKLEN);
+  if (bufin==NULL || bufout==NULL) {
+    if (bufin!=NULL) free(bufin);
+    if (bufout!=NULL) free(bufout);
+    Reporterror("Low memory");
+    return -1; };
+  // If data is encrypted, verify password before anything is written. I
+  // decrypt data piece by piece and compare CRC; AES is much faster than
+  // bzip2, so second decryption pass costs almost nothing. Decryption in
+  // place is possible, but the whole data would be lost if password is
+  // incorrect.
+  salt=(uchar *)(pf->name)+32; // hack: put the salt & iv at the end of the name field
+  memset(ctx,0,sizeof(aes_decrypt_ctx));
   if (pf->mode & PBM_ENCRYPTED) {
     if (pf->datasize & 0x0000000F) {
+      free(bufin); free(bufout);
       Reporterror("Encrypted data is not aligned");
       return -1; 
     };
-
-    if (Getpassword()!=0) {
+    if (Getkey(salt,key)!=0) {
+      free(bufin); free(bufout);
       Reporterror("Cancelling bitmap decoding");
       return -1;                       // User cancelled decryption
     }
-
-    tempdata=(uchar *)malloc(pf->datasize);
-    if (tempdata==NULL) {
-      Reporterror("Low memory, can't decrypt data");
-      return -1; 
-    };
-    n=strlen(pb_password);
-    salt=(uchar *)(pf->name)+32; // hack: put the salt & iv at the end of the name field
-    derive_key((const uchar *)pb_password, n, salt, 16, 524288, key, AESKEYLEN);
-    memset(pb_password,0,sizeof(pb_password));
-    memset(ctx,0,sizeof(aes_decrypt_ctx));
     if(aes_decrypt_key((const uchar *)key,AESKEYLEN,ctx) == EXIT_FAILURE) {
       memset(key,0,AESKEYLEN);
+      free(bufin); free(bufout);
       Reporterror("Failed to set decryption key");
       return -1; 
     };
     memset(key,0,AESKEYLEN);
-    memcpy(iv, salt+16, 16); // the second 16-byte block in 'salt' is the IV
-    if(aes_cbc_decrypt(pf->data,tempdata,pf->datasize,iv,ctx) == EXIT_FAILURE) {
+    filecrc=0;
+    for (offset=0; offset<pf->datasize; offset+=n) {
+      n=(pf->datasize-offset<PACKLEN?pf->datasize-offset:PACKLEN);
+      data=Getplaindata(pf,offset,n,bufin,salt,ctx);
+      if (data==NULL) break;
+      filecrc=Updatecrc16(filecrc,data,n); };
+    if (offset<pf->datasize) {
       Reporterror("Failed to decrypt data");
       memset(ctx,0,sizeof(aes_decrypt_ctx));
+      free(bufin); free(bufout);
       return -1; 
     };
-    memset(ctx,0,sizeof(aes_decrypt_ctx));
-
-
-    filecrc=Crc16(tempdata,pf->datasize);
     if (filecrc!=pf->filecrc) {
       Reporterror("Invalid password, please try again");
-      free (tempdata);
+      Forgetkey(salt);
+      memset(ctx,0,sizeof(aes_decrypt_ctx));
+      free(bufin); free(bufout);
       return -1; 
-    }
-    else {
-      free (pf->data);
-      pf->data=tempdata;
-      pf->mode&=~PBM_ENCRYPTED;
     };
   };
-  // If data is compressed, unpack it to temporary buffer.
-  if ((pf->mode & PBM_COMPRESSED)==0) {
-    // Data is not compressed.
-    data=pf->data; length=pf->origsize;
-    bufout=NULL; 
-  }
-  else {
-    // Data is compressed. Create temporary buffer.
-    if (pf->origsize==0)
-      pf->origsize=pf->datasize*4;     // Weak attempt to recover
-    bufout=(uchar *)malloc(pf->origsize);
-    if (bufout==NULL) {
-      Reporterror("Low memory");
-      return -1; };
-    // Unpack data.
-    length=pf->origsize;
-    success=BZ2_bzBuffToBuffDecompress((char *)bufout,(uint *)&length,
-        (char*)pf->data,pf->datasize,0,0);
-    if (success!=BZ_OK) {
-      free (bufout);
-      Reporterror("Unable to unpack data");
-      return -1; };
-    data=bufout; };
   // Ask user for file name.
   // FIXME selectoutfile must be initialized prior/by arg
   //if (pf->name!=NULL) {    
@@ -386,52 +1303,90 @@ int Saverestoredfile(int slot,int force) {
   // Open file and save data.
   //hfile=CreateFile(pb_outfile,GENERIC_WRITE,0,NULL,
   //  CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
-  hfile = fopen (pb_outfile, "wb");
+  Selectoutfile(pf,path);
+  if (pf->mode & PBM_ARCHIVE)
+    hfile = tmpfile();                 // Archive is unpacked, then split
+  else if (pb_stdout)
+    hfile = stdout;
+  else
+    hfile = fopen (path, "wb");
   if (hfile==NULL) {
-    if (bufout!=NULL) 
-      free (bufout);
+    memset(ctx,0,sizeof(aes_decrypt_ctx));
+    free(bufin); free(bufout);
     Reporterror("Unable to create file");
     return -1; 
   };
-
-  //WriteFile(hfile,data,length,&l,NULL);
-  l = fwrite (data, sizeof(char), length, hfile); 
+  // Decrypt, unpack and write data.
+  if (pf->mode & PBM_MULTISTREAM)
+    success=Unpacksegments(pf,hfile,salt,ctx);
+  else
+    success=Unpackstream(pf,hfile,bufin,bufout,salt,ctx);
+  memset(ctx,0,sizeof(aes_decrypt_ctx));
+  free(bufin);
+  free(bufout);
+  if (pf->mode & PBM_ARCHIVE) {
+    // Files are extracted from the unpacked archive. Temporary file is
+    // deleted when closed.
+    if (success==0)
+      Reporterror("Unable to unpack data");
+    else if (fflush(hfile)!=0 || Extractarchive(pf,hfile)!=0)
+      success=0;
+    fclose(hfile);
+    if (success==0)
+      return -1;
+    Checkpointdone(slot);
+    Closefproc(slot);
+    return 0; };
+  if (pb_stdout) {
+    // Data written to stdout can't be taken back, and there are no file
+    // attributes to restore.
+    if (fflush(hfile)!=0)
+      success=0;
+    if (success==0) {
+      Reporterror("Unable to write data");
+      return -1; };
+    Closefproc(slot);
+    Message("File saved",0);
+    return 0; };
+  if (fclose(hfile)!=0)
+    success=0;
+  if (success==0) {
+    remove(path);
+    if (pf->mode & PBM_COMPRESSED)
+      Reporterror("Unable to unpack data");
+    else
+      Reporterror("I/O error");
+    return -1; 
+  };
   // Restore old modification date and time.
 #ifdef _WIN32
   // open HANDLE and set file time
-  HANDLE handleFile=CreateFile(pb_outfile,GENERIC_WRITE,0,NULL,
-      CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+  HANDLE handleFile=CreateFile(path,GENERIC_WRITE,0,NULL,
+      OPEN_EXISTING,FILE_ATTRIBUTE_NORMAL,NULL);
   if (handleFile==INVALID_HANDLE_VALUE) {
-    if (bufout!=NULL) 
-      free(bufout);
     Reporterror("Unable to open handle to set file time");
     return -1; 
   };
   SetFileTime(handleFile,&pf->modified,&pf->modified,&pf->modified);
   // Close file and restore old basic attributes.
-  CloseHandle(hfile);
-  SetFileAttributes(pb_outfile,pf->attributes);
-  if (bufout!=NULL) 
-    free(bufout);
-  if (l!=length) {
-    Reporterror("I/O error");
-    return -1; 
-  };
+  CloseHandle(handleFile);
+  SetFileAttributes(path,pf->attributes);
 #elif __linux__
   // Set file time
   struct stat bmpStat;
   struct utimbuf newTime;
-  stat(pb_outfile, &bmpStat);
+  stat(path, &bmpStat);
   newTime.actime = bmpStat.st_atime;
   newTime.modtime = convertToPosixTime(pf->modified);
-  utime(pb_outfile, &newTime);
+  utime(path, &newTime);
 
   // Restore mode
   mode_t mode = convertToPosixAttributes(pf->attributes);
-  chmod (pb_outfile, convertToPosixAttributes(pf->attributes));
+  chmod (path, convertToPosixAttributes(pf->attributes));
 
 #endif
   // Close file descriptor and report success.
+  Checkpointdone(slot);
   Closefproc(slot);
   Message("File saved",0);
   return 0;
@@ -0,0 +1,199 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// PaperBack -- high density backups on the plain paper                       //
+//                                                                            //
+// Copyright (c) 2007 Oleh Yuschuk                                            //
+// ollydbg at t-online de (set Subject to 'paperback' or be filtered out!)    //
+//                                                                            //
+//                                                                            //
+// This file is part of PaperBack.                                            //
+//                                                                            //
+// Paperback is free software; you can redistribute it and/or modify it under //
+// the terms of the GNU General Public License as published by the Free       //
+// Software Foundation; either version 3 of the License, or (at your option)  //
+// any later version.                                                         //
+//                                                                            //
+// PaperBack is distributed in the hope that it will be useful, but WITHOUT   //
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or      //
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for   //
+// more details.                                                              //
+//                                                                            //
+// You should have received a copy of the GNU General Public License along    //
+// with this program. If not, see <http://www.gnu.org/licenses/>.             //
+//                                                                            //
+//                                                                            //
+// Note that bzip2 compression/decompression library, which is the part of    //
+// this project, is covered by different license, which, in my opinion, is    //
+// compatible with GPL.                                                       //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "paperbak.h"
+#include "Resource.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Parity pages. Recovery blocks protect data only within the page, so if the //
+// sheet is lost, the whole backup is lost, too. With --page-parity, printer  //
+// appends parity pages calculated with Cauchy Reed-Solomon code over GF(256) //
+// (the same field as used by block ECC). Data pages are interleaved into     //
+// nstripe stripes of at most NSTRIPEPAGE pages: page p belongs to stripe     //
+// p%nstripe as its (p/nstripe)-th member. Each stripe gets K parity pages,   //
+// parity page j of stripe s is printed as page npages+j*nstripe+s and its    //
+// blocks continue addresses of the data. Any K lost pages of the stripe can  //
+// be rebuilt. Decoder doesn't need to know K, it uses parity pages that are  //
+// available.                                                                 //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Multiplies two elements of GF(256).
+static uchar Gfmul(uchar a,uchar b) {
+  if (a==0 || b==0)
+    return 0;
+  return rs_alpha[(rs_index[a]+rs_index[b])%255];
+};
+
+// Calculates inverse of the nonzero element of GF(256).
+static uchar Gfinverse(uchar a) {
+  return rs_alpha[(255-rs_index[a])%255];
+};
+
+// Returns number of stripes for the given number of data pages.
+int Paritystripes(int npages) {
+  return max((npages+NSTRIPEPAGE-1)/NSTRIPEPAGE,1);
+};
+
+// Returns coefficient of the data page with given index in the stripe (0 to
+// NSTRIPEPAGE-1) in the parity page row (0 to NPARMAX-1). Elements of Cauchy
+// matrix 1/(x^y) with distinct x and y, any square submatrix is invertible.
+uchar Paritycoef(int row,int index) {
+  return Gfinverse((uchar)(row^(NPARMAX+index)));
+};
+
+// Multiplies n bytes of src by c and adds (XORs) result to dst. This is the
+// innermost loop of both encoding and rebuilding, so it's vectorised. With
+// SSSE3, products of low and high nibbles are looked up in two 16-byte tables
+// by PSHUFB. Plain SSE2 multiplies 16 bytes at once by shifts and XORs.
+void Gfmuladd(uchar *dst,uchar *src,uchar c,uint32_t n) {
+  uint32_t i;
+  uchar lc;
+#ifdef __SSSE3__
+  int k;
+  uchar lo[16],hi[16];
+  __m128i tlo,thi,mask,x;
+#elif defined(__SSE2__)
+  int k;
+  __m128i x,acc,poly,zero;
+#endif
+  if (c==0)
+    return;
+  i=0;
+#ifdef __SSSE3__
+  for (k=0; k<16; k++) {
+    lo[k]=Gfmul(c,(uchar)k);
+    hi[k]=Gfmul(c,(uchar)(k<<4)); };
+  tlo=_mm_loadu_si128((__m128i *)lo);
+  thi=_mm_loadu_si128((__m128i *)hi);
+  mask=_mm_set1_epi8(0x0F);
+  for ( ; i+16<=n; i+=16) {
+    x=_mm_loadu_si128((__m128i *)(src+i));
+    x=_mm_xor_si128(_mm_shuffle_epi8(tlo,_mm_and_si128(x,mask)),
+      _mm_shuffle_epi8(thi,_mm_and_si128(_mm_srli_epi64(x,4),mask)));
+    _mm_storeu_si128((__m128i *)(dst+i),
+      _mm_xor_si128(_mm_loadu_si128((__m128i *)(dst+i)),x));
+    ;
+  };
+#elif defined(__SSE2__)
+  // Field polynomial is x^8+x^7+x^2+x+1, so overflow of the doubled byte is
+  // corrected by 0x87.
+  poly=_mm_set1_epi8((char)0x87);
+  zero=_mm_setzero_si128();
+  for ( ; i+16<=n; i+=16) {
+    x=_mm_loadu_si128((__m128i *)(src+i));
+    acc=_mm_loadu_si128((__m128i *)(dst+i));
+    for (k=c; k!=0; k>>=1) {
+      if (k & 1)
+        acc=_mm_xor_si128(acc,x);
+      x=_mm_xor_si128(_mm_add_epi8(x,x),
+        _mm_and_si128(_mm_cmplt_epi8(x,zero),poly));
+      ;
+    };
+    _mm_storeu_si128((__m128i *)(dst+i),acc);
+  };
+#endif
+  lc=rs_index[c];
+  for ( ; i<n; i++) {
+    if (src[i]!=0)
+      dst[i]^=rs_alpha[(rs_index[src[i]]+lc)%255];
+    ;
+  };
+};
+
+// Inverts n*n matrix a in place by Gauss-Jordan elimination. Returns 0 on
+// success and -1 if matrix is singular.
+int Gfinvertmatrix(uchar *a,int n) {
+  int i,j,k;
+  uchar t,b[NPARMAX*NPARMAX];
+  if (n<1 || n>NPARMAX)
+    return -1;
+  memset(b,0,n*n);
+  for (i=0; i<n; i++)
+    b[i*n+i]=1;
+  for (i=0; i<n; i++) {
+    // Find pivot and move it to the diagonal.
+    for (k=i; k<n && a[k*n+i]==0; k++);
+    if (k>=n)
+      return -1;
+    if (k!=i) {
+      for (j=0; j<n; j++) {
+        t=a[i*n+j]; a[i*n+j]=a[k*n+j]; a[k*n+j]=t;
+        t=b[i*n+j]; b[i*n+j]=b[k*n+j]; b[k*n+j]=t;
+      };
+    };
+    // Normalize row and eliminate column in all other rows.
+    t=Gfinverse(a[i*n+i]);
+    for (j=0; j<n; j++) {
+      a[i*n+j]=Gfmul(a[i*n+j],t);
+      b[i*n+j]=Gfmul(b[i*n+j],t); };
+    for (k=0; k<n; k++) {
+      if (k==i || a[k*n+i]==0) continue;
+      t=a[k*n+i];
+      for (j=0; j<n; j++) {
+        a[k*n+j]^=Gfmul(a[i*n+j],t);
+        b[k*n+j]^=Gfmul(b[i*n+j],t);
+      };
+    };
+  };
+  memcpy(a,b,n*n);
+  return 0;
+};
+
+// Calculates parity page with index q (0-based, counted from the first parity
+// page) into buffer parity that is pagesize bytes long. Data beyond datasize
+// is assumed to be zero.
+void Encodeparitypage(uchar *parity,uchar *data,uint64_t datasize,
+  uint32_t pagesize,int npages,int q) {
+  int i,p,row,nstripe;
+  uint64_t offset;
+  nstripe=Paritystripes(npages);
+  row=q/nstripe;
+  memset(parity,0,pagesize);
+  for (i=0,p=q%nstripe; p<npages; i++,p+=nstripe) {
+    offset=(uint64_t)p*pagesize;
+    if (offset>=datasize) break;
+    Gfmuladd(parity,data+offset,Paritycoef(row,i),
+      datasize-offset<pagesize?datasize-offset:pagesize);
+    ;
+  };
+};
@@ -0,0 +1,372 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// PaperBack -- high density backups on the plain paper                       //
+//                                                                            //
+// Copyright (c) 2007 Oleh Yuschuk                                            //
+// ollydbg at t-online de (set Subject to 'paperback' or be filtered out!)    //
+//                                                                            //
+//                                                                            //
+// This file is part of PaperBack.                                            //
+//                                                                            //
+// Paperback is free software; you can redistribute it and/or modify it under //
+// the terms of the GNU General Public License as published by the Free       //
+// Software Foundation; either version 3 of the License, or (at your option)  //
+// any later version.                                                         //
+//                                                                            //
+// PaperBack is distributed in the hope that it will be useful, but WITHOUT   //
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or      //
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for   //
+// more details.                                                              //
+//                                                                            //
+// You should have received a copy of the GNU General Public License along    //
+// with this program. If not, see <http://www.gnu.org/licenses/>.             //
+//                                                                            //
+//                                                                            //
+// Note that bzip2 compression/decompression library, which is the part of    //
+// this project, is covered by different license, which, in my opinion, is    //
+// compatible with GPL.                                                       //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+#include "bzlib.h"
+#include "aes.h"
+
+#include "paperbak.h"
+#include "Resource.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// CCITT Group 4 (T.6) encoder for black and white pages.                     //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+typedef struct t_code {                // Variable-length code
+  ushort         code;                 // Code bits, right-aligned
+  ushort         length;               // Number of bits in code
+} t_code;
+
+static t_code whiteterm[64] = {
+  {0x035, 8},{0x007, 6},{0x007, 4},{0x008, 4},{0x00B, 4},{0x00C, 4},
+  {0x00E, 4},{0x00F, 4},{0x013, 5},{0x014, 5},{0x007, 5},{0x008, 5},
+  {0x008, 6},{0x003, 6},{0x034, 6},{0x035, 6},{0x02A, 6},{0x02B, 6},
+  {0x027, 7},{0x00C, 7},{0x008, 7},{0x017, 7},{0x003, 7},{0x004, 7},
+  {0x028, 7},{0x02B, 7},{0x013, 7},{0x024, 7},{0x018, 7},{0x002, 8},
+  {0x003, 8},{0x01A, 8},{0x01B, 8},{0x012, 8},{0x013, 8},{0x014, 8},
+  {0x015, 8},{0x016, 8},{0x017, 8},{0x028, 8},{0x029, 8},{0x02A, 8},
+  {0x02B, 8},{0x02C, 8},{0x02D, 8},{0x004, 8},{0x005, 8},{0x00A, 8},
+  {0x00B, 8},{0x052, 8},{0x053, 8},{0x054, 8},{0x055, 8},{0x024, 8},
+  {0x025, 8},{0x058, 8},{0x059, 8},{0x05A, 8},{0x05B, 8},{0x04A, 8},
+  {0x04B, 8},{0x032, 8},{0x033, 8},{0x034, 8}
+};
+
+static t_code blackterm[64] = {
+  {0x037,10},{0x002, 3},{0x003, 2},{0x002, 2},{0x003, 3},{0x003, 4},
+  {0x002, 4},{0x003, 5},{0x005, 6},{0x004, 6},{0x004, 7},{0x005, 7},
+  {0x007, 7},{0x004, 8},{0x007, 8},{0x018, 9},{0x017,10},{0x018,10},
+  {0x008,10},{0x067,11},{0x068,11},{0x06C,11},{0x037,11},{0x028,11},
+  {0x017,11},{0x018,11},{0x0CA,12},{0x0CB,12},{0x0CC,12},{0x0CD,12},
+  {0x068,12},{0x069,12},{0x06A,12},{0x06B,12},{0x0D2,12},{0x0D3,12},
+  {0x0D4,12},{0x0D5,12},{0x0D6,12},{0x0D7,12},{0x06C,12},{0x06D,12},
+  {0x0DA,12},{0x0DB,12},{0x054,12},{0x055,12},{0x056,12},{0x057,12},
+  {0x064,12},{0x065,12},{0x052,12},{0x053,12},{0x024,12},{0x037,12},
+  {0x038,12},{0x027,12},{0x028,12},{0x058,12},{0x059,12},{0x02B,12},
+  {0x02C,12},{0x05A,12},{0x066,12},{0x067,12}
+};
+
+// Make-up codes for run lengths 64, 128, ... 2560.
+static t_code whitemakeup[40] = {
+  {0x01B, 5},{0x012, 5},{0x017, 6},{0x037, 7},{0x036, 8},{0x037, 8},
+  {0x064, 8},{0x065, 8},{0x068, 8},{0x067, 8},{0x0CC, 9},{0x0CD, 9},
+  {0x0D2, 9},{0x0D3, 9},{0x0D4, 9},{0x0D5, 9},{0x0D6, 9},{0x0D7, 9},
+  {0x0D8, 9},{0x0D9, 9},{0x0DA, 9},{0x0DB, 9},{0x098, 9},{0x099, 9},
+  {0x09A, 9},{0x018, 6},{0x09B, 9},{0x008,11},{0x00C,11},{0x00D,11},
+  {0x012,12},{0x013,12},{0x014,12},{0x015,12},{0x016,12},{0x017,12},
+  {0x01C,12},{0x01D,12},{0x01E,12},{0x01F,12}
+};
+
+static t_code blackmakeup[40] = {
+  {0x00F,10},{0x0C8,12},{0x0C9,12},{0x05B,12},{0x033,12},{0x034,12},
+  {0x035,12},{0x06C,13},{0x06D,13},{0x04A,13},{0x04B,13},{0x04C,13},
+  {0x04D,13},{0x072,13},{0x073,13},{0x074,13},{0x075,13},{0x076,13},
+  {0x077,13},{0x052,13},{0x053,13},{0x054,13},{0x055,13},{0x05A,13},
+  {0x05B,13},{0x064,13},{0x065,13},{0x008,11},{0x00C,11},{0x00D,11},
+  {0x012,12},{0x013,12},{0x014,12},{0x015,12},{0x016,12},{0x017,12},
+  {0x01C,12},{0x01D,12},{0x01E,12},{0x01F,12}
+};
+
+// Vertical mode codes for a1-b1 = -3..3.
+static t_code vertical[7] = {
+  {0x02,7},{0x02,6},{0x02,3},{0x01,1},{0x03,3},{0x03,6},{0x03,7}
+};
+
+static t_code passcode  = {0x1,4};     // Pass mode
+static t_code horizcode = {0x1,3};     // Horizontal mode
+static t_code eol       = {0x1,12};    // End of line, twice at the end
+
+typedef struct t_g4 {                  // G4 encoder state
+  uchar          *buf;                 // Output buffer
+  uint32_t       size;                 // Size of buf, bytes
+  uint32_t       length;               // Number of complete bytes in buf
+  uint32_t       bits;                 // Pending bits, left-aligned
+  int            nbits;                // Number of pending bits
+  int            error;                // Out of memory
+} t_g4;
+
+// Adds code to the output stream, MSB first.
+static void Putcode(t_g4 *g,t_code c) {
+  uchar *p;
+  g->bits|=(uint32_t)c.code<<(32-g->nbits-c.length);
+  g->nbits+=c.length;
+  while (g->nbits>=8) {
+    if (g->length>=g->size) {
+      p=(uchar *)realloc(g->buf,g->size*2);
+      if (p==NULL) { g->error=1; g->length=0; }
+      else { g->buf=p; g->size*=2; };
+    };
+    g->buf[g->length++]=(uchar)(g->bits>>24);
+    g->bits<<=8;
+    g->nbits-=8;
+  };
+};
+
+// Adds run of given length and colour as a sequence of make-up codes
+// followed by the terminating code.
+static void Putrun(t_g4 *g,int run,int black) {
+  while (run>=2560+64) {
+    Putcode(g,black?blackmakeup[39]:whitemakeup[39]);
+    run-=2560; };
+  if (run>=64) {
+    Putcode(g,black?blackmakeup[run/64-1]:whitemakeup[run/64-1]);
+    run%=64; };
+  Putcode(g,black?blackterm[run]:whiteterm[run]);
+};
+
+// Returns position of the first pixel in the row, starting from x, whose
+// colour is different from black. Pixels darker than 128 are black. If there
+// is no such pixel, returns width.
+static int Findchange(uchar *row,int x,int width,int black) {
+  if (black) {
+    while (x<width && row[x]<128) x++; }
+  else {
+    while (x<width && row[x]>=128) x++; };
+  return x;
+};
+
+// Encodes bitmap with 1 byte per pixel (bottom-up, as in the BMP file) as a
+// CCITT G4 image with EOFB. Allocates output buffer and returns its size, or
+// 0 on error.
+uint32_t Encodeg4(uchar *bits,int width,int height,uchar **out) {
+  int x,y,a0,a1,a2,b1,b2,black;
+  uchar *row,*ref,*white;
+  t_g4 g;
+  *out=NULL;
+  memset(&g,0,sizeof(g));
+  g.size=65536;
+  g.buf=(uchar *)malloc(g.size);
+  white=(uchar *)malloc(width);
+  if (g.buf==NULL || white==NULL) {
+    if (g.buf!=NULL) free(g.buf);
+    if (white!=NULL) free(white);
+    return 0; };
+  // Reference line of the first row is imaginary white line.
+  memset(white,255,width);
+  ref=white;
+  for (y=height-1; y>=0 && g.error==0; y--) {
+    row=bits+y*width;
+    a0=-1; black=0;
+    a1=Findchange(row,0,width,0);
+    b1=Findchange(ref,0,width,0);
+    while (1) {
+      b2=(b1<width?Findchange(ref,b1,width,ref[b1]<128):width);
+      if (b2<a1) {
+        // Pass mode, a0 moves below b2 and keeps colour.
+        Putcode(&g,passcode);
+        a0=b2; }
+      else if (b1-a1>=-3 && b1-a1<=3) {
+        // Vertical mode.
+        Putcode(&g,vertical[a1-b1+3]);
+        a0=a1;
+        black=!black; }
+      else {
+        // Horizontal mode, two runs.
+        a2=(a1<width?Findchange(row,a1,width,!black):width);
+        Putcode(&g,horizcode);
+        Putrun(&g,a1-max(a0,0),black);
+        Putrun(&g,a2-a1,!black);
+        a0=a2; };
+      if (a0>=width) break;
+      a1=Findchange(row,a0,width,black);
+      // b1 is the first changing element on the reference line to the right
+      // of a0 that has the colour opposite to the colour of a0.
+      b1=Findchange(ref,a0,width,!black);
+      b1=Findchange(ref,b1,width,black);
+    };
+    ref=row;
+  };
+  // End of facsimile block, pad to full byte.
+  Putcode(&g,eol);
+  Putcode(&g,eol);
+  if (g.nbits>0) {
+    x=g.nbits;
+    Putcode(&g,(t_code){0,8-x}); };
+  free(white);
+  if (g.error) {
+    free(g.buf);
+    return 0; };
+  *out=g.buf;
+  return g.length;
+};
+
+
+// Packs bitmap with 1 byte per pixel (bottom-up) to uncompressed 1-bit image
+// with top-down rows, as expected by PDF, where 0 is black. Sparse dots with
+// the size of single pixel are better stored this way than G4-encoded.
+// Allocates output buffer and returns its size, or 0 on error.
+uint32_t Encoderaw(uchar *bits,int width,int height,uchar **out) {
+  int x,y,k,stride;
+  uchar *row,*pout,b;
+  stride=(width+7)/8;
+  *out=(uchar *)malloc(stride*height);
+  if (*out==NULL)
+    return 0;
+  pout=*out;
+  for (y=height-1; y>=0; y--) {
+    row=bits+y*width;
+    for (x=0; x<width; x+=8) {
+      b=0;
+      for (k=0; k<8; k++) {
+        b<<=1;
+        if (x+k<width && row[x+k]>=128) b|=1; };
+      *pout++=b;
+    };
+  };
+  return stride*height;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Multipage PDF writer.                                                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Object 1 is the catalog and object 2 the page tree that lists all pages, so
+// it's written last. Each page takes PDFPAGEOBJ objects: image, length of the
+// image, contents and page itself.
+#define PDFPAGEOBJ     4
+
+// Registers start of the next object in the file and returns its number.
+static int Pdfobject(t_pdf *pdf,int n) {
+  long *p;
+  if (n>=pdf->maxobj) {
+    p=(long *)realloc(pdf->offset,(n+256)*sizeof(long));
+    if (p==NULL) return -1;
+    pdf->offset=p;
+    pdf->maxobj=n+256; };
+  pdf->offset[n]=ftell(pdf->f);
+  if (n>=pdf->nobj) pdf->nobj=n+1;
+  fprintf(pdf->f,"%i 0 obj\n",n);
+  return n;
+};
+
+// Creates PDF file. Returns 0 on success and -1 on error.
+int Pdfopen(t_pdf *pdf,char *path) {
+  memset(pdf,0,sizeof(t_pdf));
+  pdf->f=fopen(path,"wb");
+  if (pdf->f==NULL)
+    return -1;
+  pdf->nobj=3;
+  // Binary comment marks file as binary for transfer programs.
+  fprintf(pdf->f,"%%PDF-1.4\n%%\xE2\xE3\xCF\xD3\n");
+  if (Pdfobject(pdf,1)<0) {
+    Pdfabort(pdf);
+    return -1; };
+  fprintf(pdf->f,"<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+  return ferror(pdf->f)?-1:0;
+};
+
+// Appends page with 1-bit image of given size in pixels, G4-compressed if g4
+// is set. Page size and position of the image's upper left corner are in
+// pixels, too; ppix and ppiy convert pixels to points. Returns 0 on success
+// and -1 on error.
+int Pdfaddpage(t_pdf *pdf,uchar *image,uint32_t length,int g4,
+  int width,int height,int ppix,int ppiy,int pagex,int pagey,int left,int top) {
+  int n;
+  float w,h,x,y,pw,ph;
+  char s[TEXTLEN];
+  n=3+pdf->npage*PDFPAGEOBJ;
+  // Image XObject. Length is written after the data as a separate object.
+  if (Pdfobject(pdf,n)<0) return -1;
+  fprintf(pdf->f,"<< /Type /XObject /Subtype /Image /Width %i /Height %i\n"
+    "/ColorSpace /DeviceGray /BitsPerComponent 1\n",width,height);
+  if (g4)
+    fprintf(pdf->f,"/Filter /CCITTFaxDecode\n"
+      "/DecodeParms << /K -1 /Columns %i /Rows %i /EndOfBlock true >>\n",
+      width,height);
+  fprintf(pdf->f,"/Length %i 0 R >>\nstream\n",n+1);
+  if (fwrite(image,1,length,pdf->f)!=length) return -1;
+  fprintf(pdf->f,"\nendstream\nendobj\n");
+  if (Pdfobject(pdf,n+1)<0) return -1;
+  fprintf(pdf->f,"%li\nendobj\n",(long)length);
+  // Contents, place image on the page.
+  w=width*72.0/ppix;
+  h=height*72.0/ppiy;
+  pw=pagex*72.0/ppix;
+  ph=pagey*72.0/ppiy;
+  x=left*72.0/ppix;
+  y=ph-top*72.0/ppiy-h;
+  sprintf(s,"q %.2f 0 0 %.2f %.2f %.2f cm /Im0 Do Q\n",w,h,x,y);
+  if (Pdfobject(pdf,n+2)<0) return -1;
+  fprintf(pdf->f,"<< /Length %i >>\nstream\n%sendstream\nendobj\n",
+    (int)strlen(s),s);
+  // Page.
+  if (Pdfobject(pdf,n+3)<0) return -1;
+  fprintf(pdf->f,"<< /Type /Page /Parent 2 0 R /MediaBox [0 0 %.2f %.2f]\n"
+    "/Resources << /XObject << /Im0 %i 0 R >> >> /Contents %i 0 R >>\n"
+    "endobj\n",pw,ph,n,n+2);
+  pdf->npage++;
+  return ferror(pdf->f)?-1:0;
+};
+
+// Writes page tree, cross-reference table and trailer and closes file.
+// Returns 0 on success and -1 on error.
+int Pdfclose(t_pdf *pdf) {
+  int i,success;
+  long xref;
+  if (pdf->f==NULL)
+    return -1;
+  success=(Pdfobject(pdf,2)==2);
+  if (success) {
+    fprintf(pdf->f,"<< /Type /Pages /Count %i /Kids [",pdf->npage);
+    for (i=0; i<pdf->npage; i++)
+      fprintf(pdf->f,"%s%i 0 R",(i%8==0?"\n":" "),6+i*PDFPAGEOBJ);
+    fprintf(pdf->f," ] >>\nendobj\n");
+    // Cross-reference table, each entry exactly 20 bytes.
+    xref=ftell(pdf->f);
+    fprintf(pdf->f,"xref\n0 %i\n0000000000 65535 f \n",pdf->nobj);
+    for (i=1; i<pdf->nobj; i++)
+      fprintf(pdf->f,"%010li 00000 n \n",pdf->offset[i]);
+    fprintf(pdf->f,"trailer\n<< /Size %i /Root 1 0 R >>\n"
+      "startxref\n%li\n%%%%EOF\n",pdf->nobj,xref);
+    if (ferror(pdf->f)) success=0; };
+  if (fclose(pdf->f)!=0) success=0;
+  pdf->f=NULL;
+  free(pdf->offset);
+  pdf->offset=NULL;
+  return success?0:-1;
+};
+
+// Closes unfinished PDF file.
+void Pdfabort(t_pdf *pdf) {
+  if (pdf->f!=NULL)
+    fclose(pdf->f);
+  pdf->f=NULL;
+  if (pdf->offset!=NULL)
+    free(pdf->offset);
+  pdf->offset=NULL;
+};
@@ -33,8 +33,10 @@
 #include <windows.h>
 #elif __linux__
 #include <sys/stat.h>
+#include <sys/mman.h>
 #endif
 #include <stdlib.h>
+#include <math.h>
 #include "bzlib.h"
 #include "aes.h"
 #include "Bitmap.h"
@@ -46,22 +48,43 @@
 
 
 
-// Service function, puts block of data to bitmap as a grid of 32x32 dots in
-// the position with given index. Bitmap is treated as a continuous line of
-// cells, where end of the line is connected to the start of the next line.
+// Service function, adds CRC and error correction code to the block of data.
+static void Encodeblock(t_data *block) {
+  // Add CRC.
+  block->crc=(ushort)(Crc16((uchar *)block,NDATA+sizeof(uint32_t))^0x55AA);
+  // Add error correction code.
+  Encode8((uchar *)block,block->ecc,127);
+};
+
+// Service function, prepares table of pre-rasterised dot spans. Span with
+// index b is a horizontal line of 8*dx pixels with dots in the positions of
+// the set bits of b.
+static void Preparedotspans(uchar *dotspan,int dx,int px,int black) {
+  int b,i;
+  memset(dotspan,255,256*8*dx);
+  for (b=0; b<256; b++) {
+    for (i=0; i<8; i++) {
+      if (b & (1<<i))
+        memset(dotspan+b*8*dx+i*dx,black,px);
+      ;
+    };
+  };
+};
+
+// Service function, puts encoded block of data to bitmap as a grid of 32x32
+// dots in the position with given index. Bitmap is treated as a continuous
+// line of cells, where end of the line is connected to the start of the next
+// line. Cell is expected to be white, as drawn by Drawtemplate(): each row of
+// dots is assembled from 4 spans and then replicated py times.
 static void Drawblock(int index,t_data *block,uchar *bits,int width,int height,
-  int border,int nx,int ny,int dx,int dy,int px,int py,int black
+  int border,int nx,int dx,int dy,int py,uchar *dotspan
 ) {
-  int i,j,x,y,m,n;
+  int j,k,m,x,y;
   uint32_t t;
   // Convert cell index into the X-Y bitmap coordinates.
   x=(index%nx)*(NDOT+3)*dx+2*dx+border;
   y=(index/nx)*(NDOT+3)*dy+2*dy+border;
   bits+=(height-y-1)*width+x;
-  // Add CRC.
-  block->crc=(ushort)(Crc16((uchar *)block,NDATA+sizeof(uint32_t))^0x55AA);
-  // Add error correction code.
-  Encode8((uchar *)block,block->ecc,127);
   // Print block. To increase the reliability of empty or half-empty blocks
   // and close-to-0 addresses, I XOR all data with 55 or AA.
   for (j=0; j<32; j++) {
@@ -70,22 +93,68 @@ static void Drawblock(int index,t_data *block,uchar *bits,int width,int height,
       t^=0x55555555;
     else
       t^=0xAAAAAAAA;
-    x=0;
-    for (i=0; i<32; i++) {
-      if (t & 1) {
-        for (m=0; m<py; m++) {
-          for (n=0; n<px; n++) {
-            bits[x-m*width+n]=(uchar)black;
-          };
-        };
+    for (k=0; k<4; k++,t>>=8)
+      memcpy(bits+k*8*dx,dotspan+(t & 0xFF)*8*dx,8*dx);
+    for (m=1; m<py; m++)
+      memcpy(bits-m*width,bits,32*dx);
+    bits-=dy*width;
+  };
+};
+
+// Service function, same as Drawblock() but for the bitmap packed to 1 bit per
+// pixel, where set bits are white. Cells are not aligned to the byte border,
+// so dots are cleared bit by bit.
+static void Drawpackedblock(int index,t_data *block,uchar *bits,int stride,
+  int height,int border,int nx,int dx,int dy,int px,int py
+) {
+  int i,j,m,n,x,y;
+  uint32_t t;
+  uchar *row;
+  // Convert cell index into the X-Y bitmap coordinates.
+  x=(index%nx)*(NDOT+3)*dx+2*dx+border;
+  y=(index/nx)*(NDOT+3)*dy+2*dy+border;
+  bits+=(height-y-1)*stride;
+  for (j=0; j<32; j++) {
+    t=((uint32_t *)block)[j];
+    if ((j & 1)==0)
+      t^=0x55555555;
+    else
+      t^=0xAAAAAAAA;
+    for (i=0; i<32; i++,t>>=1) {
+      if ((t & 1)==0)
+        continue;
+      for (m=0; m<py; m++) {
+        row=bits-m*stride;
+        for (n=x+i*dx; n<x+i*dx+px; n++)
+          row[n>>3]&=(uchar)~(0x80>>(n & 7));
+        ;
       };
-      t>>=1;
-      x+=dx;
     };
-    bits-=dy*width;
+    bits-=dy*stride;
   };
 };
 
+// Returns length of the line of drawn page, bytes. Black and white bitmaps are
+// drawn packed to 1 bit per pixel, lines are aligned to 4 bytes.
+static int Linesize(t_printdata *print) {
+  if (print->format==FMT_BMP1)
+    return ((print->width+31)/32)*4;
+  return print->width;
+};
+
+// Draws encoded block into the cell with given index of the page drawn by
+// Renderpage().
+static void Drawcell(t_printdata *print,int index,t_data *block,uchar *bits,
+  int height) {
+  if (print->format==FMT_BMP1)
+    Drawpackedblock(index,block,bits,Linesize(print),height,print->border,
+      print->nx,print->dx,print->dy,print->px,print->py);
+  else
+    Drawblock(index,block,bits,print->width,height,print->border,print->nx,
+      print->dx,print->dy,print->py,print->dotspan);
+  ;
+};
+
 
 
 // Service function, clips regular 32x32-dot raster to bitmap in the position
@@ -138,19 +207,45 @@ void Stopprinting(t_printdata *print) {
   //  CloseHandle(print->hfile); print->hfile=NULL; };
   if (print->hfile != NULL)
     fclose(print->hfile);
-  // Deallocate memory.
+  // Deallocate memory. If data is not compressed, buf may point directly to
+  // the mapped file.
   if (print->buf!=NULL) {
-    free(print->buf); 
+    if (print->buf!=print->map)
+      free(print->buf); 
     print->buf=NULL; 
   };
+#ifdef __linux__
+  if (print->map!=NULL) {
+    munmap(print->map,print->origsize);
+    print->map=NULL;
+  };
+#endif
   if (print->readbuf!=NULL) {
     free(print->readbuf); 
     print->readbuf=NULL;
   };
+  if (print->parity!=NULL) {
+    free(print->parity); 
+    print->parity=NULL;
+  };
   if (print->drawbits!=NULL) {
     free(print->drawbits); 
     print->drawbits=NULL; 
   };
+  if (print->dotspan!=NULL) {
+    free(print->dotspan); 
+    print->dotspan=NULL; 
+  };
+  if (print->templbits!=NULL) {
+    free(print->templbits); 
+    print->templbits=NULL; 
+  };
+  if (print->shortbits!=NULL) {
+    free(print->shortbits); 
+    print->shortbits=NULL; 
+  };
+  if (print->pdf.f!=NULL)
+    Pdfabort(&print->pdf);
   // Free other resources.
   // FIXME is this needed?
   if (print->startdoc!=0) {
@@ -177,6 +272,13 @@ void Stopprinting(t_printdata *print) {
 static void Preparefiletoprint(t_printdata *print)
 {
   uint32_t l;
+  // Several files or directory are packed into the temporary archive, which
+  // is then printed as a single file.
+  if (pb_narchive>0) {
+    if (Buildarchive(print)!=0) {
+      Stopprinting(print);
+      return; };
+    goto opened; };
 #if defined(_WIN32) || defined(__CYGWIN__)
   FILETIME created,accessed,modified;
   // Get file attributes.
@@ -207,7 +309,8 @@ static void Preparefiletoprint(t_printdata *print)
   }
   // Get original (uncompressed) file size.
   print->origsize=GetFileSize (h, &l);
-  if (print->origsize==0 || print->origsize>MAXSIZE || l!=0) {
+  print->origsize|=(uint64_t)l<<32;
+  if (print->origsize==0 || print->origsize>MAXEXTSIZE) {
     Reporterror("Invalid file size");
     Stopprinting(print);
     return; 
@@ -226,7 +329,7 @@ static void Preparefiletoprint(t_printdata *print)
   print->modified = convertToFileTime(fileInfo.st_mtime);
   // Get original (uncompressed) file size.
   print->origsize = fileInfo.st_size;
-  if (print->origsize==0 || print->origsize>MAXSIZE) {
+  if (print->origsize==0 || print->origsize>MAXEXTSIZE) {
     Reporterror("Invalid file size");
     Stopprinting(print);
     return;
@@ -241,43 +344,175 @@ static void Preparefiletoprint(t_printdata *print)
     return; 
   }
 
+opened:
   print->readsize=0;
-  // Allocate buffer for compressed file. (If compression is off, buffer will
-  // contain uncompressed data). As AES encryption works on 16-byte records,
-  // buffer is aligned to next 16-bit border.
-  print->bufsize=(print->origsize+15) & 0xFFFFFFF0;
-  print->buf=(uchar *)malloc(print->bufsize);
-  if (print->buf==NULL) {
-    Reporterror("Low memory");
-    Stopprinting(print);
-    return; };
-  // Allocate read buffer. Because compression may take significant time, I
-  // pack data in pieces of PACKLEN bytes.
-  print->readbuf=(uchar *)malloc(PACKLEN);
-  if (print->readbuf==NULL) {
-    Reporterror("Low memory");
-    Stopprinting(print);
-    return; };
+  // As AES encryption works on 16-byte records, buffer for compressed file
+  // is aligned to next 16-bit border.
+  print->bufsize=(print->origsize+15) & ~(uint64_t)15;
+#ifdef __linux__
+  // Try to map input file into memory. Compressor then reads data directly
+  // from the mapping, and uncompressed data is printed from it without any
+  // copying. Buffer for compressed data is allocated when it's clear that
+  // it's necessary, see Preparecompressor().
+  print->map=(uchar *)mmap(NULL,print->origsize,PROT_READ,MAP_PRIVATE,
+    fileno(print->hfile),0);
+  if (print->map==(uchar *)MAP_FAILED)
+    print->map=NULL;
+  else {
+    madvise(print->map,print->origsize,MADV_SEQUENTIAL);
+    print->buf=NULL; };
+#endif
+  if (print->map==NULL) {
+    // Allocate buffer for compressed file. (If compression is off, buffer
+    // will contain uncompressed data).
+    print->buf=(uchar *)malloc(print->bufsize);
+    if (print->buf==NULL) {
+      Reporterror("Low memory");
+      Stopprinting(print);
+      return; };
+    // Allocate read buffer. Because compression may take significant time, I
+    // pack data in pieces of PACKLEN bytes.
+    print->readbuf=(uchar *)malloc(PACKLEN);
+    if (print->readbuf==NULL) {
+      Reporterror("Low memory");
+      Stopprinting(print);
+      return; };
+    ;
+  };
   // Set options.
   print->compression=pb_compression;
+  print->threads=pb_threads;
+  print->multistream=pb_multistream;
+  print->format=pb_format;
   print->encryption=pb_encryption;
   print->printheader=pb_printheader;
   print->printborder=pb_printborder;
   print->redundancy=pb_redundancy;
+  print->pageparity=pb_pageparity;
+  print->columngroups=pb_columngroups;
   // Step finished.
   print->step++;
 };
 
 
 
+// Checks whether compression of the input file is worthwhile. Already packed
+// or encrypted data is incompressible, and bzip2 would only find it out when
+// output buffer overflows, after the whole file is read and compressed. So I
+// take NPROBE samples evenly distributed over the file and estimate their
+// entropy. If entropy is close to 8 bits per byte, data is incompressible.
+// Otherwise, I compress samples and compare sizes. Returns 1 if compression
+// makes sense and 0 if not.
+static int Probecompression(t_printdata *print) {
+  int i,n,worthwhile;
+  uint32_t size,l,count[256];
+  uint64_t offset;
+  uchar *sample,*packed;
+  char nam[MAXFILE],ext[MAXEXT];
+  float entropy,p;
+  // GnuPG output is always compressed and encrypted.
+  fnsplit(print->infile,NULL,NULL,nam,ext);
+  if (strnicmp(ext,".gpg",5)==0 || strnicmp(ext,".pgp",5)==0)
+    return 0;
+  // Gather samples.
+  n=(print->origsize+PROBELEN-1)/PROBELEN<NPROBE?
+    (print->origsize+PROBELEN-1)/PROBELEN:NPROBE;
+  sample=(uchar *)malloc(n*PROBELEN);
+  packed=(uchar *)malloc(n*PROBELEN+n*PROBELEN/100+600);
+  if (sample==NULL || packed==NULL) {
+    if (sample!=NULL) free(sample);
+    if (packed!=NULL) free(packed);
+    return 1; };                       // Let the compressor decide
+  size=0;
+  for (i=0; i<n; i++) {
+    if (n==1)
+      offset=0;
+    else
+      offset=(print->origsize-PROBELEN)*i/(n-1);
+    fseeko(print->hfile,offset,SEEK_SET);
+    size+=fread(sample+size,sizeof(uchar),
+      print->origsize-offset<PROBELEN?print->origsize-offset:PROBELEN,
+      print->hfile);
+    ;
+  };
+  rewind(print->hfile);
+  // Estimate entropy, bits per byte.
+  memset(count,0,sizeof(count));
+  for (l=0; l<size; l++) count[sample[l]]++;
+  entropy=0.0;
+  for (i=0; i<256; i++) {
+    if (count[i]==0) continue;
+    p=(float)count[i]/size;
+    entropy-=p*log2f(p); };
+  if (entropy>7.9)
+    worthwhile=0;
+  else {
+    // Make a trial with fast compression. Block-sorting compressors are not
+    // very efficient on short samples, so the estimation is conservative.
+    l=n*PROBELEN+n*PROBELEN/100+600;
+    if (BZ2_bzBuffToBuffCompress((char *)packed,&l,(char *)sample,size,
+      1,0,0)!=BZ_OK)
+      worthwhile=0;
+    else
+      worthwhile=(l<size-size/32);
+    ;
+  };
+  free(sample);
+  free(packed);
+  return worthwhile;
+};
+
+// Moves output window of the compressor forward. bzip2 counts free space in
+// 32 bits, so buffers longer than 4 GB are passed in pieces. Returns 0 if
+// buffer is full and 1 otherwise.
+static int Moveoutput(t_printdata *print) {
+  uint64_t done;
+  if (print->bzstream.avail_out>0)
+    return 1;
+  done=((uint64_t)print->bzstream.total_out_hi32<<32)+
+    print->bzstream.total_out_lo32;
+  if (done>=print->bufsize)
+    return 0;
+  print->bzstream.next_out=(char *)print->buf+done;
+  print->bzstream.avail_out=(print->bufsize-done<0x80000000?
+    print->bufsize-done:0x80000000);
+  return 1;
+};
+
 // Initializes bzip2 compression engine.
 static void Preparecompressor(t_printdata *print) {
   int success;
-  // Check whether compression is requested at all.
+  // Check whether compression is requested at all and whether it makes
+  // sense. In the automatic mode, data that is worth packing gets maximal
+  // compression.
+  if (print->compression!=0 && Probecompression(print)==0) {
+    Message("Data is incompressible, compression disabled",0);
+    print->compression=0;
+    print->multistream=0; }
+  else if (print->compression==3)
+    print->compression=2;
+  // If file is mapped, buffer is necessary only for the output of the
+  // compressor and for the data that will be encrypted in place.
+  if (print->map!=NULL && print->buf==NULL && (print->encryption!=0 ||
+    (print->compression!=0 && print->multistream==0))
+  ) {
+    print->buf=(uchar *)malloc(print->bufsize);
+    if (print->buf==NULL) {
+      Reporterror("Low memory");
+      Stopprinting(print);
+      return; };
+    ;
+  };
   if (print->compression==0) {
     print->step++;
     return; 
   };
+  // Multistream data is read as is and compressed later as a set of
+  // independent streams, see Packsegments().
+  if (print->multistream) {
+    print->step++;
+    return; 
+  };
   // Initialize compressor. On error, I silently disable compression.
   memset(&print->bzstream,0,sizeof(print->bzstream));
   success=BZ2_bzCompressInit(&print->bzstream,
@@ -286,8 +521,7 @@ static void Preparecompressor(t_printdata *print) {
     print->compression=0;              // Disable compression
     print->step++;
     return; };
-  print->bzstream.next_out=(char *)print->buf;
-  print->bzstream.avail_out=print->bufsize;
+  Moveoutput(print);
   // Step finished.
   print->step++;
 };
@@ -298,23 +532,33 @@ static void Preparecompressor(t_printdata *print) {
 static void Readandcompress(t_printdata *print) {
   int success;
   uint32_t size,l;
-  // Read next piece of data.
-  size=print->origsize-print->readsize;
-  if (size>PACKLEN) size=PACKLEN;
-  //success=ReadFile(print->hfile,print->readbuf,size,&l,NULL);
-  l = fread ((void*)print->readbuf, sizeof(uchar), size, print->hfile);
-                    
-  if (l!=size) {
-    Reporterror("Unable to read file");
-    Stopprinting(print);
-    return; };
+  uchar *data;
+  // Read next piece of data. Mapped file needs no reading.
+  if (print->origsize-print->readsize>PACKLEN)
+    size=PACKLEN;
+  else
+    size=print->origsize-print->readsize;
+  if (print->map!=NULL)
+    data=print->map+print->readsize;
+  else {
+    //success=ReadFile(print->hfile,print->readbuf,size,&l,NULL);
+    l = fread ((void*)print->readbuf, sizeof(uchar), size, print->hfile);
+    if (l!=size) {
+      Reporterror("Unable to read file");
+      Stopprinting(print);
+      return; };
+    data=print->readbuf;
+  };
   // If compression is active, compress next piece of data. Otherwise, just
   // copy data to buffer.
-  if (print->compression) {
+  if (print->compression && print->multistream==0) {
     Message("Compressing file",(print->readsize+size)*100/print->origsize);
-    print->bzstream.next_in=(char *)print->readbuf;
+    print->bzstream.next_in=(char *)data;
     print->bzstream.avail_in=size;
-    success=BZ2_bzCompress(&print->bzstream,BZ_RUN);
+    do {
+      success=BZ2_bzCompress(&print->bzstream,BZ_RUN);
+    } while (success==BZ_RUN_OK && print->bzstream.avail_in!=0 &&
+      Moveoutput(print));
     if (print->bzstream.avail_in!=0 || success!=BZ_RUN_OK) {
       Reporterror("Unable to compress data. Try to disable compression.");
       Stopprinting(print);
@@ -322,17 +566,24 @@ static void Readandcompress(t_printdata *print) {
     print->readsize+=size;
     // If compression runs out of memory, probably the data is already packed.
     // Silently restart without compression.
-    if (print->readsize<print->origsize && print->bzstream.avail_out==0) {
+    if (print->readsize<print->origsize && Moveoutput(print)==0) {
       BZ2_bzCompressEnd(&print->bzstream);
       print->compression=0;
       //SetFilePointer(print->hfile,0,NULL,FILE_BEGIN);
       rewind(print->hfile);
       print->readsize=0;
+      if (print->map!=NULL && print->encryption==0) {
+        free(print->buf);
+        print->buf=NULL; };
       return;
     }; }
+  else if (print->buf==NULL) {
+    // Data is taken directly from the mapped file.
+    print->buf=print->map;
+    print->readsize=print->origsize; }
   else {
     //Message("Reading file", (print->readsize+size)*100/print->origsize);
-    memcpy(print->buf+print->readsize,print->readbuf,size);
+    memcpy(print->buf+print->readsize,data,size);
     print->readsize+=size; };
   // If all data is read, finish step.
   if (print->readsize==print->origsize)
@@ -342,13 +593,96 @@ static void Readandcompress(t_printdata *print) {
 
 
 
+typedef struct t_segment {             // Independently compressed piece
+  uchar          *in;                  // Uncompressed data
+  uint32_t       insize;               // Size of uncompressed data
+  uchar          *out;                 // Compressed data
+  uint32_t       outsize;              // Size of compressed data
+  int            level;                // bzip2 block size, 1..9
+  int            success;              // Compressed successfully
+} t_segment;
+
+// Compresses one segment, called by Parallelfor().
+static void Compresssegment(void *arg,int index) {
+  t_segment *ps=((t_segment *)arg)+index;
+  // Compressed data may be slightly larger than the original, see bzip2
+  // manual.
+  ps->outsize=ps->insize+ps->insize/100+600;
+  ps->out=(uchar *)malloc(ps->outsize);
+  if (ps->out==NULL) return;
+  ps->success=(BZ2_bzBuffToBuffCompress((char *)ps->out,&ps->outsize,
+    (char *)ps->in,ps->insize,ps->level,0,0)==BZ_OK);
+  ;
+};
+
+// Compresses data in buf as a set of independent bzip2 streams, SEGLEN bytes
+// of original data each, on several threads. Packed data starts with 32-bit
+// SEGLEN, followed by streams, each preceded by its 32-bit length. Returns
+// size of packed data or 0 if data is incompressible or on error; in this
+// case, buf still contains original data.
+static uint64_t Packsegments(t_printdata *print) {
+  int i,nseg;
+  uint32_t l;
+  uint64_t size;
+  uchar *out,*pout;
+  t_segment *seg;
+  nseg=(print->origsize+SEGLEN-1)/SEGLEN;
+  seg=(t_segment *)calloc(nseg,sizeof(t_segment));
+  if (seg==NULL)
+    return 0;
+  for (i=0; i<nseg; i++) {
+    seg[i].in=print->buf+(size_t)i*SEGLEN;
+    seg[i].insize=(i<nseg-1?SEGLEN:print->origsize-(uint64_t)i*SEGLEN);
+    seg[i].level=(print->compression==1?1:9); };
+  Message("Compressing file",0);
+  Parallelfor(nseg,print->threads,Compresssegment,seg);
+  // Concatenate streams, if they fit into the buffer.
+  size=sizeof(uint32_t);
+  for (i=0; i<nseg; i++) {
+    if (seg[i].success==0) size=print->bufsize;
+    if (size>=print->bufsize) break;
+    size+=sizeof(uint32_t)+seg[i].outsize; };
+  out=NULL;
+  if (i==nseg && size<print->bufsize)
+    out=(uchar *)malloc(print->bufsize);
+  if (out!=NULL) {
+    pout=out;
+    l=SEGLEN;
+    memcpy(pout,&l,sizeof(uint32_t)); pout+=sizeof(uint32_t);
+    for (i=0; i<nseg; i++) {
+      memcpy(pout,&seg[i].outsize,sizeof(uint32_t)); pout+=sizeof(uint32_t);
+      memcpy(pout,seg[i].out,seg[i].outsize); pout+=seg[i].outsize; };
+    size=pout-out;
+    if (print->buf!=print->map)
+      free(print->buf);
+    print->buf=out; }
+  else
+    size=0;
+  for (i=0; i<nseg; i++) {
+    if (seg[i].out!=NULL) free(seg[i].out); };
+  free(seg);
+  return size;
+};
+
 // Finishes compression (may take significant time) and closes input file.
 static void Finishcompression(t_printdata *print) {
   int success;
-  uint32_t l;
+  uint64_t l;
   // Finish compression.
-  if (print->compression) {
-    success=BZ2_bzCompress(&print->bzstream,BZ_FINISH);
+  if (print->compression && print->multistream) {
+    // Compress independent streams in parallel. If data is incompressible,
+    // it's already in the buffer.
+    print->datasize=Packsegments(print);
+    if (print->datasize==0) {
+      print->compression=0;
+      print->multistream=0;
+      print->datasize=print->origsize; };
+    ; }
+  else if (print->compression) {
+    do {
+      success=BZ2_bzCompress(&print->bzstream,BZ_FINISH);
+    } while (success==BZ_FINISH_OK && print->bzstream.avail_out==0 &&
+      Moveoutput(print));
     // If compression runs out of memory, probably the data is already packed.
     // Silently restart without compression.
     if (success==BZ_FINISH_OK && print->bzstream.avail_out==0) {
@@ -357,6 +691,9 @@ static void Finishcompression(t_printdata *print) {
       //SetFilePointer(print->hfile,0,NULL,FILE_BEGIN);
       rewind(print->hfile);
       print->readsize=0;
+      if (print->map!=NULL && print->encryption==0) {
+        free(print->buf);
+        print->buf=NULL; };
       print->step--;
       return; };
     // If compression routine reports other error, stop processing.
@@ -365,22 +702,34 @@ static void Finishcompression(t_printdata *print) {
       Stopprinting(print);
       return; };
     // File compressed. Update size of compressed data and finish.
-    print->datasize=print->bzstream.total_out_lo32;
+    print->datasize=((uint64_t)print->bzstream.total_out_hi32<<32)+
+      print->bzstream.total_out_lo32;
     BZ2_bzCompressEnd(&print->bzstream); }
   else
     print->datasize=print->origsize;
   // Align size of (compressed) data to next 16-byte border. Note that bzip2
   // doesn't mind if data passed to decompressor is longer than expected.
-  print->alignedsize=(print->datasize+15) & 0xFFFFFFF0;
-  // Zero aligning bytes.
-  for (l=print->datasize; l<print->alignedsize; l++)
-    print->buf[l]='\0';
+  print->alignedsize=(print->datasize+15) & ~(uint64_t)15;
+  // Zero aligning bytes. Mapped file is read-only and may end at the page
+  // border; Printnextpage() pads data beyond datasize with zeros anyway.
+  if (print->buf!=print->map) {
+    for (l=print->datasize; l<print->alignedsize; l++)
+      print->buf[l]='\0';
+    ;
+  };
   // Close file.
   //CloseHandle(print->hfile);
   fclose(print->hfile);
   print->hfile=NULL;
+#ifdef __linux__
+  // If data was compressed, mapping is no longer necessary.
+  if (print->map!=NULL && print->buf!=print->map) {
+    munmap(print->map,print->origsize);
+    print->map=NULL; };
+#endif
   // Free read buffer. We no longer need it.
-  free(print->readbuf);
+  if (print->readbuf!=NULL)
+    free(print->readbuf);
   print->readbuf=NULL;
   // Step finished.
   print->step++;
@@ -431,6 +780,151 @@ static void Encryptdata(t_printdata *print) {
 
 
 
+// Calculates number of recovery blocks of column groups on the page with
+// nstring groups. Groups are split into squares of redundancy groups, and each
+// string of the square gets one more recovery block. Returns 0 if there are no
+// column groups.
+static int Columnblocks(t_printdata *print,int nstring) {
+  if (print->columngroups==0)
+    return 0;
+  return (nstring+print->redundancy-1)/print->redundancy*print->redundancy;
+};
+
+// Calculates number of rows of blocks on the page with given index (0-based).
+// Vertical size of the table on the last page may be reduced. To assure
+// reliable orientation, I request at least 3 rows.
+static int Pagerows(t_printdata *print,int page) {
+  int n,nstring;
+  uint64_t l;
+  l=print->pagesize;                   // Parity pages are always full
+  if (page<print->ndatapages &&
+    print->alignedsize-(uint64_t)page*print->pagesize<l)
+    l=print->alignedsize-(uint64_t)page*print->pagesize;
+  n=(l+NDATA-1)/NDATA;                 // Number of pure data blocks on page
+  nstring=                             // Number of groups (length of string)
+    (n+print->redundancy-1)/print->redundancy;
+  n=(nstring+1)*(print->redundancy+1)+1; // Total number of blocks to print
+  n+=Columnblocks(print,nstring);
+  n=max((n+print->nx-1)/print->nx,3);  // Number of rows (at least 3)
+  return min(n,print->ny);
+};
+
+// Draws static part of the page with ny rows of blocks that doesn't depend on
+// the data: white background, grid lines and regular raster around the grid.
+static void Drawtemplate(t_printdata *print,uchar *bits,int ny) {
+  int dx,dy,px,py,nx,width,height,border,black;
+  int i,j,k,basex;
+  dx=print->dx;
+  dy=print->dy;
+  px=print->px;
+  py=print->py;
+  nx=print->nx;
+  width=print->width;
+  border=print->border;
+  black=print->black;
+  height=ny*(NDOT+3)*dy+py+2*border;
+  // Initialize bitmap to all white.
+  memset(bits,255,height*width);
+  // Draw vertical grid lines.
+  for (i=0; i<=nx; i++) {
+    if (print->printborder) {
+      basex=i*(NDOT+3)*dx+border;
+      for (j=0; j<ny*(NDOT+3)*dy+py+2*border; j++,basex+=width) {
+        for (k=0; k<px; k++) bits[basex+k]=0;
+      }; 
+    }
+    else {
+      basex=i*(NDOT+3)*dx+width*border+border;
+      for (j=0; j<ny*(NDOT+3)*dy; j++,basex+=width) {
+        for (k=0; k<px; k++) bits[basex+k]=0;
+      };
+    };
+  };
+  // Draw horizontal grid lines.
+  for (j=0; j<=ny; j++) {
+    if (print->printborder) {
+      for (k=0; k<py; k++) {
+        memset(bits+(j*(NDOT+3)*dy+k+border)*width,0,width);
+      }; 
+    }
+    else {
+      for (k=0; k<py; k++) {
+        memset(bits+(j*(NDOT+3)*dy+k+border)*width+border,0,
+            nx*(NDOT+3)*dx+px);
+      };
+    };
+  };
+  // Fill borders with regular raster.
+  if (print->printborder) {
+    for (j=-1; j<=ny; j++) {
+      Fillblock(-1,j,bits,width,height,border,nx,ny,dx,dy,px,py,black);
+      Fillblock(nx,j,bits,width,height,border,nx,ny,dx,dy,px,py,black); 
+    };
+    for (i=0; i<nx; i++) {
+      Fillblock(i,-1,bits,width,height,border,nx,ny,dx,dy,px,py,black);
+      Fillblock(i,ny,bits,width,height,border,nx,ny,dx,dy,px,py,black);
+    };
+  };
+};
+
+
+
+// Packs page template in place to 1 bit per pixel, as expected by 2-colour
+// bitmap. Both dots and grid lines are black. Packed scan lines are shorter
+// than the original, so packing never overwrites pixels that are not yet
+// processed.
+static void Packpage(uchar *bits,int width,int height) {
+  int i,j,k,stride;
+  uchar *pin,*pout,b;
+  stride=((width+31)/32)*4;
+  for (j=0; j<height; j++) {
+    pin=bits+j*width;
+    pout=bits+j*stride;
+    for (i=0; i<width; i+=8) {
+      b=0;
+      for (k=0; k<8; k++) {
+        b<<=1;
+        if (i+k<width && pin[i+k]>=128) b|=1; };
+      *pout++=b; };
+    for (i=(width+7)/8; i<stride; i++)
+      *pout++=0;
+    ;
+  };
+};
+
+
+
+// Returns number of bytes in buf that are printed as is. Own buffer holds all
+// aligned data, including the tail of the last AES record, and it must be
+// printed in full. Mapped file ends at datasize; the rest is zero padding.
+static uint64_t Printedsize(t_printdata *print) {
+  if (print->buf==print->map)
+    return print->datasize;
+  return print->alignedsize;
+};
+
+// Calculates one parity page, called by Parallelfor().
+static void Paritypagejob(void *arg,int index) {
+  t_printdata *print=(t_printdata *)arg;
+  Encodeparitypage(print->parity+(size_t)index*print->pagesize,print->buf,
+    Printedsize(print),print->pagesize,print->ndatapages,index);
+  ;
+};
+
+// Calculates pageparity parity pages for each stripe of data pages. Parity
+// pages continue addresses of data. Returns 0 on success and -1 on error.
+static int Calculateparity(t_printdata *print) {
+  int nparity;
+  nparity=print->pageparity*Paritystripes(print->ndatapages);
+  print->parity=(uchar *)malloc((size_t)nparity*print->pagesize);
+  if (print->parity==NULL) {
+    Reporterror("Low memory, can't calculate parity pages");
+    return -1; };
+  Message("Calculating parity pages",0);
+  Parallelfor(nparity,print->threads,Paritypagejob,print);
+  return 0;
+};
+
 // Prepares for printing. Despite its size, this routine is very quick.
 static void Initializeprinting(t_printdata *print) {
   int i,dx,dy,px,py,nx,ny,width,height,success,rastercaps;
@@ -439,12 +933,18 @@ static void Initializeprinting(t_printdata *print) {
   //SIZE extent; //For calculating header/footer space
   // Prepare superdata.
   print->superdata.addr=SUPERBLOCK;
-  print->superdata.datasize=print->alignedsize;
-  print->superdata.origsize=print->origsize;
+  print->superdata.datasize=(uint32_t)print->alignedsize;
+  print->superdata.origsize=(uint32_t)print->origsize;
   if (print->compression)
     print->superdata.mode|=PBM_COMPRESSED;
+  if (print->compression && print->multistream)
+    print->superdata.mode|=PBM_MULTISTREAM;
   if (print->encryption)
     print->superdata.mode|=PBM_ENCRYPTED;
+  if (print->columngroups)
+    print->superdata.mode|=PBM_COLUMNGROUPS;
+  if (print->archive)
+    print->superdata.mode|=PBM_ARCHIVE;
   //mask windows values, otherwise leave *nix mode data alone
   print->superdata.attributes=(uchar)(print->attributes &
     (FILE_ATTRIBUTE_READONLY|FILE_ATTRIBUTE_HIDDEN|
@@ -458,7 +958,7 @@ static void Initializeprinting(t_printdata *print) {
   else
     fnmerge(fil,NULL,NULL,nam,NULL);
   // Note that name in superdata may be not null-terminated.
-  printf("Encoding %s to bitmap\n", fil);
+  fprintf(pb_stdout?stderr:stdout, "Encoding %s to bitmap\n", fil);
   size_t dataSize = sizeof(print->superdata.name);
   strncpy(print->superdata.name,fil,dataSize);
   print->superdata.name[dataSize] = '\0'; // ensure that later string operations don't overflow into binary data
@@ -577,6 +1077,8 @@ static void Initializeprinting(t_printdata *print) {
     width=print->ppix*8270/1000;
     height=print->ppiy*11690/1000; 
     //};
+    print->paperwidth=width;
+    print->paperheight=height;
     //print->hfont6=NULL;
     //print->hfont10=NULL;
     //print->extratop=print->extrabottom=0;
@@ -656,6 +1158,13 @@ static void Initializeprinting(t_printdata *print) {
     pbmi->bmiColors[i].rgbGreen=(uchar)i;
     pbmi->bmiColors[i].rgbRed=(uchar)i;
     pbmi->bmiColors[i].rgbReserved=0; };
+  // Black and white bitmap has only two colours. Pages are drawn directly
+  // with 1 bit per pixel, see Drawpackedblock().
+  if (print->format==FMT_BMP1) {
+    pbmi->bmiHeader.biBitCount=1;
+    pbmi->bmiHeader.biClrUsed=2;
+    pbmi->bmiHeader.biClrImportant=2;
+    pbmi->bmiColors[1]=pbmi->bmiColors[255]; };
   // Create bitmap. Direct drawing is faster than tens of thousands of API
   // calls.
   //if (print->outbmp[0]=='\0') {        // Print to paper
@@ -672,20 +1181,36 @@ static void Initializeprinting(t_printdata *print) {
     Stopprinting(print);
     return;
   }
-  else {                               // Save to bitmap
-    print->drawbits=(uchar *)malloc(width*height);
-    if (print->drawbits==NULL) {
-      Reporterror("Low memory, can't create bitmap");
-      return;
-    };
-  };
   // Calculate the total size of useful data, bytes, that fits onto the page.
   // For each redundancy blocks, I create one recovery block. For each chain, I
   // create one superblock that contains file name and size, plus at least one
   // superblock at the end of the page.
-  print->pagesize=((nx*ny-print->redundancy-2)/(print->redundancy+1))*
-    print->redundancy*NDATA;
+  // Column groups are placed after the last string, so page holds less data.
+  i=(nx*ny-print->redundancy-2)/(print->redundancy+1);
+  while (i>0 &&
+    (i+1)*(print->redundancy+1)+Columnblocks(print,i)>nx*ny-1)
+    i--;
+  if (i==0) {
+    Reporterror("Printable area is too small, reduce borders or block size");
+    Stopprinting(print);
+    return; };
+  print->pagesize=i*print->redundancy*NDATA;
   print->superdata.pagesize=print->pagesize;
+  print->ndatapages=(print->datasize+print->pagesize-1)/print->pagesize;
+  print->npages=print->ndatapages;
+  // Calculate parity pages. They are printed after the data.
+  if (print->pageparity>0) {
+    if (Calculateparity(print)!=0) {
+      Stopprinting(print);
+      return; };
+    print->superdata.mode|=PBM_PAGEPARITY;
+    print->npages+=print->pageparity*Paritystripes(print->ndatapages);
+  };
+  // If addresses of the last page don't fit into 28 bits, addresses on each
+  // page are relative to the page, and page gets superblock extensions with
+  // full sizes, see Renderpage().
+  if ((uint64_t)print->npages*print->pagesize>MAXSIZE)
+    print->superdata.mode|=PBM_EXTADDR;
   // Save calculated parameters.
   print->width=width;
   print->height=height;
@@ -695,6 +1220,69 @@ static void Initializeprinting(t_printdata *print) {
   print->py=py;
   print->nx=nx;
   print->ny=ny;
+  // Allocate bitmaps. Each worker thread draws its own page. If memory is
+  // low, I fall back to the single bitmap. Black and white pages are drawn
+  // directly packed to 1 bit per pixel.
+  print->npagebuf=min(print->threads,print->npages);
+  print->npagebuf=max(min(print->npagebuf,64),1);
+  print->drawbits=(uchar *)malloc((size_t)print->npagebuf*Linesize(print)*height);
+  if (print->drawbits==NULL && print->npagebuf>1) {
+    print->npagebuf=1;
+    print->drawbits=(uchar *)malloc(Linesize(print)*height); };
+  if (print->drawbits==NULL) {
+    Reporterror("Low memory, can't create bitmap");
+    Stopprinting(print);
+    return;
+  };
+  // All pages of PDF go to the single file.
+  if (print->format==FMT_PDF) {
+    fnsplit(print->outbmp,NULL,NULL,nam,ext);
+    strcpy(fil,print->outbmp);
+    if (ext[0]=='\0') strcat(fil,".pdf");
+    if (Pdfopen(&print->pdf,fil)!=0) {
+      Reporterror("Unable to create PDF file");
+      Stopprinting(print);
+      return; };
+    ;
+  };
+  // Pre-rasterise dot spans.
+  print->dotspan=(uchar *)malloc(256*8*dx);
+  if (print->dotspan==NULL) {
+    Reporterror("Low memory, can't create bitmap");
+    Stopprinting(print);
+    return;
+  };
+  Preparedotspans(print->dotspan,dx,px,print->black);
+  // Draw static page templates, one for the full page and, if the last page
+  // is shorter, one for the last page. Full page may have less than ny rows
+  // if column groups leave the last row free. These are the only heights that
+  // Pagerows() returns. If memory is low, pages are drawn from scratch.
+  // Templates of black and white pages are drawn with 1 byte per pixel and
+  // then packed, so they are mandatory.
+  print->fullny=Pagerows(print,print->ndatapages);
+  print->templbits=(uchar *)malloc(width*height);
+  if (print->templbits!=NULL)
+    Drawtemplate(print,print->templbits,print->fullny);
+  print->shortny=Pagerows(print,(print->datasize-1)/print->pagesize);
+  if (print->shortny!=print->fullny) {
+    print->shortbits=(uchar *)malloc(width*height);
+    if (print->shortbits!=NULL)
+      Drawtemplate(print,print->shortbits,print->shortny);
+    ;
+  };
+  if (print->format==FMT_BMP1) {
+    if (print->templbits==NULL ||
+      (print->shortny!=print->fullny && print->shortbits==NULL)) {
+      Reporterror("Low memory, can't create bitmap");
+      Stopprinting(print);
+      return; };
+    Packpage(print->templbits,width,
+      print->fullny*(NDOT+3)*dy+py+2*print->border);
+    if (print->shortbits!=NULL)
+      Packpage(print->shortbits,width,
+      print->shortny*(NDOT+3)*dy+py+2*print->border);
+    ;
+  };
   // Start printing.
   //if (print->outbmp[0]=='\0') {
   //  if (pagesetup.hDevNames!=NULL)
@@ -722,102 +1310,77 @@ static void Initializeprinting(t_printdata *print) {
   print->step++;
 };
 
-// Prints one complete page or saves one bitmap.
-static void Printnextpage(t_printdata *print) {
-  int dx,dy,px,py,nx,ny,width,height,border,redundancy,black;
-  int i,j,k,l,n,success,basex,nstring,npages,rot;
-  char s[TEXTLEN],ts[TEXTLEN/2];
-  char drv[MAXDRIVE],dir[MAXDIR],nam[MAXFILE],ext[MAXEXT],path[MAXPATH+32];
-  uchar *bits;
-  uint32_t u,size,pagesize,offset;
-  t_data block,cksum;
-  //HANDLE hbmpfile;
-  FILE *hbmpfile;
-  BITMAPFILEHEADER bmfh;
-  BITMAPINFO *pbmi;
-  // Calculate offset of this page in data.
-  offset=print->frompage*print->pagesize;
-  if (offset>=print->datasize || print->frompage>print->topage) {
-    // All requested pages are printed, finish this step.
-    print->step++;
-    return; 
-  };
-  // Report page.
-  npages=(print->datasize+print->pagesize-1)/print->pagesize;
-  sprintf(s,"Processing page %i of %i...",print->frompage+1,npages);
-  Message(s,0);
+// Draws page with given index (0-based) into bits. Bitmap must be at least
+// Linesize()*height bytes long. Routine uses only geometry calculated by
+// Initializeprinting() and data in buf or parity, so several pages can be
+// drawn in parallel. Returns actual height of the page, pixels.
+static int Renderpage(t_printdata *print,int page,uchar *bits) {
+  int dy,py,nx,ny,height,border,redundancy;
+  int i,j,k,l,n,nstring,rot;
+  uint32_t pagesize,offset,start,end,u;
+  uint64_t base,size;
+  uchar *data;
+  t_data block,cksum,*label;
+  t_superdata superdata;
+  t_extdata extdata;
   // Get frequently used variables.
-  dx=print->dx;
   dy=print->dy;
-  px=print->px;
   py=print->py;
   nx=print->nx;
-  ny=print->ny;
-  width=print->width;
   border=print->border;
-  size=print->alignedsize;
   pagesize=print->pagesize;
   redundancy=print->redundancy;
-  black=print->black;
-  if (print->outbmp[0]=='\0')
-    bits=print->dibbits;
+  base=(uint64_t)page*pagesize;        // Offset of the page in data
+  ny=Pagerows(print,page);
+  // Get data of the page. Parity pages are full, data pages end at the size
+  // returned by Printedsize(). In extended mode, addresses on every page
+  // start with 0.
+  offset=(print->superdata.mode & PBM_EXTADDR?0:(uint32_t)base);
+  start=offset;
+  if (page>=print->ndatapages) {
+    data=print->parity+(size_t)(page-print->ndatapages)*pagesize;
+    end=pagesize; }
+  else {
+    data=print->buf+base;
+    size=Printedsize(print)-base;
+    end=(size<pagesize?(uint32_t)size:pagesize); };
+  height=ny*(NDOT+3)*dy+py+2*border;
+  // Start with static template: white background, grid lines and border
+  // raster. Only the last page may be shorter than the rest. Templates of
+  // black and white pages always exist, unpacked template doesn't fit there.
+  if (ny==print->fullny && print->templbits!=NULL)
+    memcpy(bits,print->templbits,height*Linesize(print));
+  else if (ny==print->shortny && print->shortbits!=NULL)
+    memcpy(bits,print->shortbits,height*Linesize(print));
+  else if (print->format!=FMT_BMP1)
+    Drawtemplate(print,bits,ny);
+  ;
+  // Get number of groups on the page.
+  if (page>=print->ndatapages || print->alignedsize-base>=pagesize)
+    l=pagesize;
   else
-    bits=print->drawbits;
-  // Check if we can reduce the vertical size of the table on the last page.
-  // To assure reliable orientation, I request at least 3 rows.
-  l=min(size-offset,pagesize);
+    l=print->alignedsize-base;
   n=(l+NDATA-1)/NDATA;                 // Number of pure data blocks on page
   nstring=                             // Number of groups (length of string)
     (n+redundancy-1)/redundancy;
-  n=(nstring+1)*(redundancy+1)+1;      // Total number of blocks to print
-  n=max((n+nx-1)/nx,3);                // Number of rows (at least 3)
-  if (ny>n) ny=n;
-  height=ny*(NDOT+3)*dy+py+2*border;
-  // Initialize bitmap to all white.
-  memset(bits,255,height*width);
-  // Draw vertical grid lines.
-  for (i=0; i<=nx; i++) {
-    if (print->printborder) {
-      basex=i*(NDOT+3)*dx+border;
-      for (j=0; j<ny*(NDOT+3)*dy+py+2*border; j++,basex+=width) {
-        for (k=0; k<px; k++) bits[basex+k]=0;
-      }; 
-    }
-    else {
-      basex=i*(NDOT+3)*dx+width*border+border;
-      for (j=0; j<ny*(NDOT+3)*dy; j++,basex+=width) {
-        for (k=0; k<px; k++) bits[basex+k]=0;
-      };
-    };
-  };
-  // Draw horizontal grid lines.
-  for (j=0; j<=ny; j++) {
-    if (print->printborder) {
-      for (k=0; k<py; k++) {
-        memset(bits+(j*(NDOT+3)*dy+k+border)*width,0,width);
-      }; 
-    }
-    else {
-      for (k=0; k<py; k++) {
-        memset(bits+(j*(NDOT+3)*dy+k+border)*width+border,0,
-            nx*(NDOT+3)*dx+px);
-      };
-    };
-  };
-  // Fill borders with regular raster.
-  if (print->printborder) {
-    for (j=-1; j<=ny; j++) {
-      Fillblock(-1,j,bits,width,height,border,nx,ny,dx,dy,px,py,black);
-      Fillblock(nx,j,bits,width,height,border,nx,ny,dx,dy,px,py,black); 
-    };
-    for (i=0; i<nx; i++) {
-      Fillblock(i,-1,bits,width,height,border,nx,ny,dx,dy,px,py,black);
-      Fillblock(i,ny,bits,width,height,border,nx,ny,dx,dy,px,py,black);
-    };
-  };
-  // Update superblock.
-  print->superdata.page=
-    (ushort)(print->frompage+1);       // Page number is 1-based
+  // Update superblock. Each page gets its own copy, as pages may be drawn
+  // simultaneously.
+  superdata=print->superdata;
+  superdata.page=(ushort)(page+1);     // Page number is 1-based
+  // Superblock is the same in all cells, so I encode it only once.
+  Encodeblock((t_data *)&superdata);
+  // In extended mode, every second label is the superblock extension.
+  label=(t_data *)&superdata;
+  if (superdata.mode & PBM_EXTADDR) {
+    memset(&extdata,0,sizeof(extdata));
+    extdata.addr=EXTBLOCK;
+    extdata.version=EXTVERSION;
+    extdata.datasize=print->alignedsize;
+    extdata.origsize=print->origsize;
+    extdata.base=base;
+    extdata.page=page+1;
+    Encodeblock((t_data *)&extdata);
+    label=(t_data *)&extdata; };
   // First block in every string (including redundancy string) is a superblock.
   // To improve redundancy, I avoid placing blocks belonging to the same group
   // in the same column (consider damaged diode in laser printer).
@@ -825,8 +1388,7 @@ static void Printnextpage(t_printdata *print) {
     k=j*(nstring+1);
     if (nstring+1>=nx)
       k+=(nx/(redundancy+1)*j-k%nx+nx)%nx;
-    Drawblock(k,(t_data *)&print->superdata,
-        bits,width,height,border,nx,ny,dx,dy,px,py,black); 
+    Drawcell(print,k,(j & 1?label:(t_data *)&superdata),bits,height);
   };
   // Now the most important part - encode and draw data, group by group!
   for (i=0; i<nstring; i++) {
@@ -837,10 +1399,10 @@ static void Printnextpage(t_printdata *print) {
     for (j=0; j<redundancy; j++) {
       // Fill block with data.
       block.addr=offset;
-      if (offset<size) {
-        l=size-offset;
+      if (offset-start<end) {
+        l=end-(offset-start);
         if (l>NDATA) l=NDATA;
-        memcpy(block.data,print->buf+offset,l); 
+        memcpy(block.data,data+offset-start,l); 
       }
       else
         l=0;
@@ -860,7 +1422,8 @@ static void Printnextpage(t_printdata *print) {
         // string. Best understandable after two bottles of Weissbier.
         rot=(nx/(redundancy+1)*j-k%nx+nx)%nx;
         k+=(i+1+rot)%(nstring+1); };
-      Drawblock(k,&block,bits,width,height,border,nx,ny,dx,dy,px,py,black);
+      Encodeblock(&block);
+      Drawcell(print,k,&block,bits,height);
       offset+=NDATA;
     };
     // Process redundancy block in the similar way.
@@ -871,63 +1434,129 @@ static void Printnextpage(t_printdata *print) {
       rot=(nx/(redundancy+1)*redundancy-k%nx+nx)%nx;
       k+=(i+1+rot)%(nstring+1); 
     };
-    Drawblock(k,&cksum,bits,width,height,border,nx,ny,dx,dy,px,py,black);
+    Encodeblock(&cksum);
+    Drawcell(print,k,&cksum,bits,height);
   };
-  // Print superblock in all remaining cells.
-  for (k=(nstring+1)*(redundancy+1); k<nx*ny; k++) {
-    Drawblock(k,(t_data *)&print->superdata,
-        bits,width,height,border,nx,ny,dx,dy,px,py,black); 
+  // Column groups. Each string is split into pieces of redundancy blocks that
+  // get their own recovery blocks, so that every data block belongs to two
+  // groups. Recovery blocks are placed after the last string. Address of the
+  // group is never aligned: it's the address of the first block plus distance
+  // between the blocks. Older versions take redundancy from any recovery
+  // block, so the last, short piece is padded with zeros to the full length.
+  k=(nstring+1)*(redundancy+1);
+  for (i=0; i<Columnblocks(print,nstring); i+=redundancy) {
+    for (j=0; j<redundancy; j++) {
+      offset=start+(i*redundancy+j)*NDATA;
+      cksum.addr=(offset+redundancy) ^ (redundancy<<28);
+      memset(cksum.data,0xFF,NDATA);
+      for (n=0; n<redundancy; n++) {
+        u=offset-start+n*redundancy*NDATA;
+        for (l=0; l<NDATA && u+l<end; l++)
+          cksum.data[l]^=data[u+l];
+        ;
+      };
+      Encodeblock(&cksum);
+      Drawcell(print,k++,&cksum,bits,height);
+      ;
+    };
   };
-  // When printing to paper, print title at the top of the page and info text
-  // at the bottom.
-  if (print->outbmp[0]=='\0') {
-    ////FIXME add header/footer to bmp output
-    //if (print->printheader) {
-    //  // Print title at the top of the page.
-    //  Filetimetotext(&print->modified,ts,sizeof(ts));
-    //  n=sprintf(s,"%.64s [%s, %i bytes] - page %i of %i",
-    //    print->superdata.name,ts,print->origsize,print->frompage+1,npages);
-    //  SelectObject(print->dc,print->hfont6);
-    //  TextOut(print->dc,print->borderleft+width/2,print->bordertop,s,n);
-    //  // Print info at the bottom of the page.
-    //  n=sprintf(s,"Recommended scanner resolution %i dots per inch",
-    //    max(print->ppix*3/dx,print->ppiy*3/dy));
-    //  SelectObject(print->dc,print->hfont10);
-    //  TextOut(print->dc,
-    //    print->borderleft+width/2,
-    //    print->bordertop+print->extratop+height+print->ppiy/24,s,n);
-    //  ;
-    //};
-    //// Transfer bitmap to paper and send page to printer.
-    //SetDIBitsToDevice(print->dc,
-    //  print->borderleft,print->bordertop+print->extratop,
-    //  width,height,0,0,0,height,bits,
-    //  (BITMAPINFO *)print->bmi,DIB_RGB_COLORS);
-    //EndPage(print->dc); 
-  }
+  // Print superblock (and extension) in all remaining cells.
+  for ( ; k<nx*ny; k++)
+    Drawcell(print,k,(k & 1?label:(t_data *)&superdata),bits,height);
+  ;
+  return height;
+};
+
+// Writes page as a binary PGM or PBM frame. Rows of PNM go from top to
+// bottom, and in PBM set bits are black. Returns 0 on success and -1 on
+// error.
+static int Writepnm(t_printdata *print,uchar *bits,int height,FILE *f) {
+  int i,j,k,width,stride;
+  uchar *row,*line,b;
+  width=print->width;
+  if (print->format==FMT_PGM) {
+    fprintf(f,"P5\n%i %i\n255\n",width,height);
+    for (j=height-1; j>=0; j--) {
+      if (fwrite(bits+j*width,1,width,f)!=(size_t)width)
+        return -1;
+      ;
+    }; }
   else {
-    // Save bitmap to file. First, get file name.
-    fnsplit(print->outbmp,drv,dir,nam,ext);
-    if (ext[0]=='\0') strcpy(ext,".bmp");
-    if (npages>1)
-      sprintf(path,"%s%s%s_%04i%s",drv,dir,nam,print->frompage+1,ext);
+    stride=(width+7)/8;
+    line=(uchar *)malloc(stride);
+    if (line==NULL)
+      return -1;
+    fprintf(f,"P4\n%i %i\n",width,height);
+    for (j=height-1; j>=0; j--) {
+      row=bits+j*width;
+      for (i=0; i<width; i+=8) {
+        b=0;
+        for (k=0; k<8; k++) {
+          b<<=1;
+          if (i+k<width && row[i+k]<128) b|=1; };
+        line[i/8]=b; };
+      if (fwrite(line,1,stride,f)!=(size_t)stride) {
+        free(line);
+        return -1; };
+      ;
+    };
+    free(line);
+  };
+  return ferror(f)?-1:0;
+};
+
+// Saves drawn page with given index (0-based) to bitmap file. If output goes
+// to stdout, pages are written one after another. Returns 0 on success and -1
+// on error.
+static int Savepage(t_printdata *print,int page,uchar *bits,int height) {
+  int n,width,stride,success;
+  char drv[MAXDRIVE],dir[MAXDIR],nam[MAXFILE],ext[MAXEXT],path[MAXPATH+32];
+  uint32_t u;
+  //HANDLE hbmpfile;
+  FILE *hbmpfile;
+  BITMAPFILEHEADER bmfh;
+  BITMAPINFO *pbmi;
+  width=print->width;
+  // Save bitmap to file. First, get file name.
+  fnsplit(print->outbmp,drv,dir,nam,ext);
+  if (ext[0]=='\0') {
+    if (print->format==FMT_PGM)
+      strcpy(ext,".pgm");
+    else if (print->format==FMT_PBM)
+      strcpy(ext,".pbm");
     else
-      sprintf(path,"%s%s%s%s",drv,dir,nam,ext);
-    // Create bitmap file.
-    //hbmpfile=CreateFile(path,GENERIC_WRITE,0,NULL,
-    //  CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+      strcpy(ext,".bmp");
+    ;
+  };
+  if (print->npages>1)
+    sprintf(path,"%s%s%s_%04i%s",drv,dir,nam,page+1,ext);
+  else
+    sprintf(path,"%s%s%s%s",drv,dir,nam,ext);
+  // Create bitmap file.
+  //hbmpfile=CreateFile(path,GENERIC_WRITE,0,NULL,
+  //  CREATE_ALWAYS,FILE_ATTRIBUTE_NORMAL,NULL);
+  if (pb_stdout)
+    hbmpfile = stdout;
+  else
     hbmpfile = fopen (path, "wb");
-    //if (hbmpfile==INVALID_HANDLE_VALUE) //
-    if (hbmpfile == NULL) {
-      Reporterror("Unable to create bitmap file");
-      Stopprinting(print);
-      return; 
-    };
+  //if (hbmpfile==INVALID_HANDLE_VALUE) //
+  if (hbmpfile == NULL) {
+    Reporterror("Unable to create bitmap file");
+    return -1; 
+  };
+  success=1;
+  if (print->format==FMT_PGM || print->format==FMT_PBM) {
+    if (Writepnm(print,bits,height,hbmpfile)!=0)
+      success=0;
+    ;
+  }
+  else {
     // Create and save bitmap file header.
-    success=1;
-    n=sizeof(BITMAPINFOHEADER)+256*sizeof(RGBQUAD);
+    pbmi=(BITMAPINFO *)print->bmi;
+    n=sizeof(BITMAPINFOHEADER)+pbmi->bmiHeader.biClrUsed*sizeof(RGBQUAD);
+    stride=((width*pbmi->bmiHeader.biBitCount+31)/32)*4;
     bmfh.bfType=CHAR_BM; //First two bytes are 'BM'
-    bmfh.bfSize=sizeof(bmfh)+n+width*height;
+    bmfh.bfSize=sizeof(bmfh)+n+stride*height;
     bmfh.bfReserved1=bmfh.bfReserved2=0;
     bmfh.bfOffBits=sizeof(bmfh)+n;
     u = fwrite (&bmfh, sizeof(char), sizeof(bmfh), hbmpfile);
@@ -937,7 +1566,6 @@ static void Printnextpage(t_printdata *print) {
     }
     // Update and save bitmap info header and palette.
     if (success) {
-      pbmi=(BITMAPINFO *)print->bmi;
       pbmi->bmiHeader.biWidth=width;
       pbmi->bmiHeader.biHeight=height;
       pbmi->bmiHeader.biXPelsPerMeter=(print->ppix*10000)/254;
@@ -950,22 +1578,147 @@ static void Printnextpage(t_printdata *print) {
       //  success=0;
       // Save bitmap data.
       if (success) {
-        u = fwrite (bits, sizeof(char), width*height, hbmpfile);
+        u = fwrite (bits, sizeof(char), stride*height, hbmpfile);
         //if (WriteFile(hbmpfile,bits,width*height,&u,NULL)==0 ||
         //  u!=(uint32_t)(width*height))
-        if (u != (ulong)(width*height))
+        if (u != (ulong)(stride*height))
           success=0;
       };
-      fclose(hbmpfile);
-      //CloseHandle(hbmpfile);
+    };
+  };
+  if (pb_stdout) {
+    if (fflush(hbmpfile)!=0)
+      success=0;
+    ; }
+  else if (fclose(hbmpfile)!=0)
+    success=0;
+  //CloseHandle(hbmpfile);
+  if (success==0) {
+    Reporterror("Unable to save bitmap");
+    return -1;
+  };
+  return 0;
+};
+
+typedef struct t_pagejob {             // Page drawn by the worker thread
+  t_printdata    *print;               // Print control structure
+  int            page;                 // Page index (0-based)
+  uchar          *bits;                // Page bitmap
+  int            height;               // Actual page height, pixels
+  uchar          *image;               // 1-bit page for PDF
+  uint32_t       length;               // Size of image, bytes
+  int            g4;                   // Image is G4-compressed
+} t_pagejob;
+
+// Draws one page, called by Parallelfor().
+static void Renderpagejob(void *arg,int index) {
+  t_pagejob *pj=((t_pagejob *)arg)+index;
+  pj->height=Renderpage(pj->print,pj->page,pj->bits);
+  if (pj->print->format==FMT_PDF) {
+    // Small dots are poorly compressible. If G4 doesn't help, page is saved
+    // uncompressed.
+    pj->length=Encodeg4(pj->bits,pj->print->width,pj->height,&pj->image);
+    pj->g4=1;
+    if (pj->length>(uint32_t)((pj->print->width+7)/8*pj->height)) {
+      free(pj->image);
+      pj->length=0; };
+    if (pj->length==0) {
+      pj->length=Encoderaw(pj->bits,pj->print->width,pj->height,&pj->image);
+      pj->g4=0; };
+    ;
+  };
+};
+
+// Prints next complete page or saves next bitmap. If there are several page
+// buffers, draws up to npagebuf pages in parallel and saves them in order.
+static void Printnextpage(t_printdata *print) {
+  int i,n,success;
+  char s[TEXTLEN];
+  t_pagejob job[64];
+  // Check whether all pages, including parity pages, are printed.
+  if (print->frompage>=print->npages || print->frompage>print->topage) {
+    // All requested pages are printed, finish this step.
+    if (print->format==FMT_PDF && Pdfclose(&print->pdf)!=0) {
+      Reporterror("Unable to save PDF file");
+      Stopprinting(print);
+      return; };
+    print->step++;
+    return; 
+  };
+  // Get pages to draw.
+  n=min(print->npagebuf,min(print->npages,print->topage+1)-print->frompage);
+  for (i=0; i<n; i++) {
+    // Report page.
+    sprintf(s,"Processing page %i of %i...",print->frompage+i+1,print->npages);
+    Message(s,0);
+    job[i].print=print;
+    job[i].page=print->frompage+i;
+    job[i].image=NULL;
+    job[i].length=0;
+    if (print->outbmp[0]=='\0')
+      job[i].bits=print->dibbits;
+    else
+      job[i].bits=print->drawbits+(size_t)i*Linesize(print)*print->height;
+    ;
+  };
+  Parallelfor(n,n,Renderpagejob,job);
+  // When printing to paper, print title at the top of the page and info text
+  // at the bottom.
+  if (print->outbmp[0]=='\0') {
+    ////FIXME add header/footer to bmp output
+    //if (print->printheader) {
+    //  // Print title at the top of the page.
+    //  Filetimetotext(&print->modified,ts,sizeof(ts));
+    //  n=sprintf(s,"%.64s [%s, %i bytes] - page %i of %i",
+    //    print->superdata.name,ts,print->origsize,print->frompage+1,npages);
+    //  SelectObject(print->dc,print->hfont6);
+    //  TextOut(print->dc,print->borderleft+width/2,print->bordertop,s,n);
+    //  // Print info at the bottom of the page.
+    //  n=sprintf(s,"Recommended scanner resolution %i dots per inch",
+    //    max(print->ppix*3/dx,print->ppiy*3/dy));
+    //  SelectObject(print->dc,print->hfont10);
+    //  TextOut(print->dc,
+    //    print->borderleft+width/2,
+    //    print->bordertop+print->extratop+height+print->ppiy/24,s,n);
+    //  ;
+    //};
+    //// Transfer bitmap to paper and send page to printer.
+    //SetDIBitsToDevice(print->dc,
+    //  print->borderleft,print->bordertop+print->extratop,
+    //  width,height,0,0,0,height,bits,
+    //  (BITMAPINFO *)print->bmi,DIB_RGB_COLORS);
+    //EndPage(print->dc); 
+  }
+  else if (print->format==FMT_PDF) {
+    // Append pages to PDF. Page is placed on the paper as it would be
+    // printed.
+    for (i=0; i<n; i++) {
+      success=0;
+      if (job[i].length==0)
+        Reporterror("Low memory, can't create page");
+      else if (Pdfaddpage(&print->pdf,job[i].image,job[i].length,job[i].g4,
+        print->width,job[i].height,print->ppix,print->ppiy,
+        print->paperwidth,print->paperheight,
+        print->borderleft,print->bordertop)!=0)
+        Reporterror("Unable to save PDF file");
+      else
+        success=1;
       if (success==0) {
-        Reporterror("Unable to save bitmap");
+        for (; i<n; i++) {
+          if (job[i].image!=NULL) free(job[i].image); };
         Stopprinting(print);
-        return;
-      };
+        return; };
+      free(job[i].image);
+      print->frompage++;
+    }; }
+  else {
+    for (i=0; i<n; i++) {
+      if (Savepage(print,job[i].page,job[i].bits,job[i].height)!=0) {
+        Stopprinting(print);
+        return; };
+      // Page printed, proceed with next.
+      print->frompage++;
     };
-    // Page printed, proceed with next.
-    print->frompage++;
   };
 }
 
@@ -0,0 +1,243 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// PaperBack -- high density backups on the plain paper                       //
+//                                                                            //
+// Copyright (c) 2007 Oleh Yuschuk                                            //
+// ollydbg at t-online de (set Subject to 'paperback' or be filtered out!)    //
+//                                                                            //
+//                                                                            //
+// This file is part of PaperBack.                                            //
+//                                                                            //
+// Paperback is free software; you can redistribute it and/or modify it under //
+// the terms of the GNU General Public License as published by the Free       //
+// Software Foundation; either version 3 of the License, or (at your option)  //
+// any later version.                                                         //
+//                                                                            //
+// PaperBack is distributed in the hope that it will be useful, but WITHOUT   //
+// ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or      //
+// FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for   //
+// more details.                                                              //
+//                                                                            //
+// You should have received a copy of the GNU General Public License along    //
+// with this program. If not, see <http://www.gnu.org/licenses/>.             //
+//                                                                            //
+//                                                                            //
+// Note that bzip2 compression/decompression library, which is the part of    //
+// this project, is covered by different license, which, in my opinion, is    //
+// compatible with GPL.                                                       //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "paperbak.h"
+#include "Resource.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+// Report of the missing data. After each page and at the end of the run, the //
+// JSON file given by --report lists every incomplete file, and for each file //
+// every incomplete page. For pages that were partially read, it lists groups //
+// that can't be recovered, their missing blocks and the cells on the printed //
+// page where these blocks are located, so that only damaged part of the page //
+// must be rescanned. Lists are calculated from the bitmap of valid blocks,   //
+// nothing is kept in memory between the reports.                             //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+
+// Writes string to JSON file, with quotes and escapes. String is limited to n
+// characters.
+static void Writejsonstring(FILE *f,char *s,int n) {
+  int i;
+  fputc('"',f);
+  for (i=0; i<n && s[i]!='\0'; i++) {
+    if (s[i]=='"' || s[i]=='\\')
+      fprintf(f,"\\%c",s[i]);
+    else if ((uchar)s[i]<32)
+      fprintf(f,"\\u%04x",(uchar)s[i]);
+    else
+      fputc(s[i],f);
+    ;
+  };
+  fputc('"',f);
+};
+
+// Checks whether block is valid.
+static int Isvalid(t_fproc *pf,int index) {
+  return (pf->valid[index>>3] & (1<<(index & 7)))!=0;
+};
+
+// Calculates position of the block on the printed page, as in Renderpage().
+// Blocks of the group are placed into consecutive strings, each string starts
+// with superblock and is rotated so that blocks of the same group don't share
+// the column. Returns 0 on success and -1 if layout is unknown.
+static int Getcell(t_fproc *pf,int index,int *row,int *column) {
+  int nx,ngroup,page,n,nstring,i,j,k,rot;
+  uint64_t l;
+  nx=pf->ncolumn;
+  ngroup=pf->ngroup;
+  if (nx<=0 || ngroup<=0 || pf->pagesize<NDATA)
+    return -1;
+  page=index/(pf->pagesize/NDATA);
+  index-=page*(pf->pagesize/NDATA);
+  l=pf->datasize-(uint64_t)page*pf->pagesize;
+  if (l>pf->pagesize) l=pf->pagesize;
+  n=(l+NDATA-1)/NDATA;                 // Number of data blocks on page
+  nstring=(n+ngroup-1)/ngroup;         // Number of groups on page
+  i=index/ngroup;
+  j=index%ngroup;
+  k=j*(nstring+1);
+  if (nstring+1<nx)
+    k+=i+1;
+  else {
+    rot=(nx/(ngroup+1)*j-k%nx+nx)%nx;
+    k+=(i+1+rot)%(nstring+1); };
+  *row=k/nx+1;
+  *column=k%nx+1;
+  return 0;
+};
+
+// Writes missing groups and cells in the range of blocks.
+static void Writemissing(FILE *f,t_fproc *pf,int first,int last) {
+  int i,r,ngroup,ng,nb,row,column;
+  ngroup=max(pf->ngroup,1);
+  fprintf(f,",\n          \"groups\": [");
+  ng=0;
+  for (r=(first/ngroup)*ngroup; r<last; r+=ngroup) {
+    nb=0;
+    for (i=max(r,first); i<r+ngroup && i<last; i++) {
+      if (Isvalid(pf,i)) continue;
+      if (nb==0)
+        fprintf(f,"%s\n            { \"group\": %i, \"blocks\": [",
+        ng==0?"":",",r/ngroup);
+      fprintf(f,"%s%i",nb==0?"":", ",i);
+      nb++; };
+    if (nb>0) {
+      fprintf(f,"] }");
+      ng++;
+    };
+  };
+  fprintf(f,"%s]",ng==0?"":"\n          ");
+  if (Getcell(pf,first,&row,&column)!=0)
+    return;                            // Layout is unknown
+  fprintf(f,",\n          \"cells\": [");
+  nb=0;
+  for (i=first; i<last; i++) {
+    if (Isvalid(pf,i) || Getcell(pf,i,&row,&column)!=0) continue;
+    fprintf(f,"%s\n            { \"block\": %i, \"row\": %i, "
+      "\"column\": %i }",nb==0?"":",",i,row,column);
+    nb++; };
+  fprintf(f,"%s]",nb==0?"":"\n          ");
+};
+
+// Writes description of the incomplete file.
+static void Writefile(FILE *f,t_fproc *pf) {
+  int i,j,first,last,nvalid,paged,npage,nblockpage,nout;
+  fprintf(f,"\n    {\n      \"name\": ");
+  Writejsonstring(f,pf->name,(pf->mode & PBM_ENCRYPTED?32:64));
+  fprintf(f,",\n      \"blocks\": %i,\n      \"validblocks\": %i,\n"
+    "      \"recoveredblocks\": %i,\n      \"redundancy\": %i,\n"
+    "      \"pages\": %i,\n      \"columns\": %i,\n"
+    "      \"incompletepages\": [",
+    pf->nblock,pf->ndata,pf->recoveredblocks,pf->ngroup,
+    pf->npages,pf->ncolumn);
+  paged=(pf->pagesize>=NDATA && pf->pagedone!=NULL);
+  if (paged==0) {
+    // Copies were printed with different settings, pages are unknown. Report
+    // the whole file as a single page 0.
+    npage=1;
+    nblockpage=pf->nblock; }
+  else {
+    npage=pf->npages;
+    nblockpage=pf->pagesize/NDATA; };
+  nout=0;
+  for (i=0; i<npage; i++) {
+    if (paged && (pf->pagedone[i>>3] & (1<<(i & 7))))
+      continue;
+    first=i*nblockpage;
+    last=min(first+nblockpage,pf->nblock);
+    nvalid=0;
+    for (j=first; j<last; j++) {
+      if (Isvalid(pf,j)) nvalid++; };
+    if (nvalid==last-first)
+      continue;
+    fprintf(f,"%s\n        {\n          \"page\": %i,\n"
+      "          \"missingblocks\": %i,\n          \"partial\": %s",
+      nout==0?"":",",paged?i+1:0,last-first-nvalid,
+      nvalid>0?"true":"false");
+    // Page that was never read must be rescanned completely.
+    if (nvalid>0)
+      Writemissing(f,pf,first,last);
+    fprintf(f,"\n        }");
+    nout++; };
+  fprintf(f,"%s]\n    }",nout==0?"":"\n      ");
+};
+
+// Writes JSON report of the missing data to the file given by --report. File
+// is written under temporary name and then renamed, so that reader never sees
+// incomplete report. If final is 1, this is the last report of the run.
+void Writereport(int final) {
+  int slot,nfile,nout;
+  char path[MAXPATH+8];
+  FILE *f;
+  if (pb_report[0]=='\0')
+    return;
+  sprintf(path,"%.*s.tmp",MAXPATH-1,pb_report);
+  f=fopen(path,"w");
+  if (f==NULL) {
+    Reporterror("Unable to write report");
+    return; };
+  nfile=0;
+  for (slot=0; slot<pb_nfproc; slot++) {
+    if (pb_fproc[slot].busy) nfile++; };
+  fprintf(f,"{\n  \"final\": %s,\n  \"complete\": %s,\n  \"files\": [",
+    final?"true":"false",nfile==0?"true":"false");
+  nout=0;
+  for (slot=0; slot<pb_nfproc; slot++) {
+    if (pb_fproc[slot].busy==0) continue;
+    if (nout++>0) fputc(',',f);
+    Writefile(f,pb_fproc+slot); };
+  fprintf(f,"%s]\n}\n",nout==0?"":"\n  ");
+  if (fclose(f)!=0 || rename(path,pb_report)!=0) {
+    remove(path);
+    Reporterror("Unable to write report"); };
+  ;
+};
+
+// Lists incomplete pages of all files that are not yet restored. Pages that
+// are not necessary to extract file requested by --extract are omitted.
+void Listincomplete(void) {
+  int slot,i,n,start,nout;
+  char s[TEXTLEN];
+  t_fproc *pf;
+  for (slot=0; slot<pb_nfproc; slot++) {
+    pf=pb_fproc+slot;
+    if (pf->busy==0 || pf->pagedone==NULL) continue;
+    n=sprintf(s,"%.*s: incomplete pages",
+      (pf->mode & PBM_ENCRYPTED?32:64),pf->name);
+    start=-1;
+    nout=0;
+    for (i=0; i<=pf->npages; i++) {
+      if (i<pf->npages && (pf->pagedone[i>>3] & (1<<(i & 7)))==0 &&
+        Pageneeded(pf,i+1)) {
+        if (start<0) start=i;
+        continue; };
+      if (start<0)
+        continue;
+      if (n>TEXTLEN-32) {
+        strcpy(s+n,", ...");
+        break; };
+      if (i-1==start)
+        n+=sprintf(s+n,"%s %i",nout==0?"":",",start+1);
+      else
+        n+=sprintf(s+n,"%s %i-%i",nout==0?"":",",start+1,i);
+      nout++;
+      start=-1; };
+    if (nout>0)
+      Message(s,0);
+    ;
+  };
+};
@@ -39,74 +39,377 @@
 #include "paperbak.h"
 #include "Resource.h"
 
+// Colour scans are converted to gray with SSSE3, if processor supports it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SCAN_SSSE3
+#include <tmmintrin.h>
+#endif
 
 
 
-// Processes data from the scanner.
-int ProcessDIB(void *hdata,int offset) {
-  int i,j,sizex,sizey,ncolor;
-  uchar scale[256],*data,*pdata,*pbits;
-  BITMAPINFO *pdib;
-  pdib=(BITMAPINFO *)hdata;
-  if (pdib==NULL)
-    return -1;                         // Something is wrong with this DIB
-  // Check that bitmap is more or less valid.
-  if (pdib->bmiHeader.biSize!=sizeof(BITMAPINFOHEADER) ||
-    pdib->bmiHeader.biPlanes!=1 ||
-    (pdib->bmiHeader.biBitCount!=8 && pdib->bmiHeader.biBitCount!=24) ||
-    (pdib->bmiHeader.biBitCount==24 && pdib->bmiHeader.biClrUsed!=0) ||
-    pdib->bmiHeader.biCompression!=BI_RGB ||
-    pdib->bmiHeader.biWidth<128 || pdib->bmiHeader.biWidth>32768 ||
-    pdib->bmiHeader.biHeight<128 || pdib->bmiHeader.biHeight>32768
-  ) {
-    //GlobalUnlock(hdata);
-    return -1; // Not a known bitmap!
-  };                      
-  sizex=pdib->bmiHeader.biWidth;
-  sizey=pdib->bmiHeader.biHeight;
-  ncolor=pdib->bmiHeader.biClrUsed;
-  // Convert bitmap to 8-bit grayscale. Note that scan lines are DWORD-aligned.
+
+// Sets weights (in 1/256) used to convert colour pixels to gray according to
+// the selected channel mode. Weights are in the order of bytes in the pixel,
+// which is B,G,R for bitmaps and R,G,B for PNM. Weights sum to 256.
+static void Setweights(int *w,int rgb) {
+  int t;
+  switch (pb_channel) {
+    case CH_LUMA:
+      w[0]=29; w[1]=150; w[2]=77; break;
+    case CH_GREEN:
+      w[0]=0; w[1]=256; w[2]=0; break;
+    case CH_RED:
+      w[0]=0; w[1]=0; w[2]=256; break;
+    case CH_BLUE:
+      w[0]=256; w[1]=0; w[2]=0; break;
+    default:
+      w[0]=85; w[1]=86; w[2]=85; break;
+    ;
+  };
+  if (rgb) {
+    t=w[0]; w[0]=w[2]; w[2]=t; };
+  ;
+};
+
+#ifdef SCAN_SSSE3
+
+// Returns 1 if processor supports SSSE3 instructions.
+static int Hasssse3(void) {
+  static int ssse3=-1;
+  if (ssse3<0)
+    ssse3=(__builtin_cpu_supports("ssse3")?1:0);
+  return ssse3;
+};
+
+// Converts packed 24-bit pixels to gray, 16 pixels at once. Three loads of 16
+// bytes are split into separate planes of the first, second and third colour
+// bytes, which are then weighted in 16-bit arithmetics. Returns number of
+// converted pixels, the rest must be converted by the caller.
+__attribute__((target("ssse3")))
+static int Convertrgbssse3(uchar *pbits,uchar *pdata,int sizex,int *w) {
+  int i;
+  __m128i a,b,c,p0,p1,p2,zero,rnd,w0,w1,w2,lo,hi;
+  const __m128i m00=_mm_setr_epi8(0,3,6,9,12,15,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+  const __m128i m01=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,2,5,8,11,14,-1,-1,-1,-1,-1);
+  const __m128i m02=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,1,4,7,10,13);
+  const __m128i m10=_mm_setr_epi8(1,4,7,10,13,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+  const __m128i m11=_mm_setr_epi8(-1,-1,-1,-1,-1,0,3,6,9,12,15,-1,-1,-1,-1,-1);
+  const __m128i m12=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,2,5,8,11,14);
+  const __m128i m20=_mm_setr_epi8(2,5,8,11,14,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1);
+  const __m128i m21=_mm_setr_epi8(-1,-1,-1,-1,-1,1,4,7,10,13,-1,-1,-1,-1,-1,-1);
+  const __m128i m22=_mm_setr_epi8(-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,0,3,6,9,12,15);
+  zero=_mm_setzero_si128();
+  rnd=_mm_set1_epi16(128);
+  w0=_mm_set1_epi16((short)w[0]);
+  w1=_mm_set1_epi16((short)w[1]);
+  w2=_mm_set1_epi16((short)w[2]);
+  for (i=0; i+16<=sizex; i+=16) {
+    a=_mm_loadu_si128((__m128i *)(pbits+3*i));
+    b=_mm_loadu_si128((__m128i *)(pbits+3*i+16));
+    c=_mm_loadu_si128((__m128i *)(pbits+3*i+32));
+    p0=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a,m00),
+      _mm_shuffle_epi8(b,m01)),_mm_shuffle_epi8(c,m02));
+    p1=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a,m10),
+      _mm_shuffle_epi8(b,m11)),_mm_shuffle_epi8(c,m12));
+    p2=_mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(a,m20),
+      _mm_shuffle_epi8(b,m21)),_mm_shuffle_epi8(c,m22));
+    // Maximal sum is 255*256+128, it fits into unsigned 16 bits.
+    lo=_mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(p0,zero),w0),
+      _mm_mullo_epi16(_mm_unpacklo_epi8(p1,zero),w1)),
+      _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(p2,zero),w2),rnd));
+    hi=_mm_add_epi16(
+      _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(p0,zero),w0),
+      _mm_mullo_epi16(_mm_unpackhi_epi8(p1,zero),w1)),
+      _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(p2,zero),w2),rnd));
+    _mm_storeu_si128((__m128i *)(pdata+i),
+      _mm_packus_epi16(_mm_srli_epi16(lo,8),_mm_srli_epi16(hi,8)));
+  };
+  return i;
+};
+
+#endif
+
+// Converts sizex colour pixels, step bytes each, to gray with weights w.
+static void Convertrgb(uchar *pbits,uchar *pdata,int sizex,int step,int *w) {
+  int i;
+  i=0;
+#ifdef SCAN_SSSE3
+  if (step==3 && Hasssse3())
+    i=Convertrgbssse3(pbits,pdata,sizex,w);
+  ;
+#endif
+  for (pbits+=i*step; i<sizex; i++) {
+    pdata[i]=(uchar)((pbits[0]*w[0]+pbits[1]*w[1]+pbits[2]*w[2]+128)>>8);
+    pbits+=step; };
+  ;
+};
+
+// Converts one scan line of the bitmap with 1, 4, 8, 24 or 32 bits per pixel to
+// 8-bit grayscale. Scale translates palette indices to gray levels, NULL means
+// that 8-bit bitmap is already grayscale. Colour pixels are weighted with w.
+static void Convertrow(uchar *pbits,uchar *pdata,int sizex,int bitcount,
+  uchar *scale,int *w) {
+  int i;
+  switch (bitcount) {
+    case 1:
+      for (i=0; i<sizex; i++)
+        *pdata++=scale[(pbits[i>>3]>>(7-(i & 7))) & 1];
+      break;
+    case 4:
+      for (i=0; i<sizex; i++)
+        *pdata++=scale[(pbits[i>>1]>>((i & 1)?0:4)) & 15];
+      break;
+    case 8:
+      if (scale==NULL)
+        memcpy(pdata,pbits,sizex);
+      else {
+        for (i=0; i<sizex; i++)
+          *pdata++=scale[*pbits++];
+        ;
+      };
+      break;
+    case 32:
+      Convertrgb(pbits,pdata,sizex,4,w);
+      break;
+    default:
+      Convertrgb(pbits,pdata,sizex,3,w);
+      break;
+    ;
+  };
+};
+
+// Builds palette translation table for the bitmap with ncolor colours.
+// Returns 1 if bitmap is grayscale and needs no translation, 0 otherwise.
+static int Makescale(uchar *scale,RGBQUAD *palette,int ncolor,int *w) {
+  int i,identity;
+  identity=1;
+  for (i=0; i<256; i++) {
+    if (i<ncolor)
+      scale[i]=(uchar)((palette[i].rgbBlue*w[0]+palette[i].rgbGreen*w[1]+
+        palette[i].rgbRed*w[2]+128)>>8);
+    else if (ncolor==0)
+      scale[i]=(uchar)i;
+    else
+      scale[i]=0;
+    if (scale[i]!=i) identity=0; };
+  return identity;
+};
+
+
+
+// Reads unsigned decimal number from the header of PNM file, skipping
+// whitespaces and comments. Returns number or -1 on error.
+static int Readpnmnumber(FILE *f) {
+  int c,n;
+  c=getc(f);
+  while (c=='#' || c==' ' || c=='\t' || c=='\r' || c=='\n') {
+    if (c=='#') {
+      while (c!='\n' && c!=EOF) c=getc(f); };
+    c=getc(f); };
+  if (c<'0' || c>'9')
+    return -1;
+  n=0;
+  while (c>='0' && c<='9') {
+    if (n>=0x1000000) return -1;
+    n=n*10+c-'0';
+    c=getc(f); };
+  // Exactly one whitespace character separates header from the data.
+  if (c!=' ' && c!='\t' && c!='\r' && c!='\n')
+    return -1;
+  return n;
+};
+
+// Reads binary PBM, PGM or PPM image (P4, P5 or P6) from the current position
+// in the file row by row, converts it to 8-bit grayscale and starts decoding.
+// File size is not necessary, so PNM may come from the pipe. Returns 0 on
+// success and -1 on error.
+static int Decodepnm(FILE *f) {
+  int i,j,type,sizex,sizey,maxval,bps,rowsize,w[3];
+  uint32_t v;
+  uchar scale[256],*data,*row,*pdata;
+  if (getc(f)!='P')
+    return -1;
+  type=getc(f);
+  if (type!='4' && type!='5' && type!='6') {
+    Reporterror("Unsupported PNM type, only binary PNM is allowed");
+    return -1; };
+  sizex=Readpnmnumber(f);
+  sizey=Readpnmnumber(f);
+  maxval=(type=='4'?1:Readpnmnumber(f));
+  if (sizex<128 || sizex>32768 || sizey<128 || sizey>32768 ||
+    maxval<1 || maxval>65535) {
+    Reporterror("Unsupported PNM bitmap");
+    return -1; };
+  bps=(maxval>255?2:1);
+  if (type=='4')
+    rowsize=(sizex+7)/8;
+  else if (type=='5')
+    rowsize=sizex*bps;
+  else
+    rowsize=sizex*bps*3;
+  for (i=0; i<256; i++)
+    scale[i]=(uchar)(min(i,maxval)*255/maxval);
+  Setweights(w,1);
   data=(uchar *)malloc(sizex*sizey);
-  if (data==NULL) {
-    //GlobalUnlock(hdata);
+  row=(uchar *)malloc(rowsize);
+  if (data==NULL || row==NULL) {
+    if (data!=NULL) free(data);
+    if (row!=NULL) free(row);
+    Reporterror("Low memory");
     return -1; };
-  if (pdib->bmiHeader.biBitCount==8) {
-    // 8-bit bitmap with palette.
-    if (ncolor>0) {
-      for (i=0; i<ncolor; i++) {
-        scale[i]=(uchar)((pdib->bmiColors[i].rgbBlue+
-        pdib->bmiColors[i].rgbGreen+pdib->bmiColors[i].rgbRed)/3);
+  // PNM rows go from top to bottom, whereas decoder expects bitmap in the
+  // BMP order. 16-bit samples are big-endian. 8-bit gray rows with full range
+  // need no conversion and are read directly into the bitmap.
+  for (j=0; j<sizey; j++) {
+    pdata=data+(size_t)(sizey-j-1)*sizex;
+    if (fread(type=='5' && maxval==255?pdata:row,1,rowsize,f)!=
+      (size_t)rowsize) {
+      free(data); free(row);
+      Reporterror("Unable to read PNM bitmap");
+      return -1; };
+    if (type=='5' && maxval==255)
+      continue;
+    if (type=='4') {
+      for (i=0; i<sizex; i++)
+        pdata[i]=((row[i>>3]>>(7-(i & 7))) & 1)?0:255; }
+    else if (bps==1 && type=='5') {
+      for (i=0; i<sizex; i++)
+        pdata[i]=scale[row[i]]; }
+    else if (bps==1) {
+      Convertrgb(row,pdata,sizex,3,w);
+      if (maxval!=255) {
+        for (i=0; i<sizex; i++)
+          pdata[i]=scale[pdata[i]];
+        ;
       }; }
+    else if (type=='5') {
+      for (i=0; i<sizex; i++)
+        pdata[i]=(uchar)(((row[2*i]<<8)+row[2*i+1])*255/maxval); }
     else {
-      for (i=0; i<256; i++) scale[i]=(uchar)i; };
-    if (offset==0)
-      offset=sizeof(BITMAPINFOHEADER)+ncolor*sizeof(RGBQUAD);
-    pdata=data;
-    for (j=0; j<sizey; j++) {
-      offset=(offset+3) & 0xFFFFFFFC;
-      pbits=((uchar *)(pdib))+offset;
-      for (i=0; i<sizex; i++) {
-        *pdata++=scale[*pbits++]; };
-      offset+=sizex;
-    }; }
-  else {
-    // 24-bit bitmap without palette.
-    if (offset==0)
-      offset=sizeof(BITMAPINFOHEADER)+ncolor*sizeof(RGBQUAD);
-    pdata=data;
-    for (j=0; j<sizey; j++) {
-      offset=(offset+3) & 0xFFFFFFFC;
-      pbits=((uchar *)(pdib))+offset;
       for (i=0; i<sizex; i++) {
-        *pdata++=(uchar)((pbits[0]+pbits[1]+pbits[2])/3);
-        pbits+=3; };
-      offset+=sizex*3;
+        v=((row[6*i]<<8)+row[6*i+1])*w[0]+((row[6*i+2]<<8)+row[6*i+3])*w[1]+
+          ((row[6*i+4]<<8)+row[6*i+5])*w[2];
+        pdata[i]=(uchar)((v>>8)*255/maxval); };
+      ;
+    };
+  };
+  free(row);
+  // Decode bitmap.
+  Decodegrids(data,sizex,sizey);
+  return 0;
+};
+
+
+
+// Skips n bytes in the file. Works with pipes. Returns 0 on success and -1
+// on error.
+static int Skipbytes(FILE *f,uint32_t n) {
+  uchar buf[256];
+  uint32_t l;
+  while (n>0) {
+    l=min(n,sizeof(buf));
+    if (fread(buf,1,l,f)!=l) return -1;
+    n-=l; };
+  return 0;
+};
+
+// Reads BMP file from the current position scan line by scan line and
+// converts lines directly into 8-bit grayscale. File is read sequentially in
+// chunks of approximately BMPCHUNK bytes, so it may come from the pipe, and
+// raw bitmap is never kept in memory. Both bottom-up and top-down bitmaps
+// are supported. Returns 0 on success and -1 on error.
+static int Decodebmp(FILE *f) {
+  int j,k,n,sizex,sizey,topdown,bitcount,ncolor,nrows,direct,w[3];
+  uint32_t pos;
+  uint64_t end;
+  size_t rowsize;
+  uchar scale[256],*pscale,*data,*buf;
+  RGBQUAD palette[256];
+  BITMAPFILEHEADER bfh;
+  BITMAPINFOHEADER bih;
+  if (fread(&bfh,sizeof(bfh),1,f)!=1 || fread(&bih,sizeof(bih),1,f)!=1) {
+    Reporterror("Unable to read bitmap");
+    return -1; };
+  bitcount=bih.biBitCount;
+  topdown=(bih.biHeight<0);
+  sizex=bih.biWidth;
+  sizey=(topdown?-bih.biHeight:bih.biHeight);
+  // Newer bitmap headers (V4, V5) are longer, but start with the same fields.
+  if (bfh.bfType!=CHAR_BM ||
+    bih.biSize<sizeof(BITMAPINFOHEADER) || bih.biSize>1024 ||
+    bih.biPlanes!=1 ||
+    (bitcount!=1 && bitcount!=4 && bitcount!=8 &&
+    bitcount!=24 && bitcount!=32) ||
+    (bitcount<=8 && bih.biClrUsed>(1u<<bitcount)) ||
+    bih.biCompression!=BI_RGB ||
+    sizex<128 || sizex>32768 || sizey<128 || sizey>32768
+  ) {
+    Reporterror("Unsupported bitmap type");
+    return -1; };
+  pos=sizeof(bfh)+bih.biSize;
+  if (Skipbytes(f,bih.biSize-sizeof(BITMAPINFOHEADER))!=0) {
+    Reporterror("Unable to read bitmap");
+    return -1; };
+  // Read palette. If palette is missing, 8-bit bitmap is grayscale.
+  ncolor=0;
+  if (bitcount<=8) {
+    ncolor=(bih.biClrUsed!=0?bih.biClrUsed:(1<<bitcount));
+    if (bfh.bfOffBits<pos+ncolor*sizeof(RGBQUAD))
+      ncolor=(bfh.bfOffBits>pos?(bfh.bfOffBits-pos)/sizeof(RGBQUAD):0);
+    ;
+  };
+  if (ncolor>0 &&
+    fread(palette,sizeof(RGBQUAD),ncolor,f)!=(size_t)ncolor) {
+    Reporterror("Unable to read bitmap");
+    return -1; };
+  pos+=ncolor*sizeof(RGBQUAD);
+  Setweights(w,0);
+  pscale=scale;
+  if (Makescale(scale,palette,ncolor,w) && bitcount==8)
+    pscale=NULL;
+  // Go to the bitmap bits.
+  if (bfh.bfOffBits<pos || Skipbytes(f,bfh.bfOffBits-pos)!=0) {
+    Reporterror("Unable to read bitmap");
+    return -1; };
+  // Allocate grayscale bitmap and read buffer. Scan lines are DWORD-aligned.
+  rowsize=(((size_t)sizex*bitcount+31)/32)*4;
+  nrows=max(BMPCHUNK/rowsize,1);
+  // Bottom-up grayscale bitmap without padding is read in place.
+  direct=(pscale==NULL && !topdown && rowsize==(size_t)sizex);
+  data=(uchar *)malloc((size_t)sizex*sizey);
+  buf=(direct?NULL:(uchar *)malloc(nrows*rowsize));
+  if (data==NULL || (buf==NULL && !direct)) {
+    if (data!=NULL) free(data);
+    if (buf!=NULL) free(buf);
+    Reporterror("Low memory");
+    return -1; };
+  // Read and convert bitmap. Decoder expects bottom-up order.
+  for (j=0; j<sizey; j+=n) {
+    n=min(nrows,sizey-j);
+    if (fread(direct?data+(size_t)j*sizex:buf,rowsize,n,f)!=(size_t)n) {
+      free(data);
+      if (buf!=NULL) free(buf);
+      Reporterror("Unable to read bitmap");
+      return -1; };
+    if (direct)
+      continue;
+    for (k=0; k<n; k++) {
+      Convertrow(buf+k*rowsize,
+        data+(size_t)(topdown?sizey-1-(j+k):j+k)*sizex,
+        sizex,bitcount,pscale,w);
+      ;
     };
   };
-  // Decode bitmap. This is what we are for here.
-  Startbitmapdecoding(&pb_procdata,data,sizex,sizey);
-  // Free original bitmap and report success.
-  //GlobalUnlock(hdata);
+  if (buf!=NULL) free(buf);
+  // Some programs pad the file after the bits. Skip the padding, so that the
+  // next bitmap from the pipe starts at the correct position. Error means that
+  // the file is shorter than told by the header, this is not a problem.
+  end=bfh.bfOffBits+(uint64_t)rowsize*sizey;
+  if (bfh.bfSize>end)
+    Skipbytes(f,bfh.bfSize-end);
+  // Decode bitmap.
+  Decodegrids(data,sizex,sizey);
   return 0;
 };
 
@@ -114,12 +417,9 @@ int ProcessDIB(void *hdata,int offset) {
 
 // Opens and decodes bitmap. Returns 0 on success and -1 on error.
 int Decodebitmap(char *path) {
-  int i,size;
+  int i;
   char s[TEXTLEN+MAXPATH],fil[MAXFILE],ext[MAXEXT];
-  uchar *data,buf[sizeof(BITMAPFILEHEADER)+sizeof(BITMAPINFOHEADER)];
   FILE *f;
-  BITMAPFILEHEADER *pbfh;
-  BITMAPINFOHEADER *pbih;
   //HCURSOR prevcursor;
   // Ask for file name.
   //if (path==NULL || path[0]=='\0') {
@@ -127,11 +427,22 @@ int Decodebitmap(char *path) {
   //else {
   strncpy(pb_inbmp,path,sizeof(pb_inbmp));
   pb_inbmp[sizeof(pb_inbmp)-1]='\0';
+  // Standard input may contain several bitmaps, one after another. End of
+  // data is not an error.
+  if (strcmp(pb_inbmp,"-")==0) {
+    i=getc(stdin);
+    if (i==EOF)
+      return -1;
+    ungetc(i,stdin);
+    Message("Reading standard input...",0);
+    if (i=='P')
+      return Decodepnm(stdin);
+    return Decodebmp(stdin); };
   fnsplit(pb_inbmp,NULL,NULL,fil,ext);
   sprintf(s,"Reading %s%s...",fil,ext);
   Message(s,0);
   //Updatebuttons();
-  // Open file and verify that this is the valid bitmap of known type.
+  // Open file.
   f=fopen(pb_inbmp,"rb");
   if (f==NULL) {                       // Unable to open file
     sprintf(s,"Unable to open %s%s",fil,ext);
@@ -140,45 +451,15 @@ int Decodebitmap(char *path) {
   // Reading 100-MB bitmap may take many seconds. Let's inform user by changing
   // mouse pointer.
   //prevcursor=SetCursor(LoadCursor(NULL,IDC_WAIT));
-  i=fread(buf,1,sizeof(buf),f);
+  // PNM bitmaps start with 'P'.
+  i=getc(f);
+  ungetc(i,f);
+  if (i=='P')
+    i=Decodepnm(f);
+  else
+    i=Decodebmp(f);
   //SetCursor(prevcursor);
-  if (i!=sizeof(buf)) {                // Unable to read file
-    sprintf(s,"Unable to read %s%s",fil,ext);
-    Reporterror(s);
-    fclose(f); 
-    return -1; 
-  };
-  pbfh=(BITMAPFILEHEADER *)buf;
-  pbih=(BITMAPINFOHEADER *)(buf+sizeof(BITMAPFILEHEADER));
-  if (pbfh->bfType!=CHAR_BM ||
-    pbih->biSize!=sizeof(BITMAPINFOHEADER) || pbih->biPlanes!=1 ||
-    (pbih->biBitCount!=8 && pbih->biBitCount!=24) ||
-    (pbih->biBitCount==24 && pbih->biClrUsed!=0) ||
-    pbih->biCompression!=BI_RGB ||
-    pbih->biWidth<128 || pbih->biWidth>32768 ||
-    pbih->biHeight<128 || pbih->biHeight>32768
-  ) {                                  // Invalid bitmap type
-    sprintf(s,"Unsupported bitmap type: %s%s",fil,ext);
-    Reporterror(s);
-    fclose(f); return -1; };
-  // Allocate buffer and read file.
-  fseek(f,0,SEEK_END);
-  size=ftell(f)-sizeof(BITMAPFILEHEADER);
-  data=(uchar *)malloc(size);
-  if (data==NULL) {                    // Unable to allocate memory
-    Reporterror("Low memory");
-    fclose(f); return -1; };
-  fseek(f,sizeof(BITMAPFILEHEADER),SEEK_SET);
-  i=fread(data,1,size,f);
   fclose(f);
-  if (i!=size) {                       // Unable to read bitmap
-    sprintf(s,"Unable to read %s%s",fil,ext);
-    Reporterror(s);
-    free(data);
-    return -1; };
-  // Process bitmap.
-  ProcessDIB(data,pbfh->bfOffBits-sizeof(BITMAPFILEHEADER));
-  free(data);
-  return 0;
+  return i;
 };
 
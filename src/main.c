@@ -56,23 +56,42 @@
 
 
 // Global forward declarations
-t_fproc   pb_fproc[NFILE];        // Processed file
+t_fproc   *pb_fproc;              // Processed files, grows as necessary
+int       pb_nfproc;               // Number of entries in pb_fproc
 int       pb_resx, pb_resy;        // Printer resolution, dpi (may be 0!)
 t_printdata pb_printdata;          // Print control structure
 int       pb_orientation;          // Orientation of bitmap (-1: unknown)
+int       pb_decodescale;          // Bitmap reduction (0: auto, 1: never)
 t_procdata pb_procdata;            // Descriptor of processed data
 char      pb_infile[MAXPATH];      // Last selected file to read
 char      pb_outbmp[MAXPATH];      // Last selected bitmap to save
 char      pb_inbmp[MAXPATH];       // Last selected bitmap to read
 char      pb_outfile[MAXPATH];     // Last selected data file to save
 char      pb_password[PASSLEN];    // Encryption password
+int       pb_pwdsource;            // Source of password, one of PWD_xxx
+char      pb_pwdarg[MAXPATH];      // Descriptor, file or variable name
+int       pb_pwdvalid;             // Batch password is in pb_password
 int       pb_dpi;                  // Dot raster, dots per inch
 int       pb_dotpercent;           // Dot size, percent of dpi
-int       pb_compression;          // 0: none, 1: fast, 2: maximal
+int       pb_compression;          // 0: none, 1: fast, 2: maximal, 3: auto
+int       pb_threads;              // Number of worker threads
+int       pb_multistream;          // Compress as independent streams
+int       pb_format;               // Output format, one of FMT_xxx
+int       pb_channel;              // Colour to gray conversion, one of CH_xxx
+int       pb_stdin;                // Bitmaps are read from standard input
+int       pb_stdout;               // Data goes to stdout, messages to stderr
 int       pb_redundancy;           // Redundancy (NGROUPMIN..NGROUPMAX)
+int       pb_pageparity;           // Parity pages per stripe (0..NPARMAX)
+int       pb_columngroups;         // Group blocks also along strings
 int       pb_printheader;          // Print header and footer
 int       pb_printborder;          // Border around bitmap
 int       pb_autosave;             // Autosave completed files
+int       pb_resume;               // Resume from checkpoint
+int       pb_emitshard;            // Write recognized blocks to shard
+char      pb_report[MAXPATH];      // JSON report of missing data or empty
+char      pb_extract[MAXPATH];     // File to extract from archive or empty
+int       pb_narchive;             // Number of inputs packed into archive
+char      **pb_archive;            // Files and directories to pack
 int       pb_bestquality;          // Determine best quality
 int       pb_encryption;           // Encrypt data before printing
 int       pb_opentext;             // Enter passwords in open text
@@ -91,15 +110,30 @@ int arguments (int ac, char **av);
 void dhelp (const char *exe);
 void dversion();
 void nextBitmap (char *path);
+int inputlist (int argc, char **argv, char ***list);
 
 // Enumerator types
 enum Mode {
   MODE_ENCODE,
   MODE_DECODE,
+  MODE_MERGE,
   MODE_VERSION,
   MODE_HELP
 };
 
+// Options that have no short form
+enum Longopt {
+  ARG_PASSWORDFD = 256,
+  ARG_PASSWORDFILE,
+  ARG_PASSWORDENV,
+  ARG_FORMAT,
+  ARG_CHANNEL,
+  ARG_DECODESCALE,
+  ARG_REPORT,
+  ARG_PAGEPARITY,
+  ARG_EXTRACT
+};
+
 
 
 int main (int argc, char ** argv) {
@@ -114,43 +148,94 @@ int main (int argc, char ** argv) {
     pb_dpi         = 200;
     pb_dotpercent  = 70;
     pb_redundancy  = 5;
+    pb_pageparity  = 0;
     pb_printheader = 0;
     pb_printborder = 0;
+    pb_pwdsource   = PWD_PROMPT;
+    pb_compression = 0;
+    pb_threads     = 1;
+    pb_format      = FMT_BMP;
+    pb_channel     = CH_AVG;
+    pb_decodescale = 0;
 
     int mode = arguments (argc, argv);
-    if (mode == MODE_ENCODE) {
-        printf ("Encoding %s to create %s\n"
+    if (mode == MODE_ENCODE && pb_stdin) {
+        fprintf (stderr, "error: input file can't be read from stdin\n");
+    }
+    else if (mode == MODE_ENCODE) {
+        // Several inputs or a directory are packed into a single archive.
+        if (optind < argc || Isdirectory (pb_infile)) {
+          pb_narchive = inputlist (argc, argv, &pb_archive);
+          if (pb_narchive < 0)
+            return 1;
+        }
+        fprintf (pb_stdout ? stderr : stdout,
+                "Encoding %s to create %s\n"
                 "DPI: %d\n"
                 "Dot percent: %d\n"
                 "Redundancy: 1:%d\n"
+                "Parity pages per stripe: %d\n"
+                "Compression: %d\n"
+                "Threads: %d\n"
                 "Print header/footer: %d\n"
                 "Print border: %d\n",
                 pb_infile, pb_outbmp,
-                pb_dpi, pb_dotpercent, pb_redundancy,
+                pb_dpi, pb_dotpercent, pb_redundancy, pb_pageparity,
+                pb_compression, pb_threads,
                 pb_printheader, pb_printborder);
 
         Printfile (pb_infile, pb_outbmp);
         while (pb_printdata.step != 0) {
             Nextdataprintingstep (&pb_printdata);
         }
+        free (pb_archive);
+        pb_archive = NULL;
+        pb_narchive = 0;
     }
     else if (mode == MODE_DECODE) {
         char drv[MAXDRIVE],dir[MAXDIR],nam[MAXFILE],ext[MAXEXT],path[MAXPATH+32];
         fnsplit (pb_infile, drv, dir, nam, ext);
         int i;
-        if (pb_npages > 0) {
-          for (int i = 0; i < pb_npages; i++) {
-            sprintf(path,"%s%s%s_%04i%s",drv,dir,nam,i+1,ext);
-            Decodebitmap (path);
+        if (pb_resume && Resumecheckpoint () != 0)
+          return 1;
+        if (pb_resume == 0 && Newcheckpoint () != 0)
+          return 1;
+        if (pb_stdin) {
+          // Standard input may contain any number of concatenated bitmaps.
+          while (Decodebitmap ("-") == 0) {
             while (pb_procdata.step != 0) {
-              nextBitmap (path);
+              Nextdataprocessingstep (&pb_procdata);
             }
           }
         }
+        else if (pb_npages > 0) {
+          for (int i = 0; i < pb_npages; i++) {
+            sprintf(path,"%s%s%s_%04i%s",drv,dir,nam,i+1,ext);
+            nextBitmap (path);
+          }
+        }
         else {
           sprintf(path,"%s%s%s%s",drv,dir,nam,ext);
           nextBitmap (path);
         }
+        Listincomplete ();
+        Writereport (1);
+        Closecheckpoint ();
+        Clearkeycache ();
+    }
+    else if (mode == MODE_MERGE) {
+        // Shards are given with -i and as any number of extra arguments.
+        char **shards;
+        int nshard = inputlist (argc, argv, &shards);
+        if (nshard < 0)
+          return 1;
+        int result = Mergeshards (nshard, shards);
+        free (shards);
+        Listincomplete ();
+        Writereport (1);
+        Closecheckpoint ();
+        Clearkeycache ();
+        return (result == 0 ? 0 : 1);
     }
     else if (mode == MODE_VERSION) {
       dversion(argv[0]);
@@ -165,7 +250,8 @@ int main (int argc, char ** argv) {
 
 
 inline void nextBitmap (char *path) {
-  printf ("Decoding %s into %s\n", path, pb_outfile);
+  fprintf (pb_stdout ? stderr : stdout,
+           "Decoding %s into %s\n", path, pb_outfile);
   Decodebitmap (path);
   while (pb_procdata.step != 0) {
     Nextdataprocessingstep (&pb_procdata);
@@ -174,15 +260,41 @@ inline void nextBitmap (char *path) {
 
 
 
+// Collects the input given with -i and all arguments that follow the options
+// into the newly allocated list. Returns number of inputs or -1 on error.
+int inputlist (int argc, char **argv, char ***list) {
+  int n = 0;
+  *list = (char **) malloc ((argc - optind + 1) * sizeof (char *));
+  if (*list == NULL) {
+    fprintf (stderr, "error: low memory\n");
+    return -1;
+  }
+  if (pb_infile[0] != '\0')
+    (*list)[n++] = pb_infile;
+  for (int i = optind; i < argc; i++)
+    (*list)[n++] = argv[i];
+  return n;
+}
+
+
+
 inline void dhelp (const char *exe) {
     printf("%s\n\n"
             "Usage:\n"
             "\t%s --encode -i [infile] -o [out].bmp [OPTION...]\n"
+            "\t%s --encode -i [dir] -o [out].bmp [OPTION...] [file]...\n"
             "\t%s --decode -i [in].bmp -o [outfile]\n"
             "\t%s --decode -i [in].bmp -o [outfile] -p [nPages]\n"
+            "\t%s --decode -i [in].bmp -o [outfile] -p [nPages] --extract [name]\n"
+            "\t%s --decode --emit-shard -i [in].bmp -o [shard] -p [nPages]\n"
+            "\t%s --merge -o [outfile] [shard] [shard]...\n"
             "\t--encode             Create a bitmap from the input file\n"
             "\t--decode             Decode an encoded bitmap/folder of bitmaps\n"
-            "\t-i, --input          File to encode to or decode from\n"
+            "\t--merge              Merge shards and save restored file\n"
+            "\t--emit-shard         Save recognized blocks to the shard instead of\n"
+            "\t                     restoring file, shards can be merged later\n"
+            "\t-i, --input          File to encode to or decode from. Directory or several\n"
+            "\t                     files are encoded as archive with table of contents\n"
             "\t-o, --output         Newly encoded bitmap or decoded file\n"
             "\t-p, --pages          Number of pages (e.g. bitmaps labeled 0001 through 0029)\n"
             "\t-d, --dpi            Dots per inch of the output bitmap (40 to 600)\n"
@@ -190,14 +302,46 @@ inline void dhelp (const char *exe) {
             "\t                     size in pixels, (50 to 100)\n"
             "\t-r, --redundancy     Data redundancy ratio of input or output bitmap as a\n"
             "\t                     reciprocal, (2 to 10)\n"
+            "\t--page-parity        Add K parity pages per stripe of up to 240 pages, any\n"
+            "\t                     K lost pages of the stripe can be rebuilt, (0 to 15)\n"
+            "\t--column-groups      Protect blocks also by groups along the strings, so that\n"
+            "\t                     streaks and folds are recovered; page holds less data\n"
+            "\t-c, --compression    Compress data before encoding, 0: none, 1: fast,\n"
+            "\t                     2: maximal, auto: only if data is compressible\n"
+            "\t-t, --threads        Number of worker threads; pages are drawn in parallel,\n"
+            "\t                     output doesn't depend on the number of threads\n"
+            "\t--multistream        Compress data as independent bzip2 streams, packed on\n"
+            "\t                     all threads; can't be decoded by older versions\n"
             "\t-n, --no-header      Disable printing of file name, last modify date and time,\n"
             "\t                     file size, and page number\n"
             "\t-b, --border         Print a black border around the page\n"
+            "\t--format             Output format, bmp: 8-bit bitmap, bmp1: 1-bit bitmap,\n"
+            "\t                     pdf: all pages in a single PDF file, pgm or pbm:\n"
+            "\t                     8-bit or 1-bit PNM. Use - as input or output file\n"
+            "\t                     to read bitmaps from stdin or write data to stdout\n"
+            "\t--channel            How colour scans are converted to gray, avg: average,\n"
+            "\t                     luma: perceived brightness, green, red or blue:\n"
+            "\t                     single channel (green is often cleaner with colour toner)\n"
+            "\t--decode-scale       Reduce oversampled scans before decoding, auto:\n"
+            "\t                     select automatically, 1: never, 2 to 8: factor\n"
+            "\t--resume             Continue interrupted decoding from the checkpoint saved\n"
+            "\t                     next to the output file; restored pages are skipped\n"
+            "\t--extract            Restore only the named file from the archive; if archive\n"
+            "\t                     is not compressed, only pages with its data are decoded\n"
+            "\t--report             Write JSON list of incomplete pages, unrecoverable groups\n"
+            "\t                     and cells to rescan after each page and at the end\n"
+            "\t--password-fd        Read decryption password once from file descriptor\n"
+            "\t--password-file      Read decryption password once from file\n"
+            "\t--password-env       Take decryption password from environment variable\n"
             "\t-v, --version        Display version and information about that version\n"
             "\t-h, --help           Display all arguments and program description\n\n",
             "\nEncodes or decodes high-density printable file backups.\n",
             exe,
             exe,
+            exe,
+            exe,
+            exe,
+            exe,
             exe);
 }
 
@@ -228,6 +372,7 @@ int arguments (int ac, char **av) {
         // options that set flags
         {"encode",      no_argument, &mode, MODE_ENCODE},
         {"decode",      no_argument, &mode, MODE_DECODE},
+        {"merge",       no_argument, &mode, MODE_MERGE},
         // options that assign values in switch
         {"input",       required_argument, NULL,  'i'},
         {"output",      required_argument, NULL,  'o'},
@@ -235,8 +380,23 @@ int arguments (int ac, char **av) {
         {"dpi",         required_argument, NULL,  'd'},
         {"dotsize",     required_argument, NULL,  's'},
         {"redundancy",  required_argument, NULL,  'r'},
+        {"page-parity", required_argument, NULL,  ARG_PAGEPARITY},
+        {"column-groups", no_argument, &pb_columngroups, 1},
+        {"compression", required_argument, NULL,  'c'},
+        {"threads",     required_argument, NULL,  't'},
+        {"multistream", no_argument, &pb_multistream, 1},
         {"no-header",   no_argument, NULL,        'n'},
         {"border",      no_argument, NULL,        'b'},
+        {"format",      required_argument, NULL,  ARG_FORMAT},
+        {"channel",     required_argument, NULL,  ARG_CHANNEL},
+        {"decode-scale", required_argument, NULL, ARG_DECODESCALE},
+        {"resume",      no_argument, &pb_resume,  1},
+        {"emit-shard",  no_argument, &pb_emitshard, 1},
+        {"report",      required_argument, NULL,  ARG_REPORT},
+        {"extract",     required_argument, NULL,  ARG_EXTRACT},
+        {"password-fd", required_argument, NULL,  ARG_PASSWORDFD},
+        {"password-file", required_argument, NULL, ARG_PASSWORDFILE},
+        {"password-env", required_argument, NULL, ARG_PASSWORDENV},
         {"version",     no_argument, NULL,        'v'},
         {"help",        no_argument, NULL,        'h'},
         {0, 0, 0, 0}
@@ -244,7 +404,7 @@ int arguments (int ac, char **av) {
     int c;
     while(is_ok) {
         int options_index = 0;
-        c = getopt_long (ac, av, "i:o:p:f:d:s:r:nbvh", long_options, &options_index);
+        c = getopt_long (ac, av, "i:o:p:f:d:s:r:c:t:nbvh", long_options, &options_index);
         if (c == -1) {
             break;
         }
@@ -288,6 +448,16 @@ int arguments (int ac, char **av) {
                 if (optarg != NULL)
                   pb_redundancy  = atoi(optarg);
                 break;
+            case 'c':
+                if (optarg != NULL && strcmp (optarg, "auto") == 0)
+                  pb_compression = 3;
+                else if (optarg != NULL)
+                  pb_compression = atoi(optarg);
+                break;
+            case 't':
+                if (optarg != NULL)
+                  pb_threads     = atoi(optarg);
+                break;
             case 'n':
                 if (optarg != NULL)
                   pb_printheader = !(atoi(optarg));
@@ -296,6 +466,75 @@ int arguments (int ac, char **av) {
                 if (optarg != NULL)
                   pb_printborder = atoi(optarg);
                 break;
+            case ARG_FORMAT:
+                if (optarg != NULL && strcmp (optarg, "bmp") == 0)
+                  pb_format = FMT_BMP;
+                else if (optarg != NULL && strcmp (optarg, "bmp1") == 0)
+                  pb_format = FMT_BMP1;
+                else if (optarg != NULL && strcmp (optarg, "pdf") == 0)
+                  pb_format = FMT_PDF;
+                else if (optarg != NULL && strcmp (optarg, "pgm") == 0)
+                  pb_format = FMT_PGM;
+                else if (optarg != NULL && strcmp (optarg, "pbm") == 0)
+                  pb_format = FMT_PBM;
+                else
+                  pb_format = -1;
+                break;
+            case ARG_CHANNEL:
+                if (optarg != NULL && strcmp (optarg, "avg") == 0)
+                  pb_channel = CH_AVG;
+                else if (optarg != NULL && strcmp (optarg, "luma") == 0)
+                  pb_channel = CH_LUMA;
+                else if (optarg != NULL && strcmp (optarg, "green") == 0)
+                  pb_channel = CH_GREEN;
+                else if (optarg != NULL && strcmp (optarg, "red") == 0)
+                  pb_channel = CH_RED;
+                else if (optarg != NULL && strcmp (optarg, "blue") == 0)
+                  pb_channel = CH_BLUE;
+                else
+                  pb_channel = -1;
+                break;
+            case ARG_DECODESCALE:
+                if (optarg != NULL && strcmp (optarg, "auto") == 0)
+                  pb_decodescale = 0;
+                else if (optarg != NULL)
+                  pb_decodescale = atoi(optarg);
+                break;
+            case ARG_PAGEPARITY:
+                if (optarg != NULL)
+                  pb_pageparity  = atoi(optarg);
+                break;
+            case ARG_REPORT:
+                if (optarg == NULL || strlen (optarg) >= MAXPATH - 8) {
+                    fprintf(stderr, "error: invalid report file \n");
+                    is_ok = false;
+                } else
+                  strcpy (pb_report, optarg);
+                break;
+            case ARG_EXTRACT:
+                if (optarg == NULL || optarg[0] == '\0' ||
+                    strlen (optarg) >= ARCHNAME) {
+                    fprintf(stderr, "error: invalid name to extract \n");
+                    is_ok = false;
+                } else
+                  strcpy (pb_extract, optarg);
+                break;
+            case ARG_PASSWORDFD:
+            case ARG_PASSWORDFILE:
+            case ARG_PASSWORDENV:
+                if (optarg == NULL || strlen (optarg) >= MAXPATH) {
+                    fprintf(stderr, "error: invalid password source \n");
+                    is_ok = false;
+                } else {
+                    if (c == ARG_PASSWORDFD)
+                      pb_pwdsource = PWD_FD;
+                    else if (c == ARG_PASSWORDFILE)
+                      pb_pwdsource = PWD_FILE;
+                    else
+                      pb_pwdsource = PWD_ENV;
+                    strcpy (pb_pwdarg, optarg);
+                }
+                break;
             case 'v':
                 // as soon as -v encountered, return version mode
                 return MODE_VERSION;
@@ -307,7 +546,7 @@ int arguments (int ac, char **av) {
                 return MODE_HELP;
         }
     }
-    if (strlen (pb_infile) == 0) {
+    if (strlen (pb_infile) == 0 && (mode != MODE_MERGE || optind >= ac)) {
         fprintf (stderr, "error: no input file given\n");
         return MODE_HELP;
     }
@@ -315,6 +554,8 @@ int arguments (int ac, char **av) {
         fprintf (stderr, "error: no output file given\n");
         return MODE_HELP;
     }
+    pb_stdin = (strcmp (pb_infile, "-") == 0);
+    pb_stdout = (strcmp (pb_outfile, "-") == 0);
     if (pb_npages < 0 || pb_npages > 9999) {
         fprintf (stderr, "error: invalid number of pages given\n");
         return MODE_HELP;
@@ -331,6 +572,46 @@ int arguments (int ac, char **av) {
         fprintf (stderr, "error: invalid redundancy given\n");
         return MODE_HELP;
     }
+    if (pb_pageparity < 0 || pb_pageparity > NPARMAX) {
+        fprintf (stderr, "error: invalid number of parity pages given\n");
+        return MODE_HELP;
+    }
+    if (pb_compression < 0 || pb_compression > 3) {
+        fprintf (stderr, "error: invalid compression given\n");
+        return MODE_HELP;
+    }
+    if (pb_threads < 1 || pb_threads > 64) {
+        fprintf (stderr, "error: invalid number of threads given\n");
+        return MODE_HELP;
+    }
+    if (pb_format < 0) {
+        fprintf (stderr, "error: invalid output format given\n");
+        return MODE_HELP;
+    }
+    if (pb_decodescale < 0 || pb_decodescale > 8) {
+        fprintf (stderr, "error: invalid decode scale given\n");
+        return MODE_HELP;
+    }
+    if (pb_channel < 0) {
+        fprintf (stderr, "error: invalid colour channel given\n");
+        return MODE_HELP;
+    }
+    if (pb_emitshard && (pb_stdout || pb_resume)) {
+        fprintf (stderr, "error: shard must be written to a file\n");
+        return MODE_HELP;
+    }
+    if (pb_extract[0] != '\0' && (mode != MODE_DECODE && mode != MODE_MERGE)) {
+        fprintf (stderr, "error: files are extracted only while decoding\n");
+        return MODE_HELP;
+    }
+    if (pb_extract[0] != '\0' && pb_emitshard) {
+        fprintf (stderr, "error: file can't be extracted into shard\n");
+        return MODE_HELP;
+    }
+    if (pb_format == FMT_PDF && pb_stdout) {
+        fprintf (stderr, "error: PDF can't be written to stdout\n");
+        return MODE_HELP;
+    }
     if (pb_printheader < 0 || pb_printheader > 1) {
         fprintf (stderr, "error: invalid header setting given\n");
         return MODE_HELP;
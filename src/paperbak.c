@@ -15,6 +15,8 @@
  * =====================================================================================
  */
 #include <stdlib.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "paperbak.h"
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -23,7 +25,7 @@
 
 void Reporterror(const char *input) 
 {
-  printf("%s\n", input);
+  fprintf(pb_stdout?stderr:stdout, "%s\n", input);
 }
 
 
@@ -31,24 +33,25 @@ void Reporterror(const char *input)
 void Message(const char *input, int progress) 
 {
   //printf("%s @ %d\%\n", input, progress);
-  printf("%s\n", input);
+  fprintf(pb_stdout?stderr:stdout, "%s\n", input);
 }
 
 
 
-// Formerly standard case insentitive cstring compare
+// Formerly standard case insentitive cstring compare. Strings need not be
+// null-terminated if they are at least len characters long.
 int strnicmp (const char *str1, const char *str2, size_t len)
 {
-  char s1[len], s2[len];
-  strcpy (s1, str1);
-  strcpy (s2, str2);
-  for (int i = 0; i < len; i++) {
-      s1[i] = tolower(s1[i]);
-      s2[i] = tolower(s1[i]);
-      if (s1[i] < s2[i])      //s1 less than s2, return negative
+  int c1, c2;
+  for (size_t i = 0; i < len; i++) {
+      c1 = tolower((uchar)str1[i]);
+      c2 = tolower((uchar)str2[i]);
+      if (c1 < c2)            //s1 less than s2, return negative
         return -1;
-      else if (s1[i] > s2[i]) //s1 more than s2, return positive
+      else if (c1 > c2)       //s1 more than s2, return positive
         return 1;
+      else if (c1 == '\0')
+        break;
   }
 
   // if all characters are the same, return 0
@@ -57,19 +60,89 @@ int strnicmp (const char *str1, const char *str2, size_t len)
 
 
 
+// Reads batch password from the source selected on the command line. Password
+// is read only once and then reused for all encrypted files, so that batch
+// restore needs neither terminal nor repeated input. Returns 0 on success and
+// -1 on error.
+static int Getbatchpassword()
+{
+  int fd,n,status;
+  char *env,pw[PASSLEN+2];
+  if (pb_pwdvalid)
+    return 0;                          // Already read
+  n=0;
+  if (pb_pwdsource==PWD_ENV) {
+    env=getenv(pb_pwdarg);
+    if (env==NULL) {
+      Reporterror("Password variable is not set");
+      return -1; };
+    n=strlen(env);
+    if (n>PASSLEN) n=PASSLEN;
+    memcpy(pw,env,n); }
+  else {
+    if (pb_pwdsource==PWD_FD)
+      fd=atoi(pb_pwdarg);
+    else
+      fd=open(pb_pwdarg,O_RDONLY);
+    if (fd<0) {
+      Reporterror("Unable to open password source");
+      return -1; };
+    // Read up to the first line break. Descriptor may be a pipe, so that I
+    // can't read more than necessary.
+    while (n<PASSLEN+1 && read(fd,pw+n,1)==1) {
+      if (pw[n]=='\n') break;
+      n++; };
+    if (pb_pwdsource==PWD_FILE)
+      close(fd);
+    if (n>0 && pw[n-1]=='\r') n--;
+  };
+  status=-1;
+  if (n==0)
+    Reporterror("Password is empty");
+  else if (n>PASSLEN-1)
+    Reporterror("Password must be 32 characters or less");
+  else {
+    memset(pb_password,0,sizeof(pb_password));
+    memcpy(pb_password,pw,n);
+    pb_pwdvalid=1;
+    status=0; };
+  memset(pw,0,sizeof(pw));
+  return status;
+}
+
+
+
+// Wipes password, unless it is the batch password that must be reused
+void Clearpassword(void)
+{
+  if (pb_pwdsource==PWD_PROMPT)
+    memset(pb_password,0,sizeof(pb_password));
+}
+
+
+
 // returns 0 on success, -1 on failure
 int Getpassword()
 {
+  if (pb_pwdsource!=PWD_PROMPT)
+    return Getbatchpassword();
   // LINUX-ONLY, deprecated, and only gets 8 character long password
   //char * pw = getpass("Enter encryption password: ");
   //int pwLength = strlen(pw);
 
+  // Standard input may carry bitmaps.
+  if (pb_stdin) {
+    Reporterror("Can't ask for password, use --password-fd, --password-file "
+      "or --password-env");
+    return -1;
+  }
   // Crossplatform
-  printf ("Enter encryption password: ");
+  FILE *tty = (pb_stdout ? stderr : stdout);
+  fprintf (tty, "Enter encryption password: ");
   char pw[PASSLEN];
   int pwLength = 0;
   char ch = '\0';
-  printf ("\033[8m"); //set terminal to hide typing
+  fprintf (tty, "\033[8m"); //set terminal to hide typing
   while (pwLength < PASSLEN) {
     ch = getchar();
     if (ch == '\r' || ch == '\n' || ch == EOF)
@@ -82,30 +155,81 @@ int Getpassword()
 
     ++pwLength;
   }
-  printf ("\033[28m"); //set terminal to display typing
+  fprintf (tty, "\033[28m\n"); //set terminal to display typing
  
   int status = -1;
-  printf ("strlen(pw): %i\n", strlen(pw));
-  fwrite (pw, PASSLEN, 1, stdout);
-  printf ("\n");
-  if (pwLength > 0 && pwLength <= (PASSLEN - 1) ) {
-    // put password into global password variable
-    memcpy (pb_password, pw, PASSLEN);
-    status = 0; //success
+  if (pwLength == 0) {
+    Reporterror("Password is empty");
+    status = -1; //failure
   }
-  else {
+  else if (pwLength > (PASSLEN - 1)) {
     Reporterror("Password must be 32 characters or less");
     status = -1; //failure
   }
+  else {
+    // put password into global password variable
+    memcpy (pb_password, pw, PASSLEN);
+    status = 0; //success
+  }
   
-  printf ("strlen(pb_password): %i\n", strlen(pb_password));
-  fwrite (pb_password, PASSLEN, 1, stdout);
-  printf ("\n");
   // overwrite pw for security FIXME with random data
   memset (pw, 0, PASSLEN);
   return status;
 }
 
+typedef struct t_parallel {            // Shared state of Parallelfor()
+  int            n;                    // Number of calls
+  int            next;                 // Index of next call
+  void           (*fn)(void *,int);    // Called function
+  void           *arg;                 // First argument of fn
+  pthread_mutex_t mutex;               // Protects next
+} t_parallel;
+
+static void *Parallelthread(void *arg) {
+  int i;
+  t_parallel *pp=(t_parallel *)arg;
+  while (1) {
+    pthread_mutex_lock(&pp->mutex);
+    i=pp->next++;
+    pthread_mutex_unlock(&pp->mutex);
+    if (i>=pp->n) break;
+    pp->fn(pp->arg,i); };
+  return NULL;
+}
+
+
+
+// Calls fn(arg,i) for i=0..n-1, distributing calls among nthread threads.
+// Calling thread works, too. Returns when all calls are finished. If threads
+// can't be created, remaining work is done by the calling thread.
+void Parallelfor(int n,int nthread,void (*fn)(void *,int),void *arg)
+{
+  int i,nstarted;
+  pthread_t thread[64];
+  t_parallel par;
+  if (nthread>n) nthread=n;
+  if (nthread>64) nthread=64;
+  if (nthread<=1) {
+    for (i=0; i<n; i++) fn(arg,i);
+    return; };
+  par.n=n;
+  par.next=0;
+  par.fn=fn;
+  par.arg=arg;
+  pthread_mutex_init(&par.mutex,NULL);
+  for (nstarted=0; nstarted<nthread-1; nstarted++) {
+    if (pthread_create(thread+nstarted,NULL,Parallelthread,&par)!=0)
+      break;
+    ;
+  };
+  Parallelthread(&par);
+  for (i=0; i<nstarted; i++)
+    pthread_join(thread[i],NULL);
+  pthread_mutex_destroy(&par.mutex);
+}
+
+
+
 int max (int a, int b) 
 {
   return a > b ? a : b;